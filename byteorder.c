@@ -12,6 +12,7 @@
 /* this defines __BYTE_ORDER to __BIG_ENDIAN or __LITTLE_ENDIAN */
 #include <endian.h> 
 #include "byteorder.h"
+#include "uzixfs.h"
 
 #define BYTE0(a) (a&0xff)
 #define BYTE1(a) ((a>>8)&0xff)
@@ -29,6 +30,10 @@ int read_u32(FILE *f, uint32_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_reads,1);
+  UZ_COUNT(bytes_read,n * sizeof(uint32_t));
+  uz_io(n * sizeof(uint32_t),0);
+
 #if __BYTE_ORDER == __BIG_ENDIAN
   for(i=0;i<n;i++) {
     a = d[i];
@@ -50,6 +55,10 @@ int read_s32(FILE *f, int32_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_reads,1);
+  UZ_COUNT(bytes_read,n * sizeof(int32_t));
+  uz_io(n * sizeof(int32_t),0);
+
 #if __BYTE_ORDER == __BIG_ENDIAN
   for(i=0;i<n;i++) {
     a = d[i];
@@ -71,6 +80,10 @@ int read_u16(FILE *f, uint16_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_reads,1);
+  UZ_COUNT(bytes_read,n * sizeof(uint16_t));
+  uz_io(n * sizeof(uint16_t),0);
+
 #if __BYTE_ORDER == __BIG_ENDIAN
   for(i=0;i<n;i++) {
     a = d[i];
@@ -92,6 +105,10 @@ int read_s16(FILE *f, int16_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_reads,1);
+  UZ_COUNT(bytes_read,n * sizeof(int16_t));
+  uz_io(n * sizeof(int16_t),0);
+
 #if __BYTE_ORDER == __BIG_ENDIAN
   for(i=0;i<n;i++) {
     a = d[i];
@@ -129,6 +146,10 @@ int read_u8(FILE *f, uint8_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_reads,1);
+  UZ_COUNT(bytes_read,n * sizeof(uint8_t));
+  uz_io(n * sizeof(uint8_t),0);
+
   return 0;
 }
 
@@ -139,6 +160,10 @@ int read_s8(FILE *f, int8_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_reads,1);
+  UZ_COUNT(bytes_read,n * sizeof(int8_t));
+  uz_io(n * sizeof(int8_t),0);
+
   return 0;
 }
 
@@ -160,6 +185,10 @@ int write_s32(FILE *f, int32_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_writes,1);
+  UZ_COUNT(bytes_written,n * sizeof(int32_t));
+  uz_io(n * sizeof(int32_t),1);
+
 #if __BYTE_ORDER == __BIG_ENDIAN
   free(d);
 #endif
@@ -184,6 +213,10 @@ int write_u16(FILE *f, uint16_t *d, int n) {
   if (r != n)
     return -1;
 
+  UZ_COUNT(field_writes,1);
+  UZ_COUNT(bytes_written,n * sizeof(uint16_t));
+  uz_io(n * sizeof(uint16_t),1);
+
 #if __BYTE_ORDER == __BIG_ENDIAN
   free(d);
 #endif
@@ -195,5 +228,9 @@ int write_u8(FILE *f, uint8_t *d, int n) {
   r = fwrite((void *) d, sizeof(uint8_t), n, f);
   if (r != n)
     return -1;
+
+  UZ_COUNT(field_writes,1);
+  UZ_COUNT(bytes_written,n * sizeof(uint8_t));
+  uz_io(n * sizeof(uint8_t),1);
   return 0;
 }
@@ -75,51 +75,15 @@ void tick() {
   }
 }
 
-int rdsize(char *x) {
-  int ll, v;
-  char cp[32];
-  ll = strlen(x) - 1;
-  strcpy(cp, x);
-  
-  switch(x[ll]) {
-  case 'b':
-    cp[ll] = 0;
-    v = atoi(cp);
-    v *= 512;
-    break;
-  case 'K':
-  case 'k':
-    cp[ll] = 0;
-    v = atoi(cp);
-    v *= 1024;
-    break;
-  default:
-    v = atoi(cp);
-  }
-
-  if (v%512) {
-    fprintf(stderr,"sizes must be multiples of 512 bytes (block size)\n");
-    v = -1;
-  }
-  if (v < 0) v=-1;
-  return v;
-}
-
 /* mkuzixfs [-q] [-o name] [-f spec] [-i spec] [-r spec] */
 int main(int argc, char **argv) {
-  int i,j;
+  int i;
   FILE *dsk;
-  uint8_t buf[512];
   int fb,ib,rb;
   uz_sblock sb;
-  uz_inode  inode;
-
-  uz_direntry rdir[2] = {
-    { UZ_ROOT, "." },
-    { UZ_ROOT, ".."}
-  };
 
   uz_global_opt(argc, argv);
+  argc = uz_stats_opt(argc, argv);
   
   strcpy(ofile,"newuzix.dsk");
   fsize = 720 * 1024;
@@ -134,9 +98,9 @@ int main(int argc, char **argv) {
     }
     if (i==argc-1) { usage(); return 1; }   
     if (!strcmp(argv[i],"-o")) { strcpy(ofile,argv[++i]); continue; }
-    if (!strcmp(argv[i],"-f")) { fsize = rdsize(argv[++i]); continue; }
-    if (!strcmp(argv[i],"-i")) { isize = rdsize(argv[++i]); continue; }
-    if (!strcmp(argv[i],"-r")) { rsize = rdsize(argv[++i]); continue; }
+    if (!strcmp(argv[i],"-f")) { fsize = uz_parse_size(argv[++i]); continue; }
+    if (!strcmp(argv[i],"-i")) { isize = uz_parse_size(argv[++i]); continue; }
+    if (!strcmp(argv[i],"-r")) { rsize = uz_parse_size(argv[++i]); continue; }
   }
 
   if (fsize < 0 || rsize < 0 || isize < 0) {
@@ -144,11 +108,16 @@ int main(int argc, char **argv) {
     return 2;
   }
 
-  if (rsize+isize+1024 > fsize) {
+  if (rsize+isize+1024 >= fsize) {
     fprintf(stderr,"** isize and rsize too large to fsize\n\n");
     return 2;
   }
 
+  if (fsize/512 > 65535) {
+    fprintf(stderr,"** fsize too large (at most 65535 blocks)\n\n");
+    return 2;
+  }
+
   if (!quiet)
     printf("mkuzixfs v1.0 - written by Felipe Bergo\n");
 
@@ -165,80 +134,11 @@ int main(int argc, char **argv) {
   fb = fsize / 512;
   ib = isize / 512;
   rb = rsize / 512;
-  memset(buf,0,512);
 
-  /* initialize the full length with zeros */
   tick();
-  for(i=0;i<fb;i++)
-    if (fwrite(buf, 1, 512, dsk) != 512) goto ioerror;
-  
-  /* write boot sector */
-  if (fseek(dsk,0,SEEK_SET)!=0) goto ioerror;
   bootblock[0x10] = rb;
+  if (uz_mkfs(dsk,&sb,fb,ib,rb,(uint8_t *) bootblock)!=0) goto ioerror;
   tick();
-  if (fwrite(bootblock, 1, 512, dsk) != 512) goto ioerror;
-
-  /* prepare superblock */
-  memset(&sb, 0, sizeof(sb));
-  sb.s_mounted = UZ_SBSIG;
-  sb.s_reserv  = rb + 2;
-  sb.s_isize   = ib;
-  sb.s_fsize   = fb;
-
-  sb.s_tinode  = ib * UZ_IPB - 2;
-  
-  /* build free list */
-  tick();
-  j = fb - 1;
-  while(j > 2 + rb + ib) {
-    if (sb.s_nfree == 50) {
-      tick();
-      if (fseek(dsk,j*512,SEEK_SET)!=0) goto ioerror;
-      if (write_u16(dsk, &(sb.s_nfree), 1)!=0) goto ioerror;
-      if (write_u16(dsk, &(sb.s_free[0]), 50)!=0) goto ioerror;
-      sb.s_nfree = 0;
-      memset(sb.s_free,0,100);
-    }
-    sb.s_tfree++;
-    sb.s_free[sb.s_nfree++] = j--;
-  }
-
-  /* write root dir inode (1) */
-  memset(&inode, 0, sizeof(inode));
-  inode.i_mode    = UZ_IFDIR | 0755;
-  inode.i_nlink   = 3;
-  inode.i_size    = 16 * 2;
-  inode.i_addr[0] = 2 + rb + ib;
-  tick();
-  if (uz_write_inode(dsk,&sb,UZ_ROOT,&inode)!=0) goto ioerror; 
-
-  /* write root dir data */
-  tick();
-  if (fseek(dsk,(sb.s_reserv+ib)*512,SEEK_SET)!=0) goto ioerror;
-  if (write_u16(dsk,&(rdir[0].d_ino),1)!=0)        goto ioerror;
-  if (write_u8(dsk, &(rdir[0].d_name[0]),14)!=0)   goto ioerror;
-  if (write_u16(dsk,&(rdir[1].d_ino),1)!=0)        goto ioerror;
-  if (write_u8(dsk, &(rdir[1].d_name[0]),14)!=0)   goto ioerror;
-  
-  /* write reserved inode (0) */
-  memset(&inode, 0, sizeof(inode));
-  inode.i_nlink = 1;
-  inode.i_mode  = ~0;
-  tick();
-  if (uz_write_inode(dsk,&sb,0,&inode)!=0) goto ioerror; 
-
-  /* free inodes in first inode block */
-  j = UZ_ROOT+1;
-  while (j < UZ_IPB) {
-    if (sb.s_ninode == 50)
-      break;
-    sb.s_inode[sb.s_ninode++] = j++;
-  }
-  
-  /* write superblock */
-  uz_time(&(sb.s_time));
-  tick();
-  uz_write_sblock(dsk,&sb);
   fclose(dsk);
 
   if (!quiet)
@@ -11,7 +11,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "uzixdir.h"
+#include "byteorder.h"
+
+#define UZ_DPB (UZ_BLOCKSZ / UZ_DIRELEN)
 
 int  uz_iopendir(uz_ino_t inode, FILE *f, uz_sblock *sb, uz_dir *dir) {
   dir->sb   = sb;
@@ -47,45 +54,63 @@ void uz_rewinddir(uz_dir *dir) {
   dir->next = 0;
 }
 
-int  uz_readdir(uz_dir *dir, uz_direntry *dentry) {
-  if (dir->next >= dir->count)
-    return -1;
-  if (uz_read_data(dir->dsk,&(dir->inode), 
-		   UZ_DIRELEN * dir->next, UZ_DIRELEN, (void *) dentry) < 0)
-    return -1;
-
-  if (dentry->d_ino == 0) {
-    dir->count = dir->next;
-    return -1;
-  }
+static int uz_do_readdir(uz_dir *dir, uz_direntry *dentry) {
+  do {
+    if (dir->next >= dir->count)
+      return -1;
+    if (uz_read_data(dir->dsk,&(dir->inode), 
+		     UZ_DIRELEN * dir->next, UZ_DIRELEN, (void *) dentry) < 0)
+      return -1;
+    ++(dir->next);
+  } while(dentry->d_ino == 0); /* skip empty slots */
 
-  ++(dir->next);
   return 0;
 }
 
+int  uz_readdir(uz_dir *dir, uz_direntry *dentry) {
+  uint64_t t = uz_lat_begin();
+  int slot = dir->next, tr = uz_trace_enter();
+  int r = uz_do_readdir(dir,dentry);
+  uz_trace_leave(tr,UZ_TR_READDIR,&(dir->inode),slot,0,0,0);
+  uz_lat_end(UZ_LAT_READDIR,t);
+  return r;
+}
+
 void uz_closedir(uz_dir *dir) {
   /* nothing needs to be done */
 }
 
-int  uz_istat(uz_ino_t inode, FILE *f, uz_sblock *sb, uz_stat *ostat) {
+static void uz_fill_stat(uz_ino_t inode, uz_inode *x, uz_stat *ostat) {
+  ostat->st_ino   = inode;
+  ostat->st_mode  = x->i_mode;
+  ostat->st_nlink = x->i_nlink;
+  ostat->st_uid   = x->i_uid;
+  ostat->st_gid   = x->i_gid;
+  ostat->st_size  = x->i_size;
+  memcpy(&(ostat->st_atime),&(x->i_atime),sizeof(uz_time_t));
+  memcpy(&(ostat->st_mtime),&(x->i_mtime),sizeof(uz_time_t));
+  memcpy(&(ostat->st_ctime),&(x->i_ctime),sizeof(uz_time_t));
+}
+
+static int uz_do_istat(uz_ino_t inode, FILE *f, uz_sblock *sb, uz_stat *ostat) {
   uz_inode xinode;
 
   if (uz_read_inode(f,sb,inode,&xinode) != 0)
     return -1;
 
-  ostat->st_ino   = inode;
-  ostat->st_mode  = xinode.i_mode;
-  ostat->st_nlink = xinode.i_nlink;
-  ostat->st_uid   = xinode.i_uid;
-  ostat->st_gid   = xinode.i_gid;
-  ostat->st_size  = xinode.i_size;
-  memcpy(&(ostat->st_atime),&(xinode.i_atime),sizeof(uz_time_t));
-  memcpy(&(ostat->st_mtime),&(xinode.i_mtime),sizeof(uz_time_t));
-  memcpy(&(ostat->st_ctime),&(xinode.i_ctime),sizeof(uz_time_t));
-
+  uz_fill_stat(inode,&xinode,ostat);
   return 0;
 }
 
+int  uz_istat(uz_ino_t inode, FILE *f, uz_sblock *sb, uz_stat *ostat) {
+  uint64_t t = uz_lat_begin();
+  int tr = uz_trace_enter();
+  int r = uz_do_istat(inode,f,sb,ostat);
+  uz_trace_leave(tr,UZ_TR_ISTAT,0,inode,0,0,0);
+  uz_lat_end(UZ_LAT_ISTAT,t);
+  return r;
+}
+
 int  uz_fstat(char *path, FILE *f, uz_sblock *sb, uz_stat *ostat) {
   int i;
 
@@ -95,13 +120,159 @@ int  uz_fstat(char *path, FILE *f, uz_sblock *sb, uz_stat *ostat) {
   return(uz_istat(i,f,sb,ostat));
 }
 
+static int uz_cmp_blkno(const void *a, const void *b) {
+  return *(const uz_blkno_t *) a - *(const uz_blkno_t *) b;
+}
+
+static int uz_do_readdirplus(uz_dir *dir, uz_direntplus **ents) {
+  uz_sblock  *sb = dir->sb;
+  uz_direntry *raw = 0;
+  uz_direntplus *e = 0;
+  uz_blkno_t *blk = 0;
+  uz_ioreq   *req = 0;
+  uint8_t    *ib = 0;
+  uz_inode    x;
+  uz_ino_t    ino;
+  int i, n, k, nb, lo, hi, mid;
+
+  *ents = 0;
+  n = dir->count - dir->next;
+  if (n <= 0) return 0;
+
+  raw = (uz_direntry *) malloc(n * sizeof(uz_direntry));
+  e   = (uz_direntplus *) malloc(n * sizeof(uz_direntplus));
+  blk = (uz_blkno_t *) malloc(n * sizeof(uz_blkno_t));
+  if (!raw || !e || !blk) goto fail;
+
+  if (uz_read_data(dir->dsk,&(dir->inode),dir->next * UZ_DIRELEN,
+		   n * UZ_DIRELEN,(void *) raw) != n * UZ_DIRELEN)
+    goto fail;
+  dir->next = dir->count;
+
+  /* the inode blocks needed, each once, in ascending order */
+  for(i=k=nb=0;i<n;i++) {
+    if (raw[i].d_ino == 0) continue;
+    e[k++].entry = raw[i];
+    ino = u16_to_le(raw[i].d_ino);
+    if ((ino >> UZ_IPB_L2) < sb->s_isize)
+      blk[nb++] = sb->s_reserv + (ino >> UZ_IPB_L2);
+  }
+  n = k;
+  qsort(blk,nb,sizeof(uz_blkno_t),uz_cmp_blkno);
+  for(i=k=0;i<nb;i++)
+    if (!k || blk[i] != blk[k-1])
+      blk[k++] = blk[i];
+  nb = k;
+
+  req = (uz_ioreq *) malloc((nb + 1) * sizeof(uz_ioreq));
+  ib  = (uint8_t *) malloc((nb + 1) * UZ_BLOCKSZ);
+  if (!req || !ib) goto fail;
+  for(i=0;i<nb;i++) {
+    req[i].block = blk[i];
+    req[i].buf   = ib + i * UZ_BLOCKSZ;
+  }
+  if (uz_read_batch(dir->dsk,req,nb)!=0) goto fail;
+
+  for(i=0;i<n;i++) {
+    ino = u16_to_le(e[i].entry.d_ino);
+    e[i].st.st_ino = 0;
+    if ((ino >> UZ_IPB_L2) >= sb->s_isize) continue;
+    for(lo=0,hi=nb-1;lo<hi;) {
+      mid = (lo + hi) / 2;
+      if (blk[mid] < sb->s_reserv + (ino >> UZ_IPB_L2)) lo = mid + 1;
+      else hi = mid;
+    }
+    uz_decode_inode(ib + lo * UZ_BLOCKSZ + UZ_ILEN * (ino & UZ_IPB_MASK),&x);
+    uz_icache_put(dir->dsk,sb,ino,&x);
+    uz_fill_stat(ino,&x,&(e[i].st));
+  }
+
+  free(raw);
+  free(blk);
+  free(req);
+  free(ib);
+  if (!n) { /* only empty slots left */
+    free(e);
+    e = 0;
+  }
+  *ents = e;
+  return n;
+
+ fail:
+  free(raw);
+  free(e);
+  free(blk);
+  free(req);
+  free(ib);
+  return -1;
+}
+
+int  uz_readdirplus(uz_dir *dir, uz_direntplus **ents) {
+  uint64_t t = uz_lat_begin();
+  int slot = dir->next, tr = uz_trace_enter();
+  int r = uz_do_readdirplus(dir,ents);
+  uz_trace_leave(tr,UZ_TR_READDIRPLUS,&(dir->inode),slot,0,0,0);
+  uz_lat_end(UZ_LAT_READDIRPLUS,t);
+  return r;
+}
+
+/* name matching. a directory entry is 16 bytes, so the name to find
+   is laid out as one: key holds it at the offset of d_name, zero
+   padded, and mask selects its bytes and its terminator (if it has
+   one, a name may fill all 14 bytes). an entry matches if it is in
+   use and equal to key under mask, as strncmp(name,d_name,14) would
+   have it */
+typedef struct {
+  uint8_t key[UZ_DIRELEN];
+  uint8_t mask[UZ_DIRELEN];
+} uz_namekey;
+
+static int uz_name_key(char *name, uz_namekey *k) {
+  int n = strlen(name);
+  if (n > UZ_DIRNAMELEN) return -1;
+  memset(k,0,sizeof(uz_namekey));
+  memcpy(k->key + 2, name, n);
+  memset(k->mask + 2, 0xff, n < UZ_DIRNAMELEN ? n + 1 : n);
+  return 0;
+}
+
+/* first of the n entries at ent matching k, -1 if none */
+static int uz_name_find(uz_direntry *ent, int n, uz_namekey *k) {
+  int i;
+#ifdef __SSE2__
+  __m128i key = _mm_loadu_si128((__m128i *) k->key);
+  int want = _mm_movemask_epi8(_mm_loadu_si128((__m128i *) k->mask));
+  int eq;
+
+  for(i=0;i<n;i++) {
+    eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) &ent[i]),
+					  key));
+    if ((eq & want) == want && ent[i].d_ino != 0)
+      return i;
+  }
+#else
+  uint64_t key[2], mask[2], w[2];
+
+  memcpy(key, k->key, UZ_DIRELEN);
+  memcpy(mask, k->mask, UZ_DIRELEN);
+  for(i=0;i<n;i++) {
+    memcpy(w, &ent[i], UZ_DIRELEN);
+    if ((((w[0] ^ key[0]) & mask[0]) | ((w[1] ^ key[1]) & mask[1])) == 0 &&
+	ent[i].d_ino != 0)
+      return i;
+  }
+#endif
+  return -1;
+}
+
 /* FIXME: does not follow symlinks yet */
-int  uz_lookup(char *path, FILE *f, uz_sblock *sb) {
-  char        pelem[16];
-  int         i,j;
+static int uz_do_lookup(char *path, FILE *f, uz_sblock *sb) {
+  char        pelem[UZ_DIRNAMELEN+1];
+  int         i,j,k,n,s;
   uz_dir      parent;
   uz_ino_t    cnode, nnode;
-  uz_direntry entry;
+  uz_direntry blk[UZ_DPB];
+  uz_namekey  key;
 
   if (uz_openrootdir(f,sb,&parent) != 0)
     return -1;
@@ -110,23 +281,28 @@ int  uz_lookup(char *path, FILE *f, uz_sblock *sb) {
   i=0;
 
   for(;;) {
-    j=0; memset(pelem,0,16);
-    while(path[i]=='/' && path[i]!=0) ++i;
+    while(path[i]=='/') ++i;
 
     if (path[i] == 0) {
       uz_closedir(&parent);
       return cnode;
     }
 
-    while(path[i]!='/' && path[i]!=0) pelem[j++] = path[i++];
-    
-    /* find dir entry that matches pelem */
+    for(j=0;path[i]!='/' && path[i]!=0;i++)
+      if (j < UZ_DIRNAMELEN) pelem[j++] = path[i]; else return -1;
+    pelem[j] = 0;
+    uz_name_key(pelem,&key);
+
+    /* find dir entry that matches pelem, a block at a time */
     nnode = 0;
-    while(uz_readdir(&parent,&entry)==0) {
-      if (!strcmp(pelem, entry.d_name)) {
-	nnode = entry.d_ino;
-	break;
-      }      
+    for(k=0;k<parent.count && nnode==0;k+=n) {
+      n = parent.count - k;
+      if (n > UZ_DPB) n = UZ_DPB;
+      if (uz_read_data(f,&(parent.inode),k * UZ_DIRELEN,n * UZ_DIRELEN,
+		       (void *) blk) < 0)
+	return -1;
+      if ((s = uz_name_find(blk,n,&key)) >= 0)
+	nnode = u16_to_le(blk[s].d_ino);
     }
     if (nnode == 0)
       return -1; /* path element not found */
@@ -142,6 +318,725 @@ int  uz_lookup(char *path, FILE *f, uz_sblock *sb) {
 
 }
 
+int  uz_lookup(char *path, FILE *f, uz_sblock *sb) {
+  uint64_t t = uz_lat_begin();
+  int tr = uz_trace_enter();
+  int r = uz_do_lookup(path,f,sb);
+  uz_trace_leave(tr,UZ_TR_LOOKUP,0,0,0,path,0);
+  uz_lat_end(UZ_LAT_LOOKUP,t);
+  return r;
+}
+
+/* layout plan: directories breadth first from the root, then files
+   in the order they are found in them, then anything unreachable,
+   each one as a single run in uz_inode_layout order from the start
+   of the data area. fills newpos for uz_relocate and returns how many
+   blocks move, or -1 if some inode has bad or shared blocks */
+int uz_layout_plan(FILE *f, uz_sblock *sb, uz_blkno_t *newpos) {
+  uz_inode *table;
+  uz_blkno_t *seq;
+  uint8_t *seen;
+  int *order, *files;
+  int i, j, b, n, p, ino, lo, ninodes, norder = 0, nfiles = 0, moved = -1;
+  uz_dir d;
+  uz_direntry ent;
+
+  ninodes = sb->s_isize * UZ_IPB;
+  table = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  order = (int *) malloc(ninodes * sizeof(int));
+  files = (int *) malloc(ninodes * sizeof(int));
+  seen  = (uint8_t *) calloc(ninodes,1);
+  seq   = (uz_blkno_t *) malloc((UZ_MAXBLOCKS + UZ_MAXINDEX) * sizeof(uz_blkno_t));
+  if (!table || !order || !files || !seen || !seq) goto out;
+  if (uz_read_itable(f,sb,table)!=0) goto out;
+
+#define UZ_LIVE(i) (!(table[i].i_mode == 0 && table[i].i_nlink == 0))
+
+  seen[UZ_ROOT] = 1;
+  order[norder++] = UZ_ROOT;
+  for(i=0;i<norder;i++) {
+    if (uz_iopendir(order[i],f,sb,&d)!=0) continue;
+    while(uz_readdir(&d,&ent)==0) {
+      ino = u16_to_le(ent.d_ino);
+      if (ino <= 0 || ino >= ninodes || seen[ino] || !UZ_LIVE(ino)) continue;
+      seen[ino] = 1;
+      if ((table[ino].i_mode & UZ_IFMT) == UZ_IFDIR)
+	order[norder++] = ino;
+      else
+	files[nfiles++] = ino;
+    }
+    uz_closedir(&d);
+  }
+  for(i=0;i<nfiles;i++)
+    order[norder++] = files[i];
+  for(i=1;i<ninodes;i++)
+    if (!seen[i] && UZ_LIVE(i))
+      order[norder++] = i;
+
+#undef UZ_LIVE
+
+  memset(newpos,0,65536 * sizeof(uz_blkno_t));
+  lo = sb->s_reserv + sb->s_isize;
+  p = lo;
+  moved = 0;
+  for(i=0;i<norder && moved >= 0;i++) {
+    n = uz_inode_layout(f,sb,&table[order[i]],seq);
+    if (n < 0) moved = -1;
+    for(j=0;j<n && moved >= 0;j++) {
+      b = seq[j];
+      if (b < lo || b >= sb->s_fsize || newpos[b]) {
+	moved = -1;
+	break;
+      }
+      newpos[b] = p++;
+      if (newpos[b] != b) ++moved;
+    }
+  }
+
+ out:
+  free(table);
+  free(order);
+  free(files);
+  free(seen);
+  free(seq);
+  return moved;
+}
+
+/* names the inodes set in want with one breadth first walk from the
+   root: path[i] gets the first name met for inode i, malloc'd, and
+   stays 0 if there is none. the walk stops as soon as every wanted
+   inode has a name. returns how many got one, or -1 on error */
+int uz_inode_paths(FILE *f, uz_sblock *sb, uint8_t *want, char **path) {
+  uz_inode *table;
+  uint8_t *seen;
+  int *order;
+  int i, ino, ninodes, norder = 0, left = 0, named = -1;
+  char name[UZ_DIRNAMELEN+1], *p;
+  uz_dir d;
+  uz_direntry ent;
+
+  ninodes = sb->s_isize * UZ_IPB;
+  table = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  order = (int *) malloc(ninodes * sizeof(int));
+  seen  = (uint8_t *) calloc(ninodes,1);
+  if (!table || !order || !seen) goto out;
+  if (uz_read_itable(f,sb,table)!=0) goto out;
+
+  for(i=0;i<ninodes;i++) {
+    path[i] = 0;
+    if (want[i]) ++left;
+  }
+  named = 0;
+
+  seen[UZ_ROOT] = 1;
+  order[norder++] = UZ_ROOT;
+  path[UZ_ROOT] = strdup("/");
+  if (!path[UZ_ROOT]) goto out;
+  if (want[UZ_ROOT]) {
+    ++named;
+    --left;
+  }
+
+  for(i=0;i<norder && left > 0;i++) {
+    if (uz_iopendir(order[i],f,sb,&d)!=0) continue;
+    while(uz_readdir(&d,&ent)==0 && left > 0) {
+      ino = u16_to_le(ent.d_ino);
+      if (ino <= 0 || ino >= ninodes || seen[ino]) continue;
+      memset(name,0,sizeof(name));
+      memcpy(name,ent.d_name,UZ_DIRNAMELEN);
+      if (!strcmp(name,".") || !strcmp(name,"..")) continue;
+      seen[ino] = 1;
+
+      /* directories need a name to pass on to their entries, even
+	 when they are not wanted themselves */
+      if ((table[ino].i_mode & UZ_IFMT) == UZ_IFDIR)
+	order[norder++] = ino;
+      else if (!want[ino])
+	continue;
+
+      p = (char *) malloc(strlen(path[order[i]]) + UZ_DIRNAMELEN + 2);
+      if (!p) { named = -1; break; }
+      strcpy(p,path[order[i]]);
+      if (order[i] != UZ_ROOT) strcat(p,"/");
+      strcat(p,name);
+      path[ino] = p;
+      if (want[ino]) {
+	++named;
+	--left;
+      }
+    }
+    uz_closedir(&d);
+    if (named < 0) break;
+  }
+
+  /* names of directories that were only passed through */
+  for(i=0;i<ninodes;i++)
+    if (path[i] && !want[i]) {
+      free(path[i]);
+      path[i] = 0;
+    }
+
+ out:
+  free(table);
+  free(order);
+  free(seen);
+  return named;
+}
+
+/* directory slot index. the mutation calls below keep every entry of
+   the directories they touch in memory, so names are found without
+   rereading the directory and a changed entry costs one block write.
+   empty slots (d_ino == 0) left behind by UZIX itself are kept on a
+   stack and reused before the directory is made any longer. entries
+   are kept in on-disk (little-endian) form */
+
+typedef struct uz_dirindex {
+  FILE        *dsk;
+  unsigned     gen;
+  uz_ino_t     ino;
+  uz_inode     inode;
+  int          count;  /* slots in use, holes included */
+  int          size;   /* room in ent and holes */
+  uz_direntry *ent;
+  int          nholes;
+  int         *holes;
+  struct uz_dirindex *next;
+} uz_dirindex;
+
+static uz_dirindex *dircache = 0;
+
+static void uz_dirindex_free(uz_dirindex *di) {
+  free(di->ent);
+  free(di->holes);
+  free(di);
+}
+
+static void uz_dirindex_drop(FILE *f, uz_ino_t ino) {
+  uz_dirindex *di, **pp;
+  for(pp=&dircache;(di=*pp)!=0;pp=&(di->next))
+    if (di->dsk == f && di->ino == ino) {
+      *pp = di->next;
+      uz_dirindex_free(di);
+      return;
+    }
+}
+
+static int uz_dirindex_resize(uz_dirindex *di, int size) {
+  uz_direntry *e;
+  int *h;
+
+  e = (uz_direntry *) realloc(di->ent, size * UZ_DIRELEN);
+  if (!e) return -1;
+  di->ent = e;
+  h = (int *) realloc(di->holes, size * sizeof(int));
+  if (!h) return -1;
+  di->holes = h;
+  memset(&(di->ent[di->size]), 0, (size - di->size) * UZ_DIRELEN);
+  di->size = size;
+  return 0;
+}
+
+static uz_dirindex * uz_dirindex_get(FILE *f, uz_sblock *sb, uz_ino_t ino) {
+  uz_dirindex *di, **pp;
+  int i, n, nb;
+
+  for(pp=&dircache;(di=*pp)!=0;) {
+    if (di->gen != uz_sbgen) {
+      *pp = di->next;
+      uz_dirindex_free(di);
+      continue;
+    }
+    if (di->dsk == f && di->ino == ino) {
+      UZ_COUNT(cache_hits,1);
+      return di;
+    }
+    pp = &(di->next);
+  }
+
+  di = (uz_dirindex *) calloc(1, sizeof(uz_dirindex));
+  if (!di) return 0;
+  di->dsk = f;
+  di->gen = uz_sbgen;
+  di->ino = ino;
+
+  if (uz_read_inode(f,sb,ino,&(di->inode))!=0 ||
+      (di->inode.i_mode & UZ_IFMT) != UZ_IFDIR)
+    goto fail;
+
+  n  = di->inode.i_size / UZ_DIRELEN;
+  nb = uz_fit_bytes(n * UZ_DIRELEN);
+  if (uz_dirindex_resize(di, (nb + 1) * UZ_DPB)!=0)
+    goto fail;
+
+  /* all the blocks in one batch */
+  if (uz_read_data(f,&(di->inode),0,n * UZ_DIRELEN,(void *) di->ent)
+      != n * UZ_DIRELEN)
+    goto fail;
+
+  for(di->count=n;di->count>0;di->count--)
+    if (di->ent[di->count-1].d_ino != 0)
+      break;
+  for(i=di->count-1;i>=0;i--)
+    if (di->ent[i].d_ino == 0)
+      di->holes[di->nholes++] = i;
+
+  di->next = dircache;
+  dircache = di;
+  return di;
+
+ fail:
+  uz_dirindex_free(di);
+  return 0;
+}
+
+static int uz_dirindex_find(uz_dirindex *di, char *name) {
+  uz_namekey k;
+  if (uz_name_key(name,&k)!=0) return -1;
+  return(uz_name_find(di->ent,di->count,&k));
+}
+
+/* rewrites the directory block holding slot from memory */
+static int uz_dirindex_sync(FILE *f, uz_dirindex *di, int slot) {
+  int b, rank;
+
+  rank = slot / UZ_DPB;
+  b = uz_xlate_block(f,&(di->inode),rank);
+  if (b <= 0) return -1;
+  return(uz_write_raw_block(f,b,(void *) &(di->ent[rank*UZ_DPB])));
+}
+
+/* stamps the directory's mtime after its entries changed, and adjusts
+   its link count by dlink */
+static int uz_dirindex_touch(FILE *f, uz_sblock *sb, uz_dirindex *di,
+			     int dlink) 
+{
+  if (uz_read_inode(f,sb,di->ino,&(di->inode))!=0) return -1;
+  uz_time(&(di->inode.i_mtime));
+  di->inode.i_nlink += dlink;
+  return(uz_write_inode(f,sb,di->ino,&(di->inode)));
+}
+
+static int uz_dirindex_add(FILE *f, uz_sblock *sb, uz_dirindex *di,
+			   char *name, uz_ino_t ino, int dlink)
+{
+  int slot = -1, grown = 0;
+
+  while(di->nholes > 0) {
+    slot = di->holes[--(di->nholes)];
+    if (slot < di->count && di->ent[slot].d_ino == 0)
+      break;
+    slot = -1; /* went away when the tail shrank */
+  }
+
+  if (slot < 0) {
+    if (di->count == di->size)
+      if (uz_dirindex_resize(di, di->size * 2)!=0)
+	return -1;
+    slot = di->count++;
+    grown = 1;
+  }
+
+  di->ent[slot].d_ino = u16_to_le(ino);
+  memset(di->ent[slot].d_name, 0, UZ_DIRNAMELEN);
+  memcpy(di->ent[slot].d_name, name, strlen(name)); /* <= 14, checked */
+
+  if (di->count * UZ_DIRELEN > di->inode.i_size) {
+    if (uz_inode_grow(f,sb,di->ino,di->count * UZ_DIRELEN)!=0 ||
+	uz_read_inode(f,sb,di->ino,&(di->inode))!=0) {
+      memset(&(di->ent[slot]), 0, UZ_DIRELEN);
+      if (grown) --(di->count);
+      return -1;
+    }
+  }
+
+  if (uz_dirindex_sync(f,di,slot)!=0) return -1;
+  return(uz_dirindex_touch(f,sb,di,dlink));
+}
+
+/* removes the entry at slot by moving the last entry into it, as
+   uzix__rmentry does, then gives back the directory's last block if
+   it is no longer needed */
+static int uz_dirindex_del(FILE *f, uz_sblock *sb, uz_dirindex *di,
+			   int slot, int dlink)
+{
+  int last = di->count - 1;
+
+  if (slot != last)
+    memcpy(&(di->ent[slot]), &(di->ent[last]), UZ_DIRELEN);
+  memset(&(di->ent[last]), 0, UZ_DIRELEN);
+
+  /* holes at the tail are dropped, their stack entries go stale */
+  for(di->count=last;di->count>0;di->count--)
+    if (di->ent[di->count-1].d_ino != 0)
+      break;
+
+  if (uz_dirindex_sync(f,di,slot)!=0) return -1;
+  if (last / UZ_DPB != slot / UZ_DPB &&
+      last / UZ_DPB < uz_fit_bytes(di->count * UZ_DIRELEN))
+    if (uz_dirindex_sync(f,di,last)!=0) return -1;
+
+  if (di->count * UZ_DIRELEN < di->inode.i_size)
+    if (uz_inode_truncate(f,sb,di->ino,di->count * UZ_DIRELEN)!=0)
+      return -1;
+
+  return(uz_dirindex_touch(f,sb,di,dlink));
+}
+
+/* like uz_lookup, but walks the slot index instead of rereading
+   every directory on the way */
+static int uz_dirindex_lookup(char *path, FILE *f, uz_sblock *sb) {
+  char pelem[UZ_DIRNAMELEN+1];
+  uz_dirindex *di;
+  int i = 0, j, s;
+  uz_ino_t cnode = UZ_ROOT;
+
+  for(;;) {
+    while(path[i]=='/') ++i;
+    if (path[i] == 0)
+      return cnode;
+
+    for(j=0;path[i]!='/' && path[i]!=0;i++)
+      if (j < UZ_DIRNAMELEN) pelem[j++] = path[i]; else return -1;
+    pelem[j] = 0;
+
+    di = uz_dirindex_get(f,sb,cnode);
+    if (!di) return -1;
+    s = uz_dirindex_find(di,pelem);
+    if (s < 0) return -1;
+    cnode = u16_to_le(di->ent[s].d_ino);
+  }
+}
+
+/* splits path into the index of its parent directory and its last
+   element, which must be a valid new name */
+static uz_dirindex * uz_dirindex_parent(char *path, FILE *f, uz_sblock *sb,
+					char *name)
+{
+  char ppath[512];
+  int i, n, p;
+
+  n = strlen(path);
+  while(n > 0 && path[n-1] == '/') --n;
+  for(p=n;p>0 && path[p-1]!='/';p--) ;
+
+  if (n - p == 0 || n - p > UZ_DIRNAMELEN || p >= sizeof(ppath))
+    return 0;
+  memcpy(name, path + p, n - p);
+  name[n - p] = 0;
+  if (!strcmp(name,".") || !strcmp(name,".."))
+    return 0;
+
+  memcpy(ppath, path, p);
+  ppath[p] = 0;
+
+  i = uz_dirindex_lookup(ppath,f,sb);
+  if (i < 0) return 0;
+  return(uz_dirindex_get(f,sb,i));
+}
+
+static int uz_do_mknod(char *path, FILE *f, uz_sblock *sb, uz_mode_t mode) {
+  char name[UZ_DIRNAMELEN+1];
+  uz_dirindex *parent;
+  uz_inode x;
+  int ino;
+
+  parent = uz_dirindex_parent(path,f,sb,name);
+  if (!parent || uz_dirindex_find(parent,name) >= 0)
+    return -1;
+
+  ino = uz_alloc_inode(f,sb);
+  if (ino < 0) return -1;
+
+  memset(&x,0,sizeof(uz_inode));
+  if ((mode & UZ_IFMT) == 0) mode |= UZ_IFREG;
+  x.i_mode  = mode;
+  x.i_nlink = 1;
+  uz_time(&(x.i_ctime));
+  x.i_atime = x.i_mtime = x.i_ctime;
+
+  if (uz_write_inode(f,sb,ino,&x)!=0 ||
+      uz_dirindex_add(f,sb,parent,name,ino,0)!=0) {
+    uz_free_inode(f,sb,ino);
+    uz_write_sblock(f,sb);
+    return -1;
+  }
+
+  if (uz_write_sblock(f,sb)!=0) return -1;
+  return ino;
+}
+
+int  uz_mknod(char *path, FILE *f, uz_sblock *sb, uz_mode_t mode) {
+  int tr = uz_trace_enter();
+  int r = uz_do_mknod(path,f,sb,mode);
+  uz_trace_leave(tr,UZ_TR_MKNOD,0,0,mode,path,0);
+  return r;
+}
+
+static int uz_do_mkdir(char *path, FILE *f, uz_sblock *sb, uz_mode_t mode) {
+  char name[UZ_DIRNAMELEN+1];
+  uz_dirindex *parent;
+  uz_direntry blk[UZ_DPB];
+  uz_inode x;
+  int ino;
+
+  parent = uz_dirindex_parent(path,f,sb,name);
+  if (!parent || uz_dirindex_find(parent,name) >= 0)
+    return -1;
+
+  ino = uz_alloc_inode(f,sb);
+  if (ino < 0) return -1;
+
+  memset(&x,0,sizeof(uz_inode));
+  x.i_mode  = UZ_IFDIR | (mode & ~UZ_IFMT);
+  x.i_nlink = 2; /* parent and . */
+  uz_time(&(x.i_ctime));
+  x.i_atime = x.i_mtime = x.i_ctime;
+  if (uz_write_inode(f,sb,ino,&x)!=0) goto fail;
+
+  if (uz_inode_grow(f,sb,ino,2 * UZ_DIRELEN)!=0) goto fail;
+  if (uz_read_inode(f,sb,ino,&x)!=0) goto fail;
+
+  memset(blk,0,UZ_BLOCKSZ);
+  blk[0].d_ino     = u16_to_le(ino);
+  blk[0].d_name[0] = '.';
+  blk[1].d_ino     = u16_to_le(parent->ino);
+  blk[1].d_name[0] = '.';
+  blk[1].d_name[1] = '.';
+  if (uz_write_raw_block(f,x.i_addr[0],(void *)blk)!=0) goto fail;
+
+  if (uz_dirindex_add(f,sb,parent,name,ino,1)!=0) goto fail;
+
+  if (uz_write_sblock(f,sb)!=0) return -1;
+  return ino;
+
+ fail:
+  uz_inode_implode(f,sb,ino);
+  uz_free_inode(f,sb,ino);
+  uz_write_sblock(f,sb);
+  return -1;
+}
+
+int  uz_mkdir(char *path, FILE *f, uz_sblock *sb, uz_mode_t mode) {
+  int tr = uz_trace_enter();
+  int r = uz_do_mkdir(path,f,sb,mode);
+  uz_trace_leave(tr,UZ_TR_MKDIR,0,0,mode,path,0);
+  return r;
+}
+
+static int uz_do_rmdir(char *path, FILE *f, uz_sblock *sb) {
+  char name[UZ_DIRNAMELEN+1];
+  uz_dirindex *parent, *di;
+  int i, s;
+  uz_ino_t ino;
+
+  parent = uz_dirindex_parent(path,f,sb,name);
+  if (!parent) return -1;
+  s = uz_dirindex_find(parent,name);
+  if (s < 0) return -1;
+
+  ino = u16_to_le(parent->ent[s].d_ino);
+  di = uz_dirindex_get(f,sb,ino);
+  if (!di) return -1; /* not a directory */
+
+  for(i=0;i<di->count;i++)
+    if (di->ent[i].d_ino != 0 &&
+	strcmp((char *) di->ent[i].d_name, ".") &&
+	strcmp((char *) di->ent[i].d_name, ".."))
+      return -1; /* not empty */
+
+  if (uz_dirindex_del(f,sb,parent,s,-1)!=0) return -1;
+  uz_dirindex_drop(f,ino);
+  return(uz_inode_remove(f,sb,ino));
+}
+
+int  uz_rmdir(char *path, FILE *f, uz_sblock *sb) {
+  int tr = uz_trace_enter();
+  int r = uz_do_rmdir(path,f,sb);
+  uz_trace_leave(tr,UZ_TR_RMDIR,0,0,0,path,0);
+  return r;
+}
+
+static int uz_do_link(char *oldpath, char *newpath, FILE *f, uz_sblock *sb) {
+  char name[UZ_DIRNAMELEN+1];
+  uz_dirindex *parent;
+  uz_inode x;
+  int ino;
+
+  ino = uz_dirindex_lookup(oldpath,f,sb);
+  if (ino < 0 || uz_read_inode(f,sb,ino,&x)!=0) return -1;
+
+  /* same limits as the kernel module */
+  if ((x.i_mode & UZ_IFMT) == UZ_IFDIR || x.i_nlink > 30000)
+    return -1;
+
+  parent = uz_dirindex_parent(newpath,f,sb,name);
+  if (!parent || uz_dirindex_find(parent,name) >= 0)
+    return -1;
+
+  if (uz_dirindex_add(f,sb,parent,name,ino,0)!=0) return -1;
+
+  x.i_nlink++;
+  return(uz_write_inode(f,sb,ino,&x));
+}
+
+int  uz_link(char *oldpath, char *newpath, FILE *f, uz_sblock *sb) {
+  int tr = uz_trace_enter();
+  int r = uz_do_link(oldpath,newpath,f,sb);
+  uz_trace_leave(tr,UZ_TR_LINK,0,0,0,oldpath,newpath);
+  return r;
+}
+
+static int uz_do_unlink(char *path, FILE *f, uz_sblock *sb) {
+  char name[UZ_DIRNAMELEN+1];
+  uz_dirindex *parent;
+  uz_inode x;
+  uz_ino_t ino;
+  int s;
+
+  parent = uz_dirindex_parent(path,f,sb,name);
+  if (!parent) return -1;
+  s = uz_dirindex_find(parent,name);
+  if (s < 0) return -1;
+
+  ino = u16_to_le(parent->ent[s].d_ino);
+  if (uz_read_inode(f,sb,ino,&x)!=0) return -1;
+  if ((x.i_mode & UZ_IFMT) == UZ_IFDIR) return -1;
+
+  if (uz_dirindex_del(f,sb,parent,s,0)!=0) return -1;
+
+  if (x.i_nlink > 1) {
+    x.i_nlink--;
+    return(uz_write_inode(f,sb,ino,&x));
+  }
+  return(uz_inode_remove(f,sb,ino));
+}
+
+int  uz_unlink(char *path, FILE *f, uz_sblock *sb) {
+  int tr = uz_trace_enter();
+  int r = uz_do_unlink(path,f,sb);
+  uz_trace_leave(tr,UZ_TR_UNLINK,0,0,0,path,0);
+  return r;
+}
+
+static int uz_do_rename(char *oldpath, char *newpath, FILE *f, uz_sblock *sb) {
+  char oname[UZ_DIRNAMELEN+1], nname[UZ_DIRNAMELEN+1];
+  uz_dirindex *op, *np, *di;
+  uz_inode x, y;
+  uz_ino_t ino, up;
+  int s, n, isdir, moved;
+
+  op = uz_dirindex_parent(oldpath,f,sb,oname);
+  if (!op) return -1;
+  s = uz_dirindex_find(op,oname);
+  if (s < 0) return -1;
+  ino = u16_to_le(op->ent[s].d_ino);
+
+  np = uz_dirindex_parent(newpath,f,sb,nname);
+  if (!np) return -1;
+  if (np == op && !strncmp(oname,nname,UZ_DIRNAMELEN))
+    return 0;
+
+  if (uz_read_inode(f,sb,ino,&x)!=0) return -1;
+  isdir = (x.i_mode & UZ_IFMT) == UZ_IFDIR;
+  moved = isdir && np != op;
+
+  /* a directory can't be moved below itself */
+  if (moved)
+    for(up=np->ino,n=0;up!=UZ_ROOT;n++) {
+      if (up == ino || n > 65535) return -1;
+      di = uz_dirindex_get(f,sb,up);
+      if (!di || (s = uz_dirindex_find(di,"..")) < 0) return -1;
+      up = u16_to_le(di->ent[s].d_ino);
+    }
+
+  /* replace an existing target of the same kind */
+  s = uz_dirindex_find(np,nname);
+  if (s >= 0) {
+    if (u16_to_le(np->ent[s].d_ino) == ino) return 0;
+    if (uz_read_inode(f,sb,u16_to_le(np->ent[s].d_ino),&y)!=0) return -1;
+    if (isdir != ((y.i_mode & UZ_IFMT) == UZ_IFDIR)) return -1;
+    if ((isdir ? uz_rmdir(newpath,f,sb) : uz_unlink(newpath,f,sb))!=0)
+      return -1;
+  }
+
+  if (uz_dirindex_add(f,sb,np,nname,ino,moved ? 1 : 0)!=0) return -1;
+
+  s = uz_dirindex_find(op,oname);
+  if (s < 0 || uz_dirindex_del(f,sb,op,s,moved ? -1 : 0)!=0) return -1;
+
+  if (moved) {
+    di = uz_dirindex_get(f,sb,ino);
+    if (!di || (s = uz_dirindex_find(di,"..")) < 0) return -1;
+    di->ent[s].d_ino = u16_to_le(np->ino);
+    if (uz_dirindex_sync(f,di,s)!=0) return -1;
+  }
+
+  return 0;
+}
+
+int  uz_rename(char *oldpath, char *newpath, FILE *f, uz_sblock *sb) {
+  int tr = uz_trace_enter();
+  int r = uz_do_rename(oldpath,newpath,f,sb);
+  uz_trace_leave(tr,UZ_TR_RENAME,0,0,0,oldpath,newpath);
+  return r;
+}
+
+/* reads a size given as bytes, or with a b (blocks) or K (kbytes)
+   suffix. returns bytes, -1 if not a multiple of the block size */
+int uz_parse_size(char *x) {
+  int ll, v;
+  char cp[32];
+  ll = strlen(x) - 1;
+  if (ll < 0 || ll >= sizeof(cp)) return -1;
+  strcpy(cp, x);
+  
+  switch(x[ll]) {
+  case 'b':
+    cp[ll] = 0;
+    v = atoi(cp);
+    v *= 512;
+    break;
+  case 'K':
+  case 'k':
+    cp[ll] = 0;
+    v = atoi(cp);
+    v *= 1024;
+    break;
+  default:
+    v = atoi(cp);
+  }
+
+  if (v%512) {
+    fprintf(stderr,"sizes must be multiples of 512 bytes (block size)\n");
+    v = -1;
+  }
+  if (v < 0) v=-1;
+  return v;
+}
+
+int uz_json_quote(char *dest, char *src) {
+  static char hex[] = "0123456789abcdef";
+  unsigned char *x = (unsigned char *) src;
+  int n = 0;
+
+  dest[n++] = '"';
+  for(;*x;x++) {
+    if (*x == '"' || *x == '\\') {
+      dest[n++] = '\\';
+      dest[n++] = *x;
+    } else if (*x < 0x20 || *x >= 0x80) {
+      memcpy(dest+n,"\\u00",4);
+      n += 4;
+      dest[n++] = hex[*x >> 4];
+      dest[n++] = hex[*x & 15];
+    } else
+      dest[n++] = *x;
+  }
+  dest[n++] = '"';
+  dest[n] = 0;
+  return n;
+}
+
 void uz_global_opt(int argc, char **argv) {
   int i;
   for(i=1;i<argc;i++) {
@@ -153,3 +1048,76 @@ void uz_global_opt(int argc, char **argv) {
     }
   }
 }
+
+int uz_recover(char *image, char *undolog) {
+  FILE *f;
+
+  if (access(undolog,F_OK)!=0) return 0;
+  f = fopen(image,"r+");
+  if (!f || uz_rollback(f,undolog)!=0 || fclose(f)!=0) {
+    fprintf(stderr,"%s: cannot put the image back from %s.\n",image,undolog);
+    return -1;
+  }
+  fprintf(stderr,"%s: put back from %s, left by an interrupted run.\n",
+	  image,undolog);
+  return 0;
+}
+
+static void uz_print_stats(void) {
+  fprintf(stderr,"\nI/O statistics:\n");
+  fprintf(stderr,"seeks                     : %lu\n",uz_stats.seeks);
+  fprintf(stderr,"blocks read               : %lu\n",uz_stats.block_reads);
+  fprintf(stderr,"blocks written            : %lu\n",uz_stats.block_writes);
+  fprintf(stderr,"field reads               : %lu\n",uz_stats.field_reads);
+  fprintf(stderr,"field writes              : %lu\n",uz_stats.field_writes);
+  fprintf(stderr,"bytes read                : %lu\n",uz_stats.bytes_read);
+  fprintf(stderr,"bytes written             : %lu\n",uz_stats.bytes_written);
+  fprintf(stderr,"cache hits                : %lu\n",uz_stats.cache_hits);
+}
+
+static void uz_print_drive(void) {
+  fprintf(stderr,"\nsimulated drive:\n");
+  fprintf(stderr,"time (ms)                 : %.1f\n",uz_drive_stats.ms);
+  fprintf(stderr,"accesses                  : %lu\n",uz_drive_stats.accesses);
+  fprintf(stderr,"seeks                     : %lu\n",uz_drive_stats.seeks);
+  fprintf(stderr,"cylinders crossed         : %lu\n",uz_drive_stats.cylinders);
+}
+
+static void uz_print_latency(void) {
+  uz_latency_dump(stderr);
+}
+
+int uz_stats_opt(int argc, char **argv) {
+  int i, j;
+
+  for(i=j=1;i<argc;i++) {
+    if (!strcmp(argv[i],"--stats")) {
+      atexit(uz_print_stats);
+      continue;
+    }
+    if (!strcmp(argv[i],"--latency")) {
+      uz_latency(1);
+      atexit(uz_print_latency);
+      continue;
+    }
+    if (!strncmp(argv[i],"--drive=",8)) {
+      if (uz_drive_set(argv[i]+8)!=0) {
+	fprintf(stderr,"bad drive specification %s\n\n",argv[i]+8);
+	exit(1);
+      }
+      atexit(uz_print_drive);
+      continue;
+    }
+    if (!strncmp(argv[i],"--trace=",8)) {
+      if (uz_trace_open(argv[i]+8)!=0) {
+	fprintf(stderr,"cannot create trace %s\n\n",argv[i]+8);
+	exit(2);
+      }
+      atexit(uz_trace_close);
+      continue;
+    }
+    argv[j++] = argv[i];
+  }
+  if (j < argc) argv[j] = 0;
+  return j;
+}
@@ -50,8 +50,60 @@ int  uz_lookup(char *path, FILE *f, uz_sblock *sb);
 int  uz_fstat(char *path, FILE *f, uz_sblock *sb, uz_stat *ostat);
 int  uz_istat(uz_ino_t inode, FILE *f, uz_sblock *sb, uz_stat *ostat);
 
+/* readdir and istat in one go */
+typedef struct {
+  uz_direntry entry;
+  uz_stat     st;     /* st_ino is 0 if the inode can't be read */
+} uz_direntplus;
+
+/* the entries left in dir, empty slots skipped, each with the stat of
+   its inode. the inodes are read a block of them at a time, each block
+   once and in ascending order. *ents is malloc'ed, for the caller to
+   free. returns how many, -1 on error */
+int  uz_readdirplus(uz_dir *dir, uz_direntplus **ents);
+
+/* directory mutation, ported from the kernel module. uz_mknod and
+   uz_mkdir return the new inode #, the others 0. all return -1 on
+   error. mode bits without a file type make a regular file */
+int  uz_mknod(char *path, FILE *f, uz_sblock *sb, uz_mode_t mode);
+int  uz_mkdir(char *path, FILE *f, uz_sblock *sb, uz_mode_t mode);
+int  uz_rmdir(char *path, FILE *f, uz_sblock *sb);
+int  uz_link(char *oldpath, char *newpath, FILE *f, uz_sblock *sb);
+int  uz_unlink(char *path, FILE *f, uz_sblock *sb);
+int  uz_rename(char *oldpath, char *newpath, FILE *f, uz_sblock *sb);
+
+/* plans a relayout of every file as one contiguous run, for
+   uz_relocate. returns the number of blocks to move, -1 on error */
+int  uz_layout_plan(FILE *f, uz_sblock *sb, uz_blkno_t *newpos);
+
+/* one directory walk giving a path to each inode set in want (see
+   uz_scan_newer). returns how many were named, -1 on error */
+int  uz_inode_paths(FILE *f, uz_sblock *sb, uint8_t *want, char **path);
+
 
 /* common behavior to all utilities (-v and --version) */
 void uz_global_opt(int argc, char **argv);
 
+/* --stats, --latency, --trace=file and --drive=spec: takes them out
+   of argv and prints uz_stats, the latency histograms (JSON) or the
+   time of a simulated drive on stderr at exit, or records a call
+   trace. returns the new argc */
+int  uz_stats_opt(int argc, char **argv);
+
+/* -u undolog of the tools that change an image: if undolog was left
+   by a run interrupted while committing, puts image back as it was
+   before that run (see uz_rollback) and says so. 0 if there was
+   nothing to undo or it was undone, -1 on error (reported) */
+int  uz_recover(char *image, char *undolog);
+
+/* size arguments as taken by mkuzixfs: bytes, or n followed by b for
+   blocks or K for kbytes. -1 if invalid */
+int  uz_parse_size(char *x);
+
+/* src as a JSON string, quotes included. names on the image have no
+   known encoding: bytes from 0x80 up are taken as Latin-1 (\u0080 to
+   \u00ff), so the output is always plain ASCII. dest must have room
+   for 6 * strlen(src) + 3 bytes. returns the length written */
+int  uz_json_quote(char *dest, char *src);
+
 #endif
@@ -9,13 +9,446 @@
    is included in the COPYING file.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "uzixfs.h"
 #include "byteorder.h"
 
+unsigned uz_sbgen = 0;
+uz_iostats uz_stats;
+
+/* pending writes of the open transaction, see uz_begin */
+typedef struct {
+  FILE      *f;
+  uz_sblock  sb;
+  int        sbdirty;
+  uint8_t  **blk;     /* 65536 entries, non-null = dirty block */
+} uz_txn;
+
+static uz_txn *txn = 0;
+
+static uint8_t * uz_txn_block(FILE *f, uz_blkno_t block, int load);
+
+/* latency histograms */
+
+typedef struct {
+  uint64_t count, sum, min, max;
+  uint64_t bucket[UZ_LAT_BUCKETS];
+} uz_lathist;
+
+static int        uz_lat_on = 0;
+static uz_lathist uz_lat[UZ_LAT_OPS];
+static char      *uz_lat_name[UZ_LAT_OPS] = {
+  "lookup", "readdir", "istat", "read_data", "write_data",
+  "grow", "implode", "alloc", "free", "readdirplus" };
+
+void uz_latency(int on) {
+  uz_lat_on = on;
+}
+
+static uint64_t uz_lat_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+uint64_t uz_lat_begin(void) {
+  return uz_lat_on ? uz_lat_now() : 0;
+}
+
+/* 0-3 as they are, then 4 buckets per power of two */
+static int uz_lat_bucket(uint64_t v) {
+  int k;
+  if (v < 4) return v;
+  for(k=2;(v >> (k+1)) != 0;k++) ;
+  return 4 * (k-1) + ((v >> (k-2)) & 3);
+}
+
+static uint64_t uz_lat_low(int b) {
+  if (b < 4) return b;
+  return (uint64_t) (4 + (b & 3)) << (b/4 - 1);
+}
+
+void uz_lat_end(int op, uint64_t start) {
+  uz_lathist *h;
+  uint64_t v;
+
+  if (!start) return;
+  v = uz_lat_now() - start;
+  h = &uz_lat[op];
+  if (!h->count || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  ++h->count;
+  h->sum += v;
+  ++h->bucket[uz_lat_bucket(v)];
+}
+
+/* upper end of the bucket holding the q-th fraction of the values */
+static uint64_t uz_lat_quantile(uz_lathist *h, double q) {
+  uint64_t n = 0, want;
+  int b;
+
+  want = (uint64_t) (q * h->count);
+  if (want >= h->count) want = h->count - 1;
+  for(b=0;b<UZ_LAT_BUCKETS;b++) {
+    n += h->bucket[b];
+    if (n > want) break;
+  }
+  n = b+1 < UZ_LAT_BUCKETS ? uz_lat_low(b+1) - 1 : h->max;
+  return n < h->max ? n : h->max;
+}
+
+void uz_latency_dump(FILE *out) {
+  uz_lathist *h;
+  int i, b, first;
+
+  fprintf(out,"{\"unit\": \"ns\"");
+  for(i=0;i<UZ_LAT_OPS;i++) {
+    h = &uz_lat[i];
+    fprintf(out,",\n \"%s\": {\"count\": %llu",uz_lat_name[i],
+	    (unsigned long long) h->count);
+    if (h->count) {
+      fprintf(out,", \"min\": %llu, \"mean\": %llu, \"p50\": %llu, "
+	      "\"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu,\n"
+	      "   \"buckets\": [",
+	      (unsigned long long) h->min,
+	      (unsigned long long) (h->sum / h->count),
+	      (unsigned long long) uz_lat_quantile(h,0.5),
+	      (unsigned long long) uz_lat_quantile(h,0.9),
+	      (unsigned long long) uz_lat_quantile(h,0.99),
+	      (unsigned long long) uz_lat_quantile(h,0.999),
+	      (unsigned long long) h->max);
+      /* [low end, count] of the buckets in use */
+      for(b=0,first=1;b<UZ_LAT_BUCKETS;b++) {
+	if (!h->bucket[b]) continue;
+	fprintf(out,"%s[%llu, %llu]",first ? "" : ", ",
+		(unsigned long long) uz_lat_low(b),
+		(unsigned long long) h->bucket[b]);
+	first = 0;
+      }
+      fprintf(out,"]");
+    }
+    fprintf(out,"}");
+  }
+  fprintf(out,"\n}\n");
+}
+
+/* call traces. a record is the op byte (0x80 set when an encoded
+   inode and its number follow), the microseconds since the previous
+   record and then the arguments of the op, numbers as base 128
+   varints and strings as their length and bytes */
+
+#define UZ_TR_MAGIC "UZTRACE1"
+
+static FILE    *uz_tr = 0;
+static int      uz_tr_depth = 0;
+static uint64_t uz_tr_start, uz_tr_last;
+static uint8_t  uz_tr_inode[UZ_ILEN];
+
+/* the inodes read or written last, to tell which one a call on an
+   inode structure is about */
+#define UZ_TR_SEEN 16
+
+static struct {
+  uz_ino_t ino;
+  uint8_t  raw[UZ_ILEN];
+} uz_tr_seen[UZ_TR_SEEN];
+static int uz_tr_nseen = 0;
+
+static void uz_tr_saw(uz_ino_t no, uz_inode *inode) {
+  int i = uz_tr_nseen++ % UZ_TR_SEEN;
+  uz_tr_seen[i].ino = no;
+  uz_encode_inode(inode,uz_tr_seen[i].raw);
+}
+
+static uz_ino_t uz_tr_which(uint8_t *raw) {
+  int i, k;
+  for(i=1;i<=UZ_TR_SEEN && i<=uz_tr_nseen;i++) {
+    k = (uz_tr_nseen - i) % UZ_TR_SEEN;
+    if (!memcmp(uz_tr_seen[k].raw,raw,UZ_ILEN))
+      return uz_tr_seen[k].ino;
+  }
+  return 0;
+}
+
+int uz_trace_open(char *path) {
+  if (uz_tr) uz_trace_close();
+  uz_tr = fopen(path,"w");
+  if (!uz_tr) return -1;
+  fwrite(UZ_TR_MAGIC,1,8,uz_tr);
+  uz_tr_last = 0;
+  uz_tr_nseen = 0;
+  memset(uz_tr_inode,0,UZ_ILEN);
+  return 0;
+}
+
+void uz_trace_close(void) {
+  if (!uz_tr) return;
+  fclose(uz_tr);
+  uz_tr = 0;
+}
+
+int uz_trace_enter(void) {
+  if (uz_tr_depth++ || !uz_tr) return 0;
+  uz_tr_start = uz_lat_now() / 1000;
+  if (!uz_tr_last) uz_tr_last = uz_tr_start;
+  return 1;
+}
+
+static void uz_tr_num(uint32_t v) {
+  while(v >= 0x80) {
+    putc((v & 0x7f) | 0x80,uz_tr);
+    v >>= 7;
+  }
+  putc(v,uz_tr);
+}
+
+static void uz_tr_str(char *s) {
+  int n = strlen(s);
+  if (n >= UZ_TR_PATHLEN) n = UZ_TR_PATHLEN - 1;
+  uz_tr_num(n);
+  fwrite(s,1,n,uz_tr);
+}
+
+void uz_trace_leave(int rec, int op, uz_inode *inode, uint32_t a, uint32_t b,
+		    char *path, char *path2) {
+  uint8_t raw[UZ_ILEN];
+  int newinode = 0;
+
+  --uz_tr_depth;
+  if (!rec || !uz_tr) return;
+
+  if (inode) {
+    uz_encode_inode(inode,raw);
+    newinode = memcmp(raw,uz_tr_inode,UZ_ILEN) != 0;
+    memcpy(uz_tr_inode,raw,UZ_ILEN);
+  }
+  putc(op | (newinode ? 0x80 : 0),uz_tr);
+  uz_tr_num(uz_tr_start - uz_tr_last);
+  uz_tr_last = uz_tr_start;
+  if (newinode) {
+    fwrite(raw,1,UZ_ILEN,uz_tr);
+    uz_tr_num(uz_tr_which(raw));
+  }
+
+  switch(op) {
+  case UZ_TR_LINK:
+  case UZ_TR_RENAME:
+    uz_tr_str(path);
+    uz_tr_str(path2);
+    break;
+  case UZ_TR_MKNOD:
+  case UZ_TR_MKDIR:
+    uz_tr_str(path);
+    uz_tr_num(b);
+    break;
+  case UZ_TR_LOOKUP:
+  case UZ_TR_UNLINK:
+  case UZ_TR_RMDIR:
+    uz_tr_str(path);
+    break;
+  case UZ_TR_READ:
+  case UZ_TR_WRITE:
+  case UZ_TR_GROW:
+  case UZ_TR_TRUNCATE:
+    uz_tr_num(a);
+    uz_tr_num(b);
+    break;
+  default:
+    uz_tr_num(a);
+  }
+}
+
+int uz_trace_head(FILE *t, uz_trace_rec *r) {
+  char magic[8];
+  memset(r,0,sizeof(uz_trace_rec));
+  if (fread(magic,1,8,t)!=8 || memcmp(magic,UZ_TR_MAGIC,8)!=0)
+    return -1;
+  return 0;
+}
+
+static int uz_tr_getnum(FILE *t, uint32_t *v) {
+  int c, s;
+  for(*v=0,s=0;s<35;s+=7) {
+    if ((c = getc(t)) == EOF) return -1;
+    *v |= (uint32_t) (c & 0x7f) << s;
+    if (!(c & 0x80)) return 0;
+  }
+  return -1;
+}
+
+static int uz_tr_getstr(FILE *t, char *s) {
+  uint32_t n;
+  if (uz_tr_getnum(t,&n)!=0 || n >= UZ_TR_PATHLEN) return -1;
+  if (fread(s,1,n,t)!=n) return -1;
+  s[n] = 0;
+  return 0;
+}
+
+int uz_trace_read(FILE *t, uz_trace_rec *r) {
+  uint8_t raw[UZ_ILEN];
+  uint32_t dt;
+  int c;
+
+  if ((c = getc(t)) == EOF) return 1;
+  r->op = c & 0x7f;
+  if (r->op < 1 || r->op >= UZ_TR_OPS) return -1;
+  if (uz_tr_getnum(t,&dt)!=0) return -1;
+  r->usec += dt;
+  r->fresh = (c & 0x80) != 0;
+  if (r->fresh) {
+    if (fread(raw,1,UZ_ILEN,t)!=UZ_ILEN) return -1;
+    uz_decode_inode(raw,&(r->inode));
+    if (uz_tr_getnum(t,&dt)!=0 || dt > 65535) return -1;
+    r->ino = dt;
+  }
+
+  r->a = r->b = 0;
+  switch(r->op) {
+  case UZ_TR_LINK:
+  case UZ_TR_RENAME:
+    if (uz_tr_getstr(t,r->path)!=0 || uz_tr_getstr(t,r->path2)!=0) return -1;
+    break;
+  case UZ_TR_MKNOD:
+  case UZ_TR_MKDIR:
+    if (uz_tr_getstr(t,r->path)!=0 || uz_tr_getnum(t,&(r->b))!=0) return -1;
+    break;
+  case UZ_TR_LOOKUP:
+  case UZ_TR_UNLINK:
+  case UZ_TR_RMDIR:
+    if (uz_tr_getstr(t,r->path)!=0) return -1;
+    break;
+  case UZ_TR_READ:
+  case UZ_TR_WRITE:
+  case UZ_TR_GROW:
+  case UZ_TR_TRUNCATE:
+    if (uz_tr_getnum(t,&(r->a))!=0 || uz_tr_getnum(t,&(r->b))!=0) return -1;
+    break;
+  default:
+    if (uz_tr_getnum(t,&(r->a))!=0) return -1;
+  }
+  return 0;
+}
+
+/* where the next access to the image starts, for uz_io_hook. threads
+   read through streams of their own, so each has its own */
+static __thread uint32_t uz_pos = 0;
+uz_iohook uz_io_hook = 0;
+
+/* every seek on the image goes through here, to be counted */
+static int uz_seek(FILE *f, uint32_t offset) {
+  UZ_COUNT(seeks,1);
+  uz_pos = offset;
+  return(fseek(f,offset,SEEK_SET));
+}
+
+void uz_io(uint32_t length, int write) {
+  if (uz_io_hook) uz_io_hook(uz_pos,length,write);
+  uz_pos += length;
+}
+
+/* simulated drives */
+
+typedef struct {
+  char    *name;
+  uz_drive d;
+} uz_drivepreset;
+
+/* 3.5" 1.44M floppy, compact flash card, MFM hard disk */
+static uz_drivepreset uz_drives[] = {
+  { "floppy", { 15.0, 3.0,  300.0,   45.0, 0.0, 36 } },
+  { "cf",     {  0.0, 0.0,    0.0, 1000.0, 0.5, 64 } },
+  { "hd",     {  3.0, 0.03, 3600.0,  500.0, 0.0, 68 } },
+  { 0 } };
+
+uz_drive      uz_drive_model;
+uz_drivestats uz_drive_stats;
+
+static uint32_t uz_drv_end = ~0;  /* where the last access ended */
+static long     uz_drv_cyl = 0;   /* and its cylinder */
+
+int uz_drive_set(char *spec) {
+  char *p, *q, *v;
+  uz_drive d;
+  int i;
+
+  d = uz_drives[0].d;
+  for(i=0;uz_drives[i].name;i++)
+    if (!strncmp(spec,uz_drives[i].name,strlen(uz_drives[i].name)) &&
+	(spec[strlen(uz_drives[i].name)] == 0 ||
+	 spec[strlen(uz_drives[i].name)] == ',')) {
+      d = uz_drives[i].d;
+      spec += strlen(uz_drives[i].name);
+      break;
+    }
+
+  for(p=spec;*p;p=q) {
+    if (*p == ',') ++p;
+    q = p + strcspn(p,",");
+    v = strchr(p,'=');
+    if (!v || v > q) return -1;
+    ++v;
+    if      (!strncmp(p,"settle=",7)) d.settle = atof(v);
+    else if (!strncmp(p,"step=",5))   d.step   = atof(v);
+    else if (!strncmp(p,"rpm=",4))    d.rpm    = atof(v);
+    else if (!strncmp(p,"rate=",5))   d.rate   = atof(v);
+    else if (!strncmp(p,"cmd=",4))    d.cmd    = atof(v);
+    else if (!strncmp(p,"track=",6))  d.track  = atoi(v);
+    else return -1;
+  }
+  if (d.settle < 0 || d.step < 0 || d.rpm < 0 || d.rate <= 0 ||
+      d.cmd < 0 || d.track <= 0)
+    return -1;
+
+  uz_drive_model = d;
+  memset(&uz_drive_stats,0,sizeof(uz_drivestats));
+  uz_drv_end = ~0;
+  uz_drv_cyl = 0;
+  uz_io_hook = uz_drive_access;
+  return 0;
+}
+
+void uz_drive_access(uint32_t offset, uint32_t length, int write) {
+  uz_drive *d = &uz_drive_model;
+  long cyl, n;
+
+  ++uz_drive_stats.accesses;
+  cyl = offset / UZ_BLOCKSZ / d->track;
+  if (offset != uz_drv_end) {
+    uz_drive_stats.ms += d->cmd;
+    if (cyl != uz_drv_cyl) {
+      n = cyl > uz_drv_cyl ? cyl - uz_drv_cyl : uz_drv_cyl - cyl;
+      ++uz_drive_stats.seeks;
+      uz_drive_stats.cylinders += n;
+      uz_drive_stats.ms += d->settle + d->step * n;
+    }
+    if (d->rpm > 0)
+      uz_drive_stats.ms += 30000.0 / d->rpm;
+  }
+  uz_drive_stats.ms += length / (d->rate * 1.024);
+  uz_drv_end = offset + length;
+
+  /* a long transfer moves on to the next cylinders */
+  if (length) {
+    n = (uz_drv_end - 1) / UZ_BLOCKSZ / d->track - cyl;
+    uz_drive_stats.cylinders += n;
+    uz_drive_stats.ms += d->step * n;
+    cyl += n;
+  }
+  uz_drv_cyl = cyl;
+}
+
 int uz_read_sblock(FILE *f, uz_sblock *sb) {
-  
-  if (fseek(f,UZ_SBLOCK * UZ_BLOCKSZ,SEEK_SET)!=0) return -1;
+
+  __atomic_fetch_add(&uz_sbgen,1,__ATOMIC_RELAXED);
+  if (txn && txn->f == f && txn->sbdirty) {
+    memcpy(sb,&(txn->sb),sizeof(uz_sblock));
+    return 0;
+  }
+
+  if (uz_seek(f,UZ_SBLOCK * UZ_BLOCKSZ)!=0) return -1;
   
   if (read_u16(f,&(sb->s_mounted),1)!=0) return -1;
   if (read_u16(f,&(sb->s_reserv),1)!=0) return -1;
@@ -37,7 +470,13 @@ int uz_read_sblock(FILE *f, uz_sblock *sb) {
 }
 
 int uz_write_sblock(FILE *f, uz_sblock *sb) {
-  if (fseek(f,UZ_SBLOCK * UZ_BLOCKSZ,SEEK_SET)!=0) return -1;
+  if (txn && txn->f == f) {
+    memcpy(&(txn->sb),sb,sizeof(uz_sblock));
+    txn->sbdirty = 1;
+    return 0;
+  }
+
+  if (uz_seek(f,UZ_SBLOCK * UZ_BLOCKSZ)!=0) return -1;
   
   if (write_u16(f,&(sb->s_mounted),1)!=0) return -1;
   if (write_u16(f,&(sb->s_reserv),1)!=0) return -1;
@@ -58,9 +497,91 @@ int uz_write_sblock(FILE *f, uz_sblock *sb) {
   return 0;
 }
 
+/* decoded inodes, 4-way set associative on the inode number, least
+   recently used way out. uz_write_inode writes through; block writes
+   drop the inodes of the block they overwrite and a new uz_sbgen
+   drops them all */
+#define UZ_ICSETS 16
+#define UZ_ICWAYS 4
+
+typedef struct {
+  FILE       *f;
+  unsigned    gen, used;
+  uz_blkno_t  blk;
+  uz_ino_t    no;
+  uz_inode    inode;
+} uz_icentry;
+
+static uz_icentry uz_icache[UZ_ICSETS][UZ_ICWAYS];
+static unsigned   uz_icache_tick = 0;
+
+/* the way holding no, or 0 and in *victim the way to reuse for it */
+static uz_icentry * uz_icache_find(FILE *f, uz_blkno_t blk, uz_ino_t no,
+				   uz_icentry **victim)
+{
+  uz_icentry *set = uz_icache[no % UZ_ICSETS], *v = set;
+  int i;
+
+  for(i=0;i<UZ_ICWAYS;i++) {
+    if (set[i].f == f && set[i].no == no && set[i].blk == blk &&
+	set[i].gen == uz_sbgen) {
+      set[i].used = ++uz_icache_tick;
+      return &set[i];
+    }
+    if (!set[i].f || set[i].gen != uz_sbgen) v = &set[i];
+    else if (v->f && v->gen == uz_sbgen && set[i].used < v->used) v = &set[i];
+  }
+  if (victim) *victim = v;
+  return 0;
+}
+
+void uz_icache_put(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode) {
+  uz_blkno_t blk = sb->s_reserv + (no >> UZ_IPB_L2);
+  uz_icentry *e, *v;
+
+  if ((e = uz_icache_find(f,blk,no,&v))==0) {
+    e = v;
+    e->f    = f;
+    e->gen  = uz_sbgen;
+    e->blk  = blk;
+    e->no   = no;
+    e->used = ++uz_icache_tick;
+  }
+  memcpy(&(e->inode),inode,sizeof(uz_inode));
+}
+
+static void uz_icache_drop(FILE *f, uz_blkno_t blk) {
+  uz_icentry *e = uz_icache[0];
+  int i;
+  for(i=0;i<UZ_ICSETS*UZ_ICWAYS;i++)
+    if (e[i].f == f && e[i].blk == blk)
+      e[i].f = 0;
+}
+
 int uz_read_inode(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode) {
+  uz_blkno_t blk = sb->s_reserv + (no >> UZ_IPB_L2);
+  uz_icentry *e;
+  uint8_t *b;
+
+  if ((e = uz_icache_find(f,blk,no,0))!=0) {
+    memcpy(inode,&(e->inode),sizeof(uz_inode));
+    UZ_COUNT(cache_hits,1);
+    if (uz_tr) uz_tr_saw(no,inode);
+    return 0;
+  }
 
-  if (fseek(f,(UZ_BLOCKSZ * sb->s_reserv) + (UZ_ILEN * no), SEEK_SET)!=0)
+  if (txn && txn->f == f) {
+    b = uz_txn_block(f, blk, 0);
+    if (b) {
+      uz_decode_inode(b + UZ_ILEN * (no & UZ_IPB_MASK), inode);
+      uz_icache_put(f,sb,no,inode);
+      UZ_COUNT(cache_hits,1);
+      if (uz_tr) uz_tr_saw(no,inode);
+      return 0;
+    }
+  }
+
+  if (uz_seek(f,(UZ_BLOCKSZ * sb->s_reserv) + (UZ_ILEN * no))!=0)
     return -1;
 
   if (read_u16(f,&(inode->i_mode),1)!=0) return -1;
@@ -77,12 +598,27 @@ int uz_read_inode(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode) {
   if (read_u16(f,&(inode->i_addr[0]),20)!=0) return -1;
   if (read_u16(f,&(inode->i_dummy),1)!=0) return -1;
 
+  uz_icache_put(f,sb,no,inode);
+  if (uz_tr) uz_tr_saw(no,inode);
   return 0;
 }
 
 int uz_write_inode(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode) {
+  uz_blkno_t blk = sb->s_reserv + (no >> UZ_IPB_L2);
+  uint8_t *b;
+
+  if (txn && txn->f == f) {
+    b = uz_txn_block(f, blk, 1);
+    if (!b) return -1;
+    uz_encode_inode(inode, b + UZ_ILEN * (no & UZ_IPB_MASK));
+    uz_icache_put(f,sb,no,inode);
+    if (uz_tr) uz_tr_saw(no,inode);
+    return 0;
+  }
 
-  if (fseek(f,(UZ_BLOCKSZ * sb->s_reserv) + (UZ_ILEN * no), SEEK_SET)!=0)
+  /* a write that fails halfway leaves the inode unknown */
+  uz_icache_drop(f,blk);
+  if (uz_seek(f,(UZ_BLOCKSZ * sb->s_reserv) + (UZ_ILEN * no))!=0)
     return -1;
 
   if (write_u16(f,&(inode->i_mode),1)!=0) return -1;
@@ -99,14 +635,102 @@ int uz_write_inode(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode) {
   if (write_u16(f,&(inode->i_addr[0]),20)!=0) return -1;
   if (write_u16(f,&(inode->i_dummy),1)!=0) return -1;
 
+  uz_icache_put(f,sb,no,inode);
+  if (uz_tr) uz_tr_saw(no,inode);
   return 0;
 }
 
-int uz_read_data(FILE *f, uz_inode *inode, 
+#define GET16(p)   ((p)[0] | ((p)[1] << 8))
+#define PUT16(p,v) { (p)[0] = (v) & 0xff; (p)[1] = ((v) >> 8) & 0xff; }
+
+/* converts between uz_inode and its 64-byte on-disk form */
+void uz_decode_inode(uint8_t *raw, uz_inode *inode) {
+  int i;
+
+  inode->i_mode          = GET16(raw);
+  inode->i_nlink         = GET16(raw+2);
+  inode->i_uid           = raw[4];
+  inode->i_gid           = raw[5];
+  inode->i_size          = GET16(raw+6) | (GET16(raw+8) << 16);
+  inode->i_atime.t_time  = GET16(raw+10);
+  inode->i_atime.t_date  = GET16(raw+12);
+  inode->i_mtime.t_time  = GET16(raw+14);
+  inode->i_mtime.t_date  = GET16(raw+16);
+  inode->i_ctime.t_time  = GET16(raw+18);
+  inode->i_ctime.t_date  = GET16(raw+20);
+  for(i=0;i<20;i++)
+    inode->i_addr[i]     = GET16(raw+22+2*i);
+  inode->i_dummy         = GET16(raw+62);
+}
+
+void uz_encode_inode(uz_inode *inode, uint8_t *raw) {
+  int i;
+
+  PUT16(raw,    inode->i_mode);
+  PUT16(raw+2,  inode->i_nlink);
+  raw[4] = inode->i_uid;
+  raw[5] = inode->i_gid;
+  PUT16(raw+6,  inode->i_size);
+  PUT16(raw+8,  inode->i_size >> 16);
+  PUT16(raw+10, inode->i_atime.t_time);
+  PUT16(raw+12, inode->i_atime.t_date);
+  PUT16(raw+14, inode->i_mtime.t_time);
+  PUT16(raw+16, inode->i_mtime.t_date);
+  PUT16(raw+18, inode->i_ctime.t_time);
+  PUT16(raw+20, inode->i_ctime.t_date);
+  for(i=0;i<20;i++)
+    PUT16(raw+22+2*i, inode->i_addr[i]);
+  PUT16(raw+62, inode->i_dummy);
+}
+
+/* physical blocks of count ranks from first, reading each index
+   block once */
+static int uz_xlate_run(FILE *f, uz_inode *inode, int first, int count,
+			uz_blkno_t *out)
+{
+  uz_blkno_t idx[256], top[256];
+  int i, r, b, k, have = -1, havetop = 0;
+
+  for(i=0;i<count;i++) {
+    r = first + i;
+    if (r < 18) {
+      out[i] = inode->i_addr[r];
+      continue;
+    }
+    if (r < 274) {
+      b = inode->i_addr[18];
+      k = r - 18;
+    } else if (r < UZ_MAXBLOCKS) {
+      if (!havetop) {
+	if (uz_read_raw_block(f,inode->i_addr[19],(void *) top)!=0) return -1;
+	havetop = 1;
+      }
+      b = u16_to_le(top[(r-274) / 256]);
+      k = (r-274) % 256;
+    } else
+      return -1;
+    if (b != have) {
+      if (uz_read_raw_block(f,b,(void *) idx)!=0) return -1;
+      have = b;
+    }
+    out[i] = u16_to_le(idx[k]);
+  }
+  return 0;
+}
+
+/* reads and writes of data go in batches of up to UZ_BATCH blocks.
+   whole blocks move straight between the image and the caller's
+   buffer, the partial ones at either end through head and tail */
+#define UZ_BATCH 256
+
+static int uz_do_read_data(FILE *f, uz_inode *inode, 
 		 uint32_t offset, uint32_t length, void *dest)
 {
-  int nth, block, boff, maxpayload, payload, accpayload = 0;
-  char local[UZ_BLOCKSZ];
+  uz_ioreq   req[UZ_BATCH];
+  uz_blkno_t blk[UZ_BATCH];
+  uint8_t    head[UZ_BLOCKSZ], tail[UZ_BLOCKSZ];
+  uint8_t   *d = (uint8_t *) dest;
+  int i, nb, boff, chunk, accpayload = 0;
 
   if (offset >= inode->i_size)
     return 0;
@@ -115,35 +739,59 @@ int uz_read_data(FILE *f, uz_inode *inode,
     length = inode->i_size - offset;
 
   while(length != 0) {
-    nth = offset / UZ_BLOCKSZ;
-    block = uz_xlate_block(f, inode, nth);
-    if (block < 0) return -1;
-    boff = offset % UZ_BLOCKSZ;
-    
-    if (uz_read_raw_block(f,block,local)!=0)
+    boff  = offset % UZ_BLOCKSZ;
+    nb    = (boff + length + UZ_BLOCKSZ - 1) / UZ_BLOCKSZ;
+    if (nb > UZ_BATCH) nb = UZ_BATCH;
+    chunk = nb * UZ_BLOCKSZ - boff;
+    if (chunk > length) chunk = length;
+
+    if (uz_xlate_run(f,inode,offset / UZ_BLOCKSZ,nb,blk)!=0)
+      return -1;
+    for(i=0;i<nb;i++) {
+      req[i].block = blk[i];
+      req[i].buf   = d + i * UZ_BLOCKSZ - boff;
+    }
+    if (boff || chunk < UZ_BLOCKSZ)
+      req[0].buf = head;
+    if (nb > 1 && (boff + chunk) % UZ_BLOCKSZ)
+      req[nb-1].buf = tail;
+
+    if (uz_read_batch(f,req,nb)!=0)
       return -1;
-  
-    maxpayload = UZ_BLOCKSZ - boff;
-    if (length < maxpayload)
-      payload = length;
-    else
-      payload = maxpayload;
 
-    memcpy(dest,local+boff,payload);
-    offset += payload;
-    length -= payload;    
-    dest = dest + payload;
-    accpayload += payload;
+    if (req[0].buf == head)
+      memcpy(d,head + boff,chunk < UZ_BLOCKSZ - boff ? chunk : UZ_BLOCKSZ - boff);
+    if (nb > 1 && req[nb-1].buf == tail)
+      memcpy(d + (nb-1) * UZ_BLOCKSZ - boff,tail,(boff + chunk) % UZ_BLOCKSZ);
+
+    offset += chunk;
+    length -= chunk;
+    d      += chunk;
+    accpayload += chunk;
   }
 
   return accpayload;
 }
 
-int uz_write_data(FILE *f, uz_inode *inode, 
+int uz_read_data(FILE *f, uz_inode *inode,
+		 uint32_t offset, uint32_t length, void *dest)
+{
+  uint64_t t = uz_lat_begin();
+  int tr = uz_trace_enter();
+  int r = uz_do_read_data(f,inode,offset,length,dest);
+  uz_trace_leave(tr,UZ_TR_READ,inode,offset,length,0,0);
+  uz_lat_end(UZ_LAT_READ_DATA,t);
+  return r;
+}
+
+static int uz_do_write_data(FILE *f, uz_inode *inode, 
 		  uint32_t offset, uint32_t length, void *src)
 {
-  int nth, block, boff, maxpayload, payload, accpayload = 0;
-  char local[UZ_BLOCKSZ];
+  uz_ioreq   req[UZ_BATCH];
+  uz_blkno_t blk[UZ_BATCH];
+  uint8_t    head[UZ_BLOCKSZ], tail[UZ_BLOCKSZ];
+  uint8_t   *s = (uint8_t *) src;
+  int i, n, nb, boff, chunk, accpayload = 0;
 
   if (offset >= inode->i_size)
     return 0;
@@ -152,33 +800,64 @@ int uz_write_data(FILE *f, uz_inode *inode,
     length = inode->i_size - offset;
 
   while(length != 0) {
-    nth = offset / UZ_BLOCKSZ;
-    block = uz_xlate_block(f, inode, nth);
-    if (block < 0) return -1;
-    boff = offset % UZ_BLOCKSZ;
-    
-    if (uz_read_raw_block(f,block,local)!=0)
+    boff  = offset % UZ_BLOCKSZ;
+    nb    = (boff + length + UZ_BLOCKSZ - 1) / UZ_BLOCKSZ;
+    if (nb > UZ_BATCH) nb = UZ_BATCH;
+    chunk = nb * UZ_BLOCKSZ - boff;
+    if (chunk > length) chunk = length;
+
+    if (uz_xlate_run(f,inode,offset / UZ_BLOCKSZ,nb,blk)!=0)
       return -1;
-  
-    maxpayload = UZ_BLOCKSZ - boff;
-    if (length < maxpayload)
-      payload = length;
-    else
-      payload = maxpayload;
-
-    memcpy(local+boff,src,payload);
-    if (uz_write_raw_block(f,block,local)!=0)
+
+    /* the partial blocks are read, changed, then written with the rest */
+    n = 0;
+    if (boff || chunk < UZ_BLOCKSZ) {
+      req[n].block = blk[0];
+      req[n++].buf = head;
+    }
+    if (nb > 1 && (boff + chunk) % UZ_BLOCKSZ) {
+      req[n].block = blk[nb-1];
+      req[n++].buf = tail;
+    }
+    if (uz_read_batch(f,req,n)!=0)
       return -1;
 
-    offset += payload;
-    length -= payload;    
-    src = src + payload;
-    accpayload += payload;
+    for(i=0;i<nb;i++) {
+      req[i].block = blk[i];
+      req[i].buf   = s + i * UZ_BLOCKSZ - boff;
+    }
+    if (boff || chunk < UZ_BLOCKSZ) {
+      memcpy(head + boff,s,chunk < UZ_BLOCKSZ - boff ? chunk : UZ_BLOCKSZ - boff);
+      req[0].buf = head;
+    }
+    if (nb > 1 && (boff + chunk) % UZ_BLOCKSZ) {
+      memcpy(tail,s + (nb-1) * UZ_BLOCKSZ - boff,(boff + chunk) % UZ_BLOCKSZ);
+      req[nb-1].buf = tail;
+    }
+
+    if (uz_write_batch(f,req,nb)!=0)
+      return -1;
+
+    offset += chunk;
+    length -= chunk;
+    s      += chunk;
+    accpayload += chunk;
   }
 
   return accpayload;
 }
 
+int uz_write_data(FILE *f, uz_inode *inode,
+		  uint32_t offset, uint32_t length, void *src)
+{
+  uint64_t t = uz_lat_begin();
+  int tr = uz_trace_enter();
+  int r = uz_do_write_data(f,inode,offset,length,src);
+  uz_trace_leave(tr,UZ_TR_WRITE,inode,offset,length,0,0);
+  uz_lat_end(UZ_LAT_WRITE_DATA,t);
+  return r;
+}
+
 /* 18 direct blocks                  :   0 ..    17
    256 indirect blocks               :  18 ..   273
    256 * 256 double indirect blocks  : 274 .. 65809  */
@@ -254,22 +933,810 @@ int uz_set_nth_block(FILE *f, uz_inode *inode, int rank, uz_blkno_t block) {
 
 int uz_read_raw_block(FILE *f, uz_blkno_t block, void *dest) {
   uint32_t offset;
+
+  if (txn && txn->f == f && txn->blk[block]) {
+    memcpy(dest,txn->blk[block],UZ_BLOCKSZ);
+    UZ_COUNT(cache_hits,1);
+    return 0;
+  }
+
   offset = block;
   offset *= UZ_BLOCKSZ;
-  if (fseek(f,offset,SEEK_SET)!=0) return -1;
+  if (uz_seek(f,offset)!=0) return -1;
   if (fread(dest,sizeof(uint8_t),UZ_BLOCKSZ,f)!=UZ_BLOCKSZ) return -1;
+  UZ_COUNT(block_reads,1);
+  UZ_COUNT(bytes_read,UZ_BLOCKSZ);
+  uz_io(UZ_BLOCKSZ,0);
   return 0;
 }
 
 int uz_write_raw_block(FILE *f, uz_blkno_t block, void *src) {
   uint32_t offset;
+  uint8_t *b;
+
+  uz_icache_drop(f,block);
+  if (txn && txn->f == f) {
+    b = uz_txn_block(f, block, 0);
+    if (!b) {
+      b = (uint8_t *) malloc(UZ_BLOCKSZ);
+      if (!b) return -1;
+      txn->blk[block] = b;
+    }
+    memcpy(b,src,UZ_BLOCKSZ);
+    return 0;
+  }
+
   offset = block;
   offset *= UZ_BLOCKSZ;
-  if (fseek(f,offset,SEEK_SET)!=0) return -1;
+  if (uz_seek(f,offset)!=0) return -1;
   if (fwrite(src,sizeof(uint8_t),UZ_BLOCKSZ,f)!=UZ_BLOCKSZ) return -1;
+  UZ_COUNT(block_writes,1);
+  UZ_COUNT(bytes_written,UZ_BLOCKSZ);
+  uz_io(UZ_BLOCKSZ,1);
   return 0;  
 }
 
+/* transactions */
+
+/* returns the pending copy of a block, if load is set one is made
+   from the image when there is none yet */
+static uint8_t * uz_txn_block(FILE *f, uz_blkno_t block, int load) {
+  uint8_t *b;
+
+  if (txn->blk[block] || !load)
+    return(txn->blk[block]);
+
+  b = (uint8_t *) malloc(UZ_BLOCKSZ);
+  if (!b) return 0;
+  if (uz_read_raw_block(f,block,b)!=0) {
+    free(b);
+    return 0;
+  }
+  txn->blk[block] = b;
+  return b;
+}
+
+static void uz_txn_end(void) {
+  int i;
+  for(i=0;i<65536;i++)
+    if (txn->blk[i]) free(txn->blk[i]);
+  free(txn->blk);
+  free(txn);
+  txn = 0;
+}
+
+int uz_begin(FILE *f, uz_sblock *sb) {
+  if (txn) return -1; /* no nesting */
+
+  txn = (uz_txn *) calloc(1,sizeof(uz_txn));
+  if (!txn) return -1;
+  txn->blk = (uint8_t **) calloc(65536,sizeof(uint8_t *));
+  if (!txn->blk) {
+    free(txn);
+    txn = 0;
+    return -1;
+  }
+  txn->f = f;
+  memcpy(&(txn->sb),sb,sizeof(uz_sblock));
+  return 0;
+}
+
+void uz_abort(FILE *f) {
+  if (!txn || txn->f != f) return;
+  uz_txn_end();
+  ++uz_sbgen; /* anything cached meanwhile may be uncommitted */
+}
+
+#define UZ_UNDOSIG "UZUNDO1"
+
+/* undo log layout: 8-byte signature, u16 record count (written last,
+   0 while the log is incomplete), then per record the u16 block # and
+   the block's old contents */
+
+/* the log is not the image: plain stdio, out of uz_stats and the
+   I/O hook */
+static int uz_undo_put16(FILE *u, uint16_t v) {
+  uint8_t b[2];
+  b[0] = v & 0xff;
+  b[1] = v >> 8;
+  return(fwrite(b,1,2,u) == 2 ? 0 : -1);
+}
+
+static int uz_undo_get16(FILE *u, uint16_t *v) {
+  uint8_t b[2];
+  if (fread(b,1,2,u)!=2) return -1;
+  *v = b[0] | (b[1] << 8);
+  return 0;
+}
+
+static int uz_undo_save(uz_txn *t, FILE *f, char *undolog) {
+  FILE *u;
+  uint8_t old[UZ_BLOCKSZ];
+  uint16_t n = 0;
+  int b;
+
+  u = fopen(undolog,"w");
+  if (!u) return -1;
+  if (fwrite(UZ_UNDOSIG,1,8,u)!=8) goto fail;
+  if (uz_undo_put16(u,n)!=0) goto fail;
+
+  for(b=0;b<65536;b++) {
+    if (!t->blk[b] && !(b == UZ_SBLOCK && t->sbdirty))
+      continue;
+    if (uz_read_raw_block(f,b,old)!=0) goto fail;
+    if (uz_undo_put16(u,b)!=0) goto fail;
+    if (fwrite(old,1,UZ_BLOCKSZ,u)!=UZ_BLOCKSZ) goto fail;
+    ++n;
+  }
+
+  if (fflush(u)!=0 || fsync(fileno(u))!=0) goto fail;
+  if (fseek(u,8,SEEK_SET)!=0 || uz_undo_put16(u,n)!=0) goto fail;
+  if (fflush(u)!=0 || fsync(fileno(u))!=0) goto fail;
+  fclose(u);
+  return 0;
+
+ fail:
+  fclose(u);
+  return -1;
+}
+
+/* writes every pending block once, in ascending order, then the
+   superblock. if undolog is not null the old contents are saved there
+   first and the log is removed when the commit is complete */
+int uz_commit(FILE *f, char *undolog) {
+  uz_txn *t = txn;
+  int b, prev = -2;
+
+  if (!t || t->f != f) return -1;
+
+  /* the reads and writes below must really hit the image */
+  txn = 0;
+
+  if (undolog && uz_undo_save(t,f,undolog)!=0)
+    goto fail;
+
+  for(b=0;b<65536;b++) {
+    if (!t->blk[b]) continue;
+    if (b != prev + 1)
+      if (uz_seek(f,(uint32_t) b * UZ_BLOCKSZ)!=0) goto fail;
+    if (fwrite(t->blk[b],1,UZ_BLOCKSZ,f)!=UZ_BLOCKSZ) goto fail;
+    UZ_COUNT(block_writes,1);
+    UZ_COUNT(bytes_written,UZ_BLOCKSZ);
+    uz_io(UZ_BLOCKSZ,1);
+    prev = b;
+  }
+  if (t->sbdirty)
+    if (uz_write_sblock(f,&(t->sb))!=0) goto fail;
+  if (fflush(f)!=0) goto fail;
+
+  if (undolog) {
+    if (fsync(fileno(f))!=0) goto fail;
+    remove(undolog);
+  }
+
+  txn = t;
+  uz_txn_end();
+  return 0;
+
+ fail:
+  txn = t;
+  return -1;
+}
+
+/* puts back the blocks saved in an undo log by an interrupted commit.
+   a missing or incomplete log means the image was never touched */
+int uz_rollback(FILE *f, char *undolog) {
+  FILE *u;
+  char sig[8];
+  uint8_t old[UZ_BLOCKSZ];
+  uint16_t n, i, b;
+
+  u = fopen(undolog,"r");
+  if (!u) return 0;
+
+  /* cut short before its header was on disk */
+  if (fread(sig,1,8,u)!=8 ||
+      (!memcmp(sig,UZ_UNDOSIG,8) && uz_undo_get16(u,&n)!=0)) {
+    fclose(u);
+    remove(undolog);
+    return 0;
+  }
+  if (memcmp(sig,UZ_UNDOSIG,8)) {
+    fclose(u);
+    return -1; /* not ours, leave it alone */
+  }
+
+  for(i=0;i<n;i++) {
+    if (uz_undo_get16(u,&b)!=0) goto fail;
+    if (fread(old,1,UZ_BLOCKSZ,u)!=UZ_BLOCKSZ) goto fail;
+    if (uz_write_raw_block(f,b,old)!=0) goto fail;
+  }
+  if (fflush(f)!=0 || fsync(fileno(f))!=0) goto fail;
+
+  fclose(u);
+  remove(undolog);
+  ++uz_sbgen;
+  return 0;
+
+ fail:
+  fclose(u);
+  return -1;
+}
+
+/* reads count consecutive blocks with a single seek */
+int uz_read_blocks(FILE *f, uz_blkno_t first, int count, void *dest) {
+  uint32_t offset;
+  int i;
+
+  if (txn && txn->f == f) {
+    for(i=0;i<count;i++)
+      if (uz_read_raw_block(f,first+i,(uint8_t *)dest + i*UZ_BLOCKSZ)!=0)
+	return -1;
+    return 0;
+  }
+
+  offset = first;
+  offset *= UZ_BLOCKSZ;
+  if (uz_seek(f,offset)!=0) return -1;
+  if (fread(dest,UZ_BLOCKSZ,count,f)!=count) return -1;
+  UZ_COUNT(block_reads,count);
+  UZ_COUNT(bytes_read,count * UZ_BLOCKSZ);
+  uz_io(count * UZ_BLOCKSZ,0);
+  return 0;
+}
+
+/* batches. requests are sorted by block, keeping the order of those
+   on the same block, and each run of consecutive blocks is done with
+   one seek: a whole batch is one sweep across the image */
+
+static int uz_cmp_key(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+#define UZ_KEYS 256
+
+/* block in the high half, request number in the low one. small
+   batches use local, which must hold UZ_KEYS */
+static uint64_t * uz_batch_sort(uz_ioreq *req, int n, uint64_t *local) {
+  uint64_t *key = local;
+  int i;
+
+  if (n > UZ_KEYS) key = (uint64_t *) malloc(n * sizeof(uint64_t));
+  if (!key) return 0;
+  for(i=0;i<n;i++)
+    key[i] = ((uint64_t) req[i].block << 32) | i;
+  qsort(key,n,sizeof(uint64_t),uz_cmp_key);
+  return key;
+}
+
+#define UZ_RUNMAX 64  /* blocks in one read or write */
+#define UZ_KREQ(k) (&req[(k) & 0xffffffff])
+
+int uz_read_batch(FILE *f, uz_ioreq *req, int n) {
+  uint8_t run[UZ_RUNMAX * UZ_BLOCKSZ];
+  uint64_t local[UZ_KEYS], *key;
+  uz_ioreq *a, *p;
+  int i, j, len, direct;
+
+  if (n <= 0) return 0;
+  if (n == 1) return(uz_read_raw_block(f,req->block,req->buf));
+  key = uz_batch_sort(req,n,local);
+  if (!key) return -1;
+
+  for(i=0;i<n;i=j) {
+    /* consecutive blocks; a block asked for twice is read once. when
+       the buffers follow each other too, the read goes straight in */
+    len = 1;
+    direct = 1;
+    for(j=i+1;j<n;j++) {
+      a = UZ_KREQ(key[j]);
+      p = UZ_KREQ(key[j-1]);
+      if (a->block == p->block) {
+	direct = 0;
+	continue;
+      }
+      if (a->block != p->block + 1 || len == UZ_RUNMAX) break;
+      if (a->buf != p->buf + UZ_BLOCKSZ) direct = 0;
+      ++len;
+    }
+
+    a = UZ_KREQ(key[i]);
+    if (direct) {
+      if (uz_read_blocks(f,a->block,len,a->buf)!=0) goto fail;
+      continue;
+    }
+    if (uz_read_blocks(f,a->block,len,run)!=0) goto fail;
+    for(;i<j;i++) {
+      p = UZ_KREQ(key[i]);
+      memcpy(p->buf,run + (p->block - a->block) * UZ_BLOCKSZ,UZ_BLOCKSZ);
+    }
+  }
+  if (key != local) free(key);
+  return 0;
+
+ fail:
+  if (key != local) free(key);
+  return -1;
+}
+
+int uz_write_batch(FILE *f, uz_ioreq *req, int n) {
+  uint64_t local[UZ_KEYS], *key;
+  uz_ioreq *a;
+  int i, prev = -2;
+
+  if (n <= 0) return 0;
+  if (n == 1) return(uz_write_raw_block(f,req->block,req->buf));
+  key = uz_batch_sort(req,n,local);
+  if (!key) return -1;
+
+  for(i=0;i<n;i++) {
+    /* of the writes to one block the last one asked for wins */
+    if (i+1 < n && (key[i+1] >> 32) == (key[i] >> 32)) continue;
+    a = UZ_KREQ(key[i]);
+    if (txn && txn->f == f) {
+      if (uz_write_raw_block(f,a->block,a->buf)!=0) goto fail;
+      continue;
+    }
+    uz_icache_drop(f,a->block);
+    if (a->block != prev + 1)
+      if (uz_seek(f,(uint32_t) a->block * UZ_BLOCKSZ)!=0) goto fail;
+    if (fwrite(a->buf,1,UZ_BLOCKSZ,f)!=UZ_BLOCKSZ) goto fail;
+    UZ_COUNT(block_writes,1);
+    UZ_COUNT(bytes_written,UZ_BLOCKSZ);
+    uz_io(UZ_BLOCKSZ,1);
+    prev = a->block;
+  }
+  if (key != local) free(key);
+  return 0;
+
+ fail:
+  if (key != local) free(key);
+  return -1;
+}
+
+/* reads and decodes the whole inode table in one go. table must hold
+   s_isize * UZ_IPB inodes */
+int uz_read_itable(FILE *f, uz_sblock *sb, uz_inode *table) {
+  uint8_t *raw;
+  int i, n;
+
+  n = sb->s_isize * UZ_IPB;
+  raw = (uint8_t *) malloc(sb->s_isize * UZ_BLOCKSZ);
+  if (!raw) return -1;
+
+  if (uz_read_blocks(f,sb->s_reserv,sb->s_isize,raw)!=0) {
+    free(raw);
+    return -1;
+  }
+
+  for(i=0;i<n;i++)
+    uz_decode_inode(raw + i*UZ_ILEN, &table[i]);
+
+  free(raw);
+  return 0;
+}
+
+/* lists the physical blocks of an inode, reading each index block
+   once: map[rank] for every data block, idx[] for the index blocks
+   (single indirect, double indirect, then its second level ones).
+   index pointers outside the data area are listed but not followed,
+   the data blocks under them come out as 0. device inodes have no
+   blocks. returns the number of data blocks */
+int uz_inode_map(FILE *f, uz_sblock *sb, uz_inode *inode,
+		 uz_blkno_t *map, uz_blkno_t *idx, int *nidx)
+{
+  uint16_t blk[256], top[256];
+  int i, k, n, lo, hi, ni = 0;
+
+  *nidx = 0;
+  if ((inode->i_mode & UZ_IFMT) == UZ_IFBLK ||
+      (inode->i_mode & UZ_IFMT) == UZ_IFCHR)
+    return 0;
+  if (inode->i_size < 0 || inode->i_size > UZ_MAXBLOCKS * UZ_BLOCKSZ)
+    return -1;
+
+  n  = uz_fit_bytes(inode->i_size);
+  lo = sb->s_reserv + sb->s_isize;
+  hi = sb->s_fsize;
+
+  // direct
+  for(i=0;i<n && i<18;i++)
+    map[i] = inode->i_addr[i];
+
+  // single indirect
+  if (n > 18) {
+    k = idx[ni++] = inode->i_addr[18];
+    if (k >= lo && k < hi) {
+      if (uz_read_raw_block(f,k,(void *)blk)!=0) return -1;
+    } else
+      memset(blk,0,UZ_BLOCKSZ);
+    for(i=18;i<n && i<274;i++)
+      map[i] = u16_to_le(blk[i-18]);
+  }
+
+  // double indirect
+  if (n > 274) {
+    k = idx[ni++] = inode->i_addr[19];
+    if (k >= lo && k < hi) {
+      if (uz_read_raw_block(f,k,(void *)top)!=0) return -1;
+    } else
+      memset(top,0,UZ_BLOCKSZ);
+    for(i=274;i<n;i++) {
+      if ((i-274) % 256 == 0) {
+	k = idx[ni++] = u16_to_le(top[(i-274) / 256]);
+	if (k >= lo && k < hi) {
+	  if (uz_read_raw_block(f,k,(void *)blk)!=0) return -1;
+	} else
+	  memset(blk,0,UZ_BLOCKSZ);
+      }
+      map[i] = u16_to_le(blk[(i-274) % 256]);
+    }
+  }
+
+  *nidx = ni;
+  return n;
+}
+
+/* lists the blocks of an inode in the order a sequential read uses
+   them, each index block right before the first data block it
+   addresses (the order uz_inode_grow allocates them in). holes are
+   left out. seq must hold UZ_MAXBLOCKS + UZ_MAXINDEX entries.
+   returns the number of blocks */
+int uz_inode_layout(FILE *f, uz_sblock *sb, uz_inode *inode, uz_blkno_t *seq)
+{
+  uz_blkno_t idx[UZ_MAXINDEX], *map;
+  int r, n, ni, k = 0, w = 0;
+
+  /* the data map goes to the tail and is merged forward in place;
+     at most ni entries are inserted, so reads stay ahead of writes */
+  map = seq + UZ_MAXINDEX;
+  n = uz_inode_map(f,sb,inode,map,idx,&ni);
+  if (n < 0) return -1;
+
+  for(r=0;r<n;r++) {
+    if (r == 18 || (r >= 274 && (r-274) % 256 == 0)) {
+      if (idx[k]) seq[w++] = idx[k];
+      ++k;
+      if (r == 274) {
+	if (idx[k]) seq[w++] = idx[k];
+	++k;
+      }
+    }
+    if (map[r]) seq[w++] = map[r];
+  }
+  return w;
+}
+
+/* rebuilds the free block list from scratch: every data area block
+   with inuse[block] == 0 is free. a 0 at the bottom of the list ends
+   it, as UZIX does, and blocks are pushed in descending order so that
+   uz_alloc_block hands them out in ascending order */
+int uz_rebuild_freelist(FILE *f, uz_sblock *sb, uint8_t *inuse) {
+  int b, lo;
+
+  lo = sb->s_reserv + sb->s_isize;
+  memset(sb->s_free,0,sizeof(sb->s_free));
+  sb->s_nfree = 1;
+  sb->s_tfree = 0;
+
+  for(b=sb->s_fsize-1;b>=lo;b--)
+    if (!inuse[b])
+      if (uz_free_block(f,sb,b)!=0) return -1;
+
+  return(uz_write_sblock(f,sb));
+}
+
+#define UZ_NEWPOS(b) (((b) && newpos[b]) ? newpos[b] : (b))
+
+/* rewrites the block pointers of one inode after a relocation and
+   marks all of its blocks (at their new places) in inuse */
+static int uz_relocate_inode(FILE *f, uz_sblock *sb, uz_ino_t ino,
+			     uz_blkno_t *newpos, uint8_t *inuse)
+{
+  uz_inode x;
+  uint16_t blk[256], top[256];
+  int i, k, b, n, lo, hi;
+
+  lo = sb->s_reserv + sb->s_isize;
+  hi = sb->s_fsize;
+
+  if (uz_read_inode(f,sb,ino,&x)!=0) return -1;
+  if (x.i_mode == 0 && x.i_nlink == 0) return 0;
+  if ((x.i_mode & UZ_IFMT) == UZ_IFBLK || (x.i_mode & UZ_IFMT) == UZ_IFCHR)
+    return 0;
+  if (x.i_size < 0 || x.i_size > UZ_MAXBLOCKS * UZ_BLOCKSZ) return -1;
+
+  n = uz_fit_bytes(x.i_size);
+
+  for(i=0;i<n && i<18;i++) {
+    b = x.i_addr[i] = UZ_NEWPOS(x.i_addr[i]);
+    if (b >= lo && b < hi) inuse[b] = 1;
+  }
+
+  if (n > 18) {
+    b = x.i_addr[18] = UZ_NEWPOS(x.i_addr[18]);
+    if (b >= lo && b < hi) {
+      inuse[b] = 1;
+      if (uz_read_raw_block(f,b,(void *)blk)!=0) return -1;
+      for(i=18;i<n && i<274;i++) {
+	k = UZ_NEWPOS(u16_to_le(blk[i-18]));
+	blk[i-18] = u16_to_le(k);
+	if (k >= lo && k < hi) inuse[k] = 1;
+      }
+      if (uz_write_raw_block(f,b,(void *)blk)!=0) return -1;
+    }
+  }
+
+  if (n > 274) {
+    b = x.i_addr[19] = UZ_NEWPOS(x.i_addr[19]);
+    if (b >= lo && b < hi) {
+      inuse[b] = 1;
+      if (uz_read_raw_block(f,b,(void *)top)!=0) return -1;
+      for(k=0;274+k*256<n;k++) {
+	b = UZ_NEWPOS(u16_to_le(top[k]));
+	top[k] = u16_to_le(b);
+	if (b < lo || b >= hi) continue;
+	inuse[b] = 1;
+	if (uz_read_raw_block(f,b,(void *)blk)!=0) return -1;
+	for(i=274+k*256;i<n && i<274+(k+1)*256;i++) {
+	  int d = UZ_NEWPOS(u16_to_le(blk[(i-274) % 256]));
+	  blk[(i-274) % 256] = u16_to_le(d);
+	  if (d >= lo && d < hi) inuse[d] = 1;
+	}
+	if (uz_write_raw_block(f,b,(void *)blk)!=0) return -1;
+      }
+      if (uz_write_raw_block(f,x.i_addr[19],(void *)top)!=0) return -1;
+    }
+  }
+
+  return(uz_write_inode(f,sb,ino,&x));
+}
+
+/* moves every block b with newpos[b] != 0 to newpos[b], rewrites all
+   pointers to it and rebuilds the free block list. newpos holds 65536
+   entries, zero past the end of the filesystem. destinations must
+   be distinct data area blocks that are free or moving themselves.
+   each block is copied once: a chain of moves is done from its free
+   end backwards, a cycle through one spare buffer */
+int uz_relocate(FILE *f, uz_sblock *sb, uz_blkno_t *newpos) {
+  uint8_t *done, *inuse, buf[UZ_BLOCKSZ], tmp[UZ_BLOCKSZ];
+  uz_blkno_t *path;
+  int b, d, i, n, lo, hi, ret = -1;
+
+  lo = sb->s_reserv + sb->s_isize;
+  hi = sb->s_fsize;
+
+  done  = (uint8_t *) calloc(65536,1);
+  inuse = (uint8_t *) calloc(65536,1);
+  path  = (uz_blkno_t *) malloc(65536 * sizeof(uz_blkno_t));
+  if (!done || !inuse || !path) goto out;
+
+  /* done doubles as the set of destinations while validating */
+  for(b=0;b<hi;b++) {
+    if (newpos[b] == b) newpos[b] = 0;
+    if (!newpos[b]) continue;
+    d = newpos[b];
+    if (b < lo || d < lo || d >= hi || done[d]) goto out;
+    done[d] = 1;
+  }
+  memset(done,0,65536);
+
+#define UZ_PENDING(b) (newpos[b] && !done[b])
+
+  for(b=lo;b<hi;b++) {
+    if (!UZ_PENDING(b)) continue;
+
+    n = 0;
+    d = b;
+    do {
+      path[n++] = d;
+      d = newpos[d];
+    } while(d != b && UZ_PENDING(d));
+
+    if (d == b) { /* cycle */
+      if (uz_read_raw_block(f,path[n-1],(void *)tmp)!=0) goto out;
+      for(i=n-2;i>=0;i--) {
+	if (uz_read_raw_block(f,path[i],(void *)buf)!=0) goto out;
+	if (uz_write_raw_block(f,path[i+1],(void *)buf)!=0) goto out;
+      }
+      if (uz_write_raw_block(f,b,(void *)tmp)!=0) goto out;
+    } else {
+      for(i=n-1;i>=0;i--) {
+	if (uz_read_raw_block(f,path[i],(void *)buf)!=0) goto out;
+	if (uz_write_raw_block(f,newpos[path[i]],(void *)buf)!=0) goto out;
+      }
+    }
+    for(i=0;i<n;i++) done[path[i]] = 1;
+  }
+
+#undef UZ_PENDING
+
+  for(i=1;i<sb->s_isize * UZ_IPB;i++)
+    if (uz_relocate_inode(f,sb,i,newpos,inuse)!=0) goto out;
+
+  ret = uz_rebuild_freelist(f,sb,inuse);
+
+ out:
+  ++uz_sbgen; /* directory indexes and cached inodes name old blocks */
+  free(done);
+  free(inuse);
+  free(path);
+  return ret;
+}
+
+static void uz_bm_set(uz_sblock *sb, uz_bmentry *map, int block,
+		      int ino, int kind, int32_t rank)
+{
+  if (block < sb->s_reserv + sb->s_isize || block >= sb->s_fsize) return;
+  if (map[block].b_kind != UZ_BM_LEAKED) return;
+  map[block].b_ino  = ino;
+  map[block].b_kind = kind;
+  map[block].b_rank = rank;
+}
+
+int uz_block_map(FILE *f, uz_sblock *sb, uz_bmentry *map) {
+  uz_inode *table;
+  uz_blkno_t *dmap, idx[UZ_MAXINDEX], list[50];
+  uint16_t nc[256];
+  int i, j, n, ni, b, lo, steps, ninodes;
+
+  lo = sb->s_reserv + sb->s_isize;
+  if (lo >= sb->s_fsize) return -1;
+
+  ninodes = sb->s_isize * UZ_IPB;
+  table = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  dmap  = (uz_blkno_t *) malloc(UZ_MAXBLOCKS * sizeof(uz_blkno_t));
+  if (!table || !dmap || uz_read_itable(f,sb,table)!=0) {
+    free(table);
+    free(dmap);
+    return -1;
+  }
+
+  for(b=0;b<sb->s_fsize;b++) {
+    map[b].b_ino  = 0;
+    map[b].b_rank = 0;
+    if (b == 0)               map[b].b_kind = UZ_BM_BOOT;
+    else if (b == UZ_SBLOCK)  map[b].b_kind = UZ_BM_SUPER;
+    else if (b < sb->s_reserv) map[b].b_kind = UZ_BM_RESERVED;
+    else if (b < lo)          map[b].b_kind = UZ_BM_ITABLE;
+    else                      map[b].b_kind = UZ_BM_LEAKED;
+  }
+
+  /* inode 0 is reserved */
+  for(i=1;i<ninodes;i++) {
+    if (table[i].i_mode == 0 && table[i].i_nlink == 0) continue;
+    n = uz_inode_map(f,sb,&table[i],dmap,idx,&ni);
+    if (n < 0) continue;
+    for(j=0;j<ni;j++)
+      uz_bm_set(sb,map,idx[j],i,UZ_BM_INDEX,
+		j == 0 ? 18 : (j == 1 ? -1 : 274 + (j-2) * 256));
+    for(j=0;j<n;j++)
+      uz_bm_set(sb,map,dmap[j],i,UZ_BM_DATA,j);
+  }
+
+  free(table);
+  free(dmap);
+
+  /* free list, either ending in a 0 entry or in an empty cache */
+  n = sb->s_nfree > 50 ? 0 : sb->s_nfree;
+  memcpy(list,sb->s_free,sizeof(list));
+  for(steps=0;n > 0 && steps <= sb->s_fsize / 50 + 1;steps++) {
+    for(i=0;i<n;i++)
+      uz_bm_set(sb,map,list[i],0,UZ_BM_FREE,0);
+    b = list[0];
+    if (b < lo || b >= sb->s_fsize) break;
+    if (uz_read_raw_block(f,b,(void *)nc)!=0) return -1;
+    n = u16_to_le(nc[0]);
+    if (n > 50) break;
+    for(i=0;i<n;i++)
+      list[i] = u16_to_le(nc[i+1]);
+  }
+
+  return 0;
+}
+
+int uz_scan_newer(FILE *f, uz_sblock *sb, long since, uint8_t *hit) {
+  uz_inode *table, *x;
+  int i, n = 0, ninodes;
+
+  ninodes = sb->s_isize * UZ_IPB;
+  table = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  if (!table || uz_read_itable(f,sb,table)!=0) {
+    free(table);
+    return -1;
+  }
+
+  /* inode 0 is reserved */
+  hit[0] = 0;
+  for(i=1;i<ninodes;i++) {
+    x = &table[i];
+    hit[i] = !(x->i_mode == 0 && x->i_nlink == 0) &&
+      (uz_time_to_unix(&x->i_mtime) > since ||
+       uz_time_to_unix(&x->i_ctime) > since);
+    n += hit[i];
+  }
+
+  free(table);
+  return n;
+}
+
+int uz_mkfs(FILE *f, uz_sblock *sb, int fblocks, int iblocks, int rblocks,
+	    uint8_t *boot)
+{
+  uint8_t buf[UZ_BLOCKSZ];
+  uz_inode inode;
+  uz_direntry rdir[2];
+  int i, j;
+
+  if (fblocks > 65535 || rblocks + iblocks + 2 >= fblocks) return -1;
+  ++uz_sbgen;
+
+  /* initialize the full length with zeros */
+  memset(buf,0,UZ_BLOCKSZ);
+  if (uz_seek(f,0)!=0) return -1;
+  for(i=0;i<fblocks;i++)
+    if (fwrite(buf,1,UZ_BLOCKSZ,f)!=UZ_BLOCKSZ) return -1;
+  UZ_COUNT(block_writes,fblocks);
+  UZ_COUNT(bytes_written,fblocks * UZ_BLOCKSZ);
+  uz_io(fblocks * UZ_BLOCKSZ,1);
+
+  if (uz_write_raw_block(f,0,boot)!=0) return -1;
+
+  memset(sb,0,sizeof(uz_sblock));
+  sb->s_mounted = UZ_SBSIG;
+  sb->s_reserv  = rblocks + 2;
+  sb->s_isize   = iblocks;
+  sb->s_fsize   = fblocks;
+  sb->s_tinode  = iblocks * UZ_IPB - 2;
+
+  /* free list: every data block but the first one, which holds the
+     root directory */
+  j = fblocks - 1;
+  while(j > 2 + rblocks + iblocks) {
+    if (sb->s_nfree == 50) {
+      if (uz_seek(f,j*UZ_BLOCKSZ)!=0) return -1;
+      if (write_u16(f,&(sb->s_nfree),1)!=0) return -1;
+      if (write_u16(f,&(sb->s_free[0]),50)!=0) return -1;
+      sb->s_nfree = 0;
+      memset(sb->s_free,0,sizeof(sb->s_free));
+    }
+    sb->s_tfree++;
+    sb->s_free[sb->s_nfree++] = j--;
+  }
+
+  /* root directory (1) */
+  memset(&inode,0,sizeof(inode));
+  inode.i_mode    = UZ_IFDIR | 0755;
+  inode.i_nlink   = 3;
+  inode.i_size    = 2 * UZ_DIRELEN;
+  inode.i_addr[0] = 2 + rblocks + iblocks;
+  if (uz_write_inode(f,sb,UZ_ROOT,&inode)!=0) return -1;
+
+  memset(rdir,0,sizeof(rdir));
+  rdir[0].d_ino = rdir[1].d_ino = UZ_ROOT;
+  rdir[0].d_name[0] = rdir[1].d_name[0] = rdir[1].d_name[1] = '.';
+  if (uz_seek(f,(sb->s_reserv + iblocks)*UZ_BLOCKSZ)!=0) return -1;
+  for(i=0;i<2;i++) {
+    if (write_u16(f,&(rdir[i].d_ino),1)!=0)           return -1;
+    if (write_u8(f,&(rdir[i].d_name[0]),UZ_DIRNAMELEN)!=0) return -1;
+  }
+
+  /* reserved inode (0) */
+  memset(&inode,0,sizeof(inode));
+  inode.i_nlink = 1;
+  inode.i_mode  = ~0;
+  if (uz_write_inode(f,sb,0,&inode)!=0) return -1;
+
+  /* free inodes in first inode block */
+  for(j=UZ_ROOT+1;j<UZ_IPB && sb->s_ninode<50;j++)
+    sb->s_inode[sb->s_ninode++] = j;
+
+  uz_time(&(sb->s_time));
+  if (uz_write_sblock(f,sb)!=0) return -1;
+  return(fflush(f));
+}
+
 uz_blkno_t uz_fit_bytes(uz_off_t length) {
   uz_off_t x;
   x = length / UZ_BLOCKSZ;
@@ -277,154 +1744,212 @@ uz_blkno_t uz_fit_bytes(uz_off_t length) {
   return( (uz_blkno_t) x );
 }
 
-int uz_inode_remove(FILE *f, uz_sblock *sb, uz_ino_t inode) {
+static int uz_do_inode_remove(FILE *f, uz_sblock *sb, uz_ino_t inode) {
   if (uz_inode_implode(f,sb,inode)!=0) return -1;
   if (uz_free_inode(f,sb,inode)!=0) return -1;
   if (uz_write_sblock(f,sb)!=0) return -1;
   return 0;
 }
 
+int uz_inode_remove(FILE *f, uz_sblock *sb, uz_ino_t inode) {
+  int tr = uz_trace_enter();
+  int r = uz_do_inode_remove(f,sb,inode);
+  uz_trace_leave(tr,UZ_TR_REMOVE,0,inode,0,0,0);
+  return r;
+}
+
 int uz_inode_implode(FILE *f, uz_sblock *sb, uz_ino_t inode) {
-  uz_blkno_t x;
-  int i,j,k;
-  uz_inode z;
-  uint16_t blk[256], iblk[256];
+  uint64_t t = uz_lat_begin();
+  int tr = uz_trace_enter();
+  int r = uz_inode_truncate(f,sb,inode,0);
+  uz_trace_leave(tr,UZ_TR_IMPLODE,0,inode,0,0,0);
+  uz_lat_end(UZ_LAT_IMPLODE,t);
+  return r;
+}
+
+/* number of index blocks needed to address nblocks data blocks */
+static int uz_index_blocks(int nblocks) {
+  int n = 0;
+  if (nblocks > 18)  ++n;
+  if (nblocks > 274) n += 1 + (nblocks - 274 + 255) / 256;
+  return n;
+}
 
-  if (uz_read_inode(f,sb,inode,&z)!=0) return -1;
-  x = uz_fit_bytes(z.i_size);
+/* frees data blocks from the end of the inode until it fits length
+   bytes, dropping index blocks as they become empty. blocks are freed
+   in descending rank order so that a later grow gets them back in
+   ascending order from the free block cache */
+static int uz_do_inode_truncate(FILE *f, uz_sblock *sb, uz_ino_t inode,
+				uz_off_t length)
+{
+  uz_inode x;
+  int i, k, r, nblocks, oblocks, leaf = -1;
+  int sdirty = 0, tdirty = 0, ldirty = 0;
+  uint16_t sind[256], top[256], lblk[256];
 
-  // direct blocks
-  for(i=0;i<x && i<18;i++) {
-    if (uz_free_block(f,sb,z.i_addr[i])!=0) return -1;
-    z.i_addr[i] = 0;
-  }
+  if (uz_read_inode(f,sb,inode,&x)!=0) return -1;
+  if (length < 0 || length > x.i_size) return -1;
 
-  // single indirect
-  if (x>=18) {
-    if (uz_read_raw_block(f,z.i_addr[18],(void *)blk)!=0) return -1;
-    for(i=0;i<256;i++) blk[i] = u16_to_le(blk[i]);
-    for(i=18;i<274 && i<x;i++)
-      if (uz_free_block(f,sb,blk[i-18])!=0) return -1;
-    if (uz_free_block(f,sb,z.i_addr[18])!=0) return -1;
-    z.i_addr[18] = 0;
-  }
+  oblocks = uz_fit_bytes(x.i_size);
+  nblocks = uz_fit_bytes(length);
 
   // double indirect
-  if (x>=274) {
-    if (uz_read_raw_block(f,z.i_addr[19],(void *)iblk)!=0) return -1;
-    for(i=0;i<256;i++) iblk[i] = u16_to_le(iblk[i]);
-    for(i=274;i<x;i++) {
-      j = uz_xlate_block(f,&z,i); if (j<0) return -1;
-      if (uz_free_block(f,sb,j)!=0) return -1;
-      k = (j-274) / 256;
-      if (iblk[k]!=0) {
-	if (uz_free_block(f,sb,iblk[k])!=0) return -1;
-	iblk[k] = 0;
+  if (oblocks > 274 && x.i_addr[19]) {
+    if (uz_read_raw_block(f,x.i_addr[19],(void *)top)!=0) return -1;
+    for(i=oblocks-1;i>=274 && i>=nblocks;i--) {
+      k = (i-274) / 256;
+      r = (i-274) % 256;
+      if (!top[k]) { i -= r; continue; }
+      if (k != leaf) {
+	if (uz_read_raw_block(f,u16_to_le(top[k]),(void *)lblk)!=0) return -1;
+	leaf = k;
+      }
+      if (lblk[r]) {
+	if (uz_free_block(f,sb,u16_to_le(lblk[r]))!=0) return -1;
+	lblk[r] = 0;
+	ldirty = 1;
+      }
+      if (r == 0) {
+	if (uz_free_block(f,sb,u16_to_le(top[k]))!=0) return -1;
+	top[k] = 0;
+	tdirty = 1;
+	ldirty = 0;
+	leaf = -1;
       }
     }
-    if (uz_free_block(f,sb,z.i_addr[19])!=0) return -1;
-    z.i_addr[19] = 0;
+    if (ldirty)
+      if (uz_write_raw_block(f,u16_to_le(top[leaf]),(void *)lblk)!=0) return -1;
+    if (nblocks <= 274) {
+      if (uz_free_block(f,sb,x.i_addr[19])!=0) return -1;
+      x.i_addr[19] = 0;
+    } else if (tdirty)
+      if (uz_write_raw_block(f,x.i_addr[19],(void *)top)!=0) return -1;
+  }
+
+  // single indirect
+  if (oblocks > 18 && nblocks < 274 && x.i_addr[18]) {
+    if (uz_read_raw_block(f,x.i_addr[18],(void *)sind)!=0) return -1;
+    i = oblocks < 274 ? oblocks : 274;
+    for(--i;i>=18 && i>=nblocks;i--)
+      if (sind[i-18]) {
+	if (uz_free_block(f,sb,u16_to_le(sind[i-18]))!=0) return -1;
+	sind[i-18] = 0;
+	sdirty = 1;
+      }
+    if (nblocks <= 18) {
+      if (uz_free_block(f,sb,x.i_addr[18])!=0) return -1;
+      x.i_addr[18] = 0;
+    } else if (sdirty)
+      if (uz_write_raw_block(f,x.i_addr[18],(void *)sind)!=0) return -1;
   }
 
-  z.i_size = 0;
-  if (uz_write_inode(f,sb,inode,&z)!=0) return -1;
+  // direct
+  i = oblocks < 18 ? oblocks : 18;
+  for(--i;i>=nblocks;i--)
+    if (x.i_addr[i]) {
+      if (uz_free_block(f,sb,x.i_addr[i])!=0) return -1;
+      x.i_addr[i] = 0;
+    }
+
+  x.i_size = length;
+  if (uz_write_inode(f,sb,inode,&x)!=0) return -1;
   if (uz_write_sblock(f,sb)!=0) return -1;
   return 0;
 }
 
-int uz_inode_grow(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length) 
+int uz_inode_truncate(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length)
+{
+  int tr = uz_trace_enter();
+  int r = uz_do_inode_truncate(f,sb,inode,length);
+  uz_trace_leave(tr,UZ_TR_TRUNCATE,0,inode,length,0,0);
+  return r;
+}
+
+/* allocates blocks for the inode until it holds length bytes. each
+   index block is allocated right before the first data block it
+   addresses, so on a clean free list the file comes out contiguous */
+static int uz_do_inode_grow(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length) 
 {
   uz_inode x;
-  int i, j, k, nblocks, oblocks;
-  uint8_t have_sind, have_dindi, have_dind[256];
-  uint8_t want_sind, want_dindi, want_dind[256];
-  uint16_t blk[256], iblk[256];
+  int i, j, k, nblocks, oblocks, leaf = -1;
+  int sload = 0, tload = 0, sdirty = 0, tdirty = 0, ldirty = 0;
+  uint16_t sind[256], top[256], lblk[256];
 
-  nblocks = uz_fit_bytes(length);
-  if (nblocks > 65810) return -1;
+  if (length < 0 || length > 65810 * UZ_BLOCKSZ) return -1;
 
   if (uz_read_inode(f,sb,inode,&x)!=0) return -1;
+  if (length < x.i_size) return -1;
 
   oblocks = uz_fit_bytes(x.i_size);
+  nblocks = uz_fit_bytes(length);
 
-  /* no need to remove or add blocks */
-  if (nblocks == oblocks) return 0;
-  if (nblocks < oblocks) return -1;
-
-  have_sind  = 0;
-  have_dindi = 0;
-  for(i=0;i<256;i++) have_dind[256] = 0;
-  want_sind  = 0;
-  want_dindi = 0;
-  for(i=0;i<256;i++) want_dind[256] = 0;
-
-  /* calc old block layout */
-  if (oblocks >= 18)  have_sind  = 1;
-  if (oblocks >= 274) have_dindi = 1;  
-  j = (oblocks - 274); /* number of groups of 256-blocks in the last chain */
-  k = j/256;
-  if (j%256) ++k;
-  for(i=0;i<k;i++) have_dind[i] = 1;
-
-  /* calc new block layout */
-  if (nblocks >= 18)  want_sind  = 1;
-  if (nblocks >= 274) want_dindi = 1;  
-  j = (nblocks - 274); /* number of groups of 256-blocks in the last chain */
-  k = j/256;
-  if (j%256) ++k;
-  for(i=0;i<k;i++) want_dind[i] = 1;
-  
-  // direct blocks
-  for(i=oblocks;i<18;i++) {
-    j = uz_alloc_block(f,sb); if (j<0) return -1;
-    x.i_addr[i] = j;
-  }
-  
-  // single indirect
-  if (!have_sind && want_sind) {
-    j = uz_alloc_block(f,sb); if (j<0) return -1;
-    x.i_addr[18] = j;
-  }
-  if (want_sind && oblocks<274) {
-    if (uz_read_raw_block(f,x.i_addr[18],(void *)blk)!=0) return -1;
-    for(i=oblocks;i<nblocks && i<274;i++) {
+  /* fail up front rather than leave a half-grown inode behind */
+  j = (nblocks - oblocks) + uz_index_blocks(nblocks) - uz_index_blocks(oblocks);
+  if (j > sb->s_tfree) return -1;
+
+  for(i=oblocks;i<nblocks;i++) {
+
+    // direct
+    if (i < 18) {
       j = uz_alloc_block(f,sb); if (j<0) return -1;
-      blk[i-18] = u16_to_le(j);
+      x.i_addr[i] = j;
+      continue;
     }
-    if (uz_write_raw_block(f,x.i_addr[18],(void *)blk)!=0) return -1;
-  }
-  
-  // double indirect
-  if (!have_dindi && want_dindi) {
-    j = uz_alloc_block(f,sb); if (j<0) return -1;
-    x.i_addr[19] = j;
-  }
-  if (want_dindi) {
-    if (uz_read_raw_block(f,x.i_addr[19],(void *)iblk)!=0) return -1;
-    for(i=0;i<256;i++) iblk[i] = u16_to_le(iblk[i]);
-    
-    for(i=0;i<256;i++)
-      if (!have_dind[i] && want_dind[i]) {
-	j=uz_alloc_block(f,sb); if (j<0) return -1;
-	iblk[i] = j;
+
+    // single indirect
+    if (i < 274) {
+      if (!sload) {
+	if (x.i_addr[18] == 0) {
+	  j = uz_alloc_block(f,sb); if (j<0) return -1;
+	  x.i_addr[18] = j;
+	  memset(sind,0,UZ_BLOCKSZ);
+	} else if (uz_read_raw_block(f,x.i_addr[18],(void *)sind)!=0)
+	  return -1;
+	sload = 1;
       }
-    
-    /* write back index */
-    for(i=0;i<256;i++) iblk[i] = u16_to_le(iblk[i]);
-    if (uz_write_raw_block(f,x.i_addr[19],(void *)iblk)!=0) return -1;      
-    
-    /* now that we have at least ensured that the index blocks exist,
-       leave the rest of the work to uz_set_nth_block */
-    
-    i = oblocks;
-    if (i < 274) i = 274;
-    for(;i<nblocks;i++) {
       j = uz_alloc_block(f,sb); if (j<0) return -1;
-      if (uz_set_nth_block(f,&x,i,j)!=0) return -1;
+      sind[i-18] = u16_to_le(j);
+      sdirty = 1;
+      continue;
     }
-    
+
+    // double indirect
+    if (!tload) {
+      if (x.i_addr[19] == 0) {
+	j = uz_alloc_block(f,sb); if (j<0) return -1;
+	x.i_addr[19] = j;
+	memset(top,0,UZ_BLOCKSZ);
+      } else if (uz_read_raw_block(f,x.i_addr[19],(void *)top)!=0)
+	return -1;
+      tload = 1;
+    }
+    k = (i-274) / 256;
+    if (k != leaf) {
+      if (ldirty)
+	if (uz_write_raw_block(f,u16_to_le(top[leaf]),(void *)lblk)!=0)
+	  return -1;
+      if (top[k] == 0) {
+	j = uz_alloc_block(f,sb); if (j<0) return -1;
+	top[k] = u16_to_le(j);
+	tdirty = 1;
+	memset(lblk,0,UZ_BLOCKSZ);
+      } else if (uz_read_raw_block(f,u16_to_le(top[k]),(void *)lblk)!=0)
+	return -1;
+      leaf = k;
+    }
+    j = uz_alloc_block(f,sb); if (j<0) return -1;
+    lblk[(i-274) % 256] = u16_to_le(j);
+    ldirty = 1;
   }
 
+  /* write back index blocks */
+  if (sdirty)
+    if (uz_write_raw_block(f,x.i_addr[18],(void *)sind)!=0) return -1;
+  if (ldirty)
+    if (uz_write_raw_block(f,u16_to_le(top[leaf]),(void *)lblk)!=0) return -1;
+  if (tdirty)
+    if (uz_write_raw_block(f,x.i_addr[19],(void *)top)!=0) return -1;
+
   /* write back inode and superblock */
   x.i_size = length;
   if (uz_write_inode(f,sb,inode,&x)!=0) return -1;
@@ -433,6 +1958,15 @@ int uz_inode_grow(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length)
   return 0;
 }
 
+int uz_inode_grow(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length) {
+  uint64_t t = uz_lat_begin();
+  int tr = uz_trace_enter();
+  int r = uz_do_inode_grow(f,sb,inode,length);
+  uz_trace_leave(tr,UZ_TR_GROW,0,inode,length,0,0);
+  uz_lat_end(UZ_LAT_GROW,t);
+  return r;
+}
+
 int uz_alloc_inode(FILE *f, uz_sblock *sb) {
   uz_ino_t newno;
   uz_ino_t i,j;
@@ -479,7 +2013,7 @@ int uz_free_inode(FILE *f, uz_sblock *sb, uz_ino_t inode) {
   return 0;
 }
 
-int uz_alloc_block(FILE *f, uz_sblock *sb) {
+static int uz_do_alloc_block(FILE *f, uz_sblock *sb) {
   uz_blkno_t newno;
   uint16_t nc[256];
   int i;
@@ -511,7 +2045,14 @@ int uz_alloc_block(FILE *f, uz_sblock *sb) {
   return newno;
 }
 
-int uz_free_block(FILE *f, uz_sblock *sb, uz_blkno_t block) {
+int uz_alloc_block(FILE *f, uz_sblock *sb) {
+  uint64_t t = uz_lat_begin();
+  int r = uz_do_alloc_block(f,sb);
+  uz_lat_end(UZ_LAT_ALLOC,t);
+  return r;
+}
+
+static int uz_do_free_block(FILE *f, uz_sblock *sb, uz_blkno_t block) {
   uint16_t nc[256];
   int i;
 
@@ -532,6 +2073,13 @@ int uz_free_block(FILE *f, uz_sblock *sb, uz_blkno_t block) {
   return 0;
 }
 
+int uz_free_block(FILE *f, uz_sblock *sb, uz_blkno_t block) {
+  uint64_t t = uz_lat_begin();
+  int r = uz_do_free_block(f,sb,block);
+  uz_lat_end(UZ_LAT_FREE,t);
+  return r;
+}
+
 char * uz_date_for_humans(uz_time_t *t, char *dest) {
   int h,m,s,D,M,Y;
   static char *mo[13] = { "Jan", "Jan","Feb","Mar","Apr","May","Jun",
@@ -569,14 +2117,48 @@ void uz_set_time(int hour,int min,int sec, uz_time_t *t) {
 }
 
 void uz_time(uz_time_t *t) {
+  uz_unix_to_time((long) time(0), t);
+}
+
+/* uzix dates are kept in UTC (see uz_time). years are counted from
+   March, so that leap days fall at their end */
+long uz_time_to_unix(uz_time_t *t) {
+  int h,m,s,D,M,Y;
+  long days, y;
+
+  h = (t->t_time >> 11) & 0x1f;
+  m = (t->t_time >> 5) & 0x3f;
+  s = (t->t_time << 1) & 0x3f;
+
+  D = ((t->t_date) & 0x1f);
+  M = (t->t_date >> 5) & 0x0f;
+  Y = 1980 + ((t->t_date >> 9) & 0x7f);
+
+  if (D==0) ++D;
+  if (M==0 || M>12) M = 1;
+
+  if (M <= 2) { --Y; M += 12; }
+  y = Y - 1600; /* 1600-03-01 is day 0 of a 400 year cycle */
+  days = 365 * y + y / 4 - y / 100 + y / 400 +
+    (153 * (M - 3) + 2) / 5 + D - 1 - 135080; /* 1970-01-01 */
+
+  return(((days * 24 + h) * 60 + m) * 60 + s);
+}
+
+/* dates out of the uzix range (1980-2107) are clamped to it */
+void uz_unix_to_time(long secs, uz_time_t *t) {
   time_t t0;
-  struct tm *now;
+  struct tm *u;
 
-  t0 = time(0);
-  now = gmtime(&t0);
+  t0 = (time_t) (secs < 315532800L ? 315532800L : secs); /* 1980-01-01 */
+  u = gmtime(&t0);
 
-  if (now != 0) {
-    uz_set_date(now->tm_mday, now->tm_mon + 1, now->tm_year, t);
-    uz_set_time(now->tm_hour, now->tm_min, now->tm_sec, t);
+  if (u == 0) return;
+  if (u->tm_year + 1900 > 2107) {
+    uz_set_date(31, 12, 2107, t);
+    uz_set_time(23, 59, 58, t);
+    return;
   }
+  uz_set_date(u->tm_mday, u->tm_mon + 1, u->tm_year + 1900, t);
+  uz_set_time(u->tm_hour, u->tm_min, u->tm_sec, t);
 }
@@ -38,6 +38,9 @@
 
 #define UZ_SBSIG       19638   /* superblock signature */
 
+#define UZ_MAXBLOCKS   65810   /* data blocks of the largest file */
+#define UZ_MAXINDEX    258     /* index blocks of the largest file */
+
 typedef uint16_t uz_mode_t;
 typedef int32_t  uz_off_t;
 typedef uint16_t uz_blkno_t;
@@ -116,16 +119,188 @@ typedef struct {
         uint8_t  d_name[UZ_DIRNAMELEN];  /* file name */
 } uz_direntry;
 
+/* bumped by every uz_read_sblock, so caches tied to an image can
+   tell it was opened again */
+extern unsigned uz_sbgen;
+
+/* I/O counters, kept by the block calls below and the byteorder.c
+   helpers, with atomic adds as threads may share them. a tool may
+   zero them with memset while no other thread runs */
+typedef struct {
+  unsigned long seeks;
+  unsigned long block_reads;    /* whole blocks, raw or in runs */
+  unsigned long block_writes;
+  unsigned long field_reads;    /* read_* calls (superblock, inodes) */
+  unsigned long field_writes;   /* write_* calls */
+  unsigned long bytes_read;     /* by either of the above */
+  unsigned long bytes_written;
+  unsigned long cache_hits;     /* reads served from memory instead */
+} uz_iostats;
+
+extern uz_iostats uz_stats;
+
+#define UZ_COUNT(field,n) __atomic_fetch_add(&uz_stats.field,(n),__ATOMIC_RELAXED)
+
+/* called with the byte offset and length of each read or write the
+   library makes on an image, before it is made. uz_io is how the
+   library reports them. null by default */
+typedef void (*uz_iohook)(uint32_t offset, uint32_t length, int write);
+extern uz_iohook uz_io_hook;
+void uz_io(uint32_t length, int write);
+
+/* a simulated drive, to be set as uz_io_hook. an access that does not
+   start where the previous one ended pays the command overhead, a
+   seek if it is on another cylinder and half a turn; then every
+   access pays its transfer, and a step per cylinder it runs into.
+   the time is only added up in uz_drive_stats, nothing waits. there
+   is one drive, shared by all images opened, with one head: it is
+   not for tools reading from several threads at once */
+typedef struct {
+  double settle;  /* ms of any seek */
+  double step;    /* ms per cylinder crossed */
+  double rpm;     /* 0 if nothing turns */
+  double rate;    /* KBytes per second */
+  double cmd;     /* ms of overhead per discontiguous access */
+  int    track;   /* 512 byte blocks per cylinder */
+} uz_drive;
+
+typedef struct {
+  double        ms;
+  unsigned long accesses;
+  unsigned long seeks;
+  unsigned long cylinders;  /* crossed by seeks and transfers */
+} uz_drivestats;
+
+extern uz_drive      uz_drive_model;
+extern uz_drivestats uz_drive_stats;
+
+/* spec is floppy, cf or hd, followed by ,field=value pairs with the
+   names above to change it, or the pairs alone over floppy. sets
+   uz_drive_access as the hook. returns 0, -1 if spec is bad */
+int  uz_drive_set(char *spec);
+void uz_drive_access(uint32_t offset, uint32_t length, int write);
+
+/* latency histograms of the main calls, off until uz_latency(1).
+   each power of two of nanoseconds is split in 4 buckets, so any
+   value is within 25% of its bucket. not thread safe */
+#define UZ_LAT_LOOKUP     0
+#define UZ_LAT_READDIR    1
+#define UZ_LAT_ISTAT      2
+#define UZ_LAT_READ_DATA  3
+#define UZ_LAT_WRITE_DATA 4
+#define UZ_LAT_GROW       5
+#define UZ_LAT_IMPLODE    6
+#define UZ_LAT_ALLOC      7
+#define UZ_LAT_FREE       8
+#define UZ_LAT_READDIRPLUS 9
+#define UZ_LAT_OPS        10
+
+#define UZ_LAT_BUCKETS    256
+
+void uz_latency(int on);
+/* the histograms as one JSON object */
+void uz_latency_dump(FILE *out);
+
+/* used by the timed calls: 0 when off */
+uint64_t uz_lat_begin(void);
+void     uz_lat_end(int op, uint64_t start);
+
+/* call traces, replayed by uzixfsreplay. after uz_trace_open each
+   call the program makes (not those the library makes itself) is
+   appended to the file, stamped with the microseconds since the one
+   before. calls on an inode structure carry it, and its number when
+   it was read or written shortly before, only when it differs from
+   the last one written. not thread safe */
+#define UZ_TR_LOOKUP    1  /* path */
+#define UZ_TR_READDIR   2  /* inode, a = slot */
+#define UZ_TR_ISTAT     3  /* a = ino */
+#define UZ_TR_READ      4  /* inode, a = offset, b = length */
+#define UZ_TR_WRITE     5  /* inode, a = offset, b = length */
+#define UZ_TR_GROW      6  /* a = ino, b = length */
+#define UZ_TR_TRUNCATE  7  /* a = ino, b = length */
+#define UZ_TR_IMPLODE   8  /* a = ino */
+#define UZ_TR_REMOVE    9  /* a = ino */
+#define UZ_TR_MKNOD    10  /* path, b = mode */
+#define UZ_TR_MKDIR    11  /* path, b = mode */
+#define UZ_TR_UNLINK   12  /* path */
+#define UZ_TR_RMDIR    13  /* path */
+#define UZ_TR_LINK     14  /* path, path2 */
+#define UZ_TR_RENAME   15  /* path, path2 */
+#define UZ_TR_READDIRPLUS 16  /* inode, a = slot */
+#define UZ_TR_OPS      17
+
+#define UZ_TR_PATHLEN  1024
+
+typedef struct {
+  int      op;
+  uint64_t usec;     /* since the first record */
+  uz_inode inode;
+  uz_ino_t ino;      /* of inode, 0 if not known */
+  int      fresh;    /* inode and ino came with this call */
+  uint32_t a, b;
+  char     path[UZ_TR_PATHLEN], path2[UZ_TR_PATHLEN];
+} uz_trace_rec;
+
+int  uz_trace_open(char *path);
+void uz_trace_close(void);
+
+/* used by the traced calls: uz_trace_enter says whether this call is
+   to be recorded, uz_trace_leave writes it if so */
+int  uz_trace_enter(void);
+void uz_trace_leave(int rec, int op, uz_inode *inode, uint32_t a, uint32_t b,
+		    char *path, char *path2);
+
+/* reading a trace: uz_trace_head checks the file header and clears r,
+   then each uz_trace_read fills the same r with the next call.
+   returns 0, 1 at the end of the trace, -1 if it is damaged */
+int  uz_trace_head(FILE *t, uz_trace_rec *r);
+int  uz_trace_read(FILE *t, uz_trace_rec *r);
+
 /* all functions return 0 in case of success, -1 on error */
 
 int uz_read_sblock(FILE *f, uz_sblock *sb);
 int uz_read_inode(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode);
+/* puts an inode decoded elsewhere (e.g. from a whole inode table
+   block) in the cache uz_read_inode keeps */
+void uz_icache_put(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode);
 int uz_read_data(FILE *f, uz_inode *inode, 
 		 uint32_t offset, uint32_t length, void *dest);
 int uz_read_raw_block(FILE *f, uz_blkno_t block, void *dest);
+int uz_read_blocks(FILE *f, uz_blkno_t first, int count, void *dest);
+int uz_read_itable(FILE *f, uz_sblock *sb, uz_inode *table);
 
 int uz_xlate_block(FILE *f, uz_inode *inode, int rank);
 int uz_set_nth_block(FILE *f, uz_inode *inode, int rank, uz_blkno_t block);
+int uz_inode_map(FILE *f, uz_sblock *sb, uz_inode *inode,
+		 uz_blkno_t *map, uz_blkno_t *idx, int *nidx);
+int uz_inode_layout(FILE *f, uz_sblock *sb, uz_inode *inode, uz_blkno_t *seq);
+
+/* reverse block map: what each block of the image holds */
+#define UZ_BM_FREE      0  /* in the free list */
+#define UZ_BM_BOOT      1  /* boot block */
+#define UZ_BM_SUPER     2  /* superblock */
+#define UZ_BM_RESERVED  3  /* between superblock and inode table */
+#define UZ_BM_ITABLE    4  /* inode table */
+#define UZ_BM_DATA      5  /* data block b_rank of inode b_ino */
+#define UZ_BM_INDEX     6  /* index block of inode b_ino, b_rank is the
+			      first rank it addresses (-1 for the double
+			      indirect block itself) */
+#define UZ_BM_LEAKED    7  /* data area, neither used nor free */
+
+typedef struct {
+  uz_ino_t b_ino;
+  uint8_t  b_kind;
+  int32_t  b_rank;
+} uz_bmentry;
+
+/* fills map[0..s_fsize-1] from one pass over the inode table and
+   index blocks. a block used twice keeps its lowest inode owner */
+int uz_block_map(FILE *f, uz_sblock *sb, uz_bmentry *map);
+
+/* sets hit[i] for every inode in use whose mtime or ctime is later
+   than since (seconds since 1970, UTC), reading the inode table in
+   one go. returns how many, -1 on error */
+int uz_scan_newer(FILE *f, uz_sblock *sb, long since, uint8_t *hit);
 
 int uz_write_sblock(FILE *f, uz_sblock *sb);
 int uz_write_inode(FILE *f, uz_sblock *sb, uz_ino_t no, uz_inode *inode);
@@ -133,17 +308,55 @@ int uz_write_data(FILE *f, uz_inode *inode,
 		  uint32_t offset, uint32_t length, void *src);
 int uz_write_raw_block(FILE *f, uz_blkno_t block, void *src);
 
+/* a block request of a batch */
+typedef struct {
+  uz_blkno_t block;
+  uint8_t   *buf;   /* UZ_BLOCKSZ bytes */
+} uz_ioreq;
+
+/* the n requests are done in ascending block order, consecutive
+   blocks with one seek, and each buffer gets or gives its own block.
+   a block read twice is read once; of two writes to a block the later
+   one in req wins. 0 or -1 */
+int uz_read_batch(FILE *f, uz_ioreq *req, int n);
+int uz_write_batch(FILE *f, uz_ioreq *req, int n);
+
 int uz_alloc_inode(FILE *f, uz_sblock *sb);
 int uz_free_inode(FILE *f, uz_sblock *sb, uz_ino_t inode);
 
 int uz_alloc_block(FILE *f, uz_sblock *sb);
 int uz_free_block(FILE *f, uz_sblock *sb, uz_blkno_t block);
+int uz_rebuild_freelist(FILE *f, uz_sblock *sb, uint8_t *inuse);
+int uz_relocate(FILE *f, uz_sblock *sb, uz_blkno_t *newpos);
 
 int uz_inode_grow(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length);
+int uz_inode_truncate(FILE *f, uz_sblock *sb, uz_ino_t inode, uz_off_t length);
 int uz_inode_implode(FILE *f, uz_sblock *sb, uz_ino_t inode);
 
 int uz_inode_remove(FILE *f, uz_sblock *sb, uz_ino_t inode);
 
+/* transactions: between uz_begin and uz_commit, superblock, inode and
+   block writes to f are held in memory (reads see them), and uz_commit
+   writes each changed block once, in ascending order. undolog may be
+   null; otherwise the old contents are saved there before the image
+   is touched, so uz_rollback can undo an interrupted commit (tools
+   do it at startup through uz_recover, in uzixdir.h). after
+   uz_abort the caller should read the superblock again */
+int  uz_begin(FILE *f, uz_sblock *sb);
+int  uz_commit(FILE *f, char *undolog);
+void uz_abort(FILE *f);
+int  uz_rollback(FILE *f, char *undolog);
+
+/* 64-byte on-disk inode <-> uz_inode */
+void uz_decode_inode(uint8_t *raw, uz_inode *inode);
+void uz_encode_inode(uz_inode *inode, uint8_t *raw);
+
+/* formats f as an empty filesystem of fblocks blocks, iblocks of
+   them for inodes and rblocks reserved after the superblock, with
+   boot as block 0. the whole length is written */
+int uz_mkfs(FILE *f, uz_sblock *sb, int fblocks, int iblocks, int rblocks,
+	    uint8_t *boot);
+
 uz_blkno_t uz_fit_bytes(uz_off_t length);
 
 /* converts uzix date/time to human-readable string */
@@ -152,6 +365,10 @@ void uz_set_date(int day,int month,int year, uz_time_t *t);
 void uz_set_time(int hour,int min,int sec, uz_time_t *t);
 void uz_time(uz_time_t *t);
 
+/* uzix date/time <-> seconds since 1970-01-01 00:00 UTC */
+long uz_time_to_unix(uz_time_t *t);
+void uz_unix_to_time(long secs, uz_time_t *t);
+
 #endif
 
 // additional stuff copied from uzix headers
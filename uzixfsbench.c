@@ -0,0 +1,303 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+/* benchmarks of the uzixfs.c and uzixdir.c calls, run by make bench.
+   the image is built in memory and read through a counting stream,
+   so the numbers are those of the library and not of the host disk.
+   results go to stdout as JSON, with the latency histograms of all
+   the calls made */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+
+#define FBLOCKS 32768
+#define IBLOCKS 512
+#define BIGSIZE (4L * 1024 * 1024)
+
+/* the image, and what the library asked of it */
+uint8_t  *image;
+long      pos, iocalls, iobytes;
+FILE     *f;
+char      iobuf[UZ_BLOCKSZ];
+uz_sblock sb;
+double    mintime = 0.25;
+int       nresults;
+unsigned  seed = 1;
+
+ssize_t img_read(void *c, char *buf, size_t n) {
+  if (pos + n > (long) FBLOCKS * UZ_BLOCKSZ) n = (long) FBLOCKS * UZ_BLOCKSZ - pos;
+  memcpy(buf,image + pos,n);
+  pos += n;
+  ++iocalls;
+  iobytes += n;
+  return n;
+}
+
+ssize_t img_write(void *c, const char *buf, size_t n) {
+  if (pos + n > (long) FBLOCKS * UZ_BLOCKSZ) n = (long) FBLOCKS * UZ_BLOCKSZ - pos;
+  memcpy(image + pos,buf,n);
+  pos += n;
+  ++iocalls;
+  iobytes += n;
+  return n;
+}
+
+int img_seek(void *c, off64_t *off, int whence) {
+  if (whence == SEEK_CUR) *off += pos;
+  if (whence == SEEK_END) *off += (long) FBLOCKS * UZ_BLOCKSZ;
+  if (*off < 0 || *off > (long) FBLOCKS * UZ_BLOCKSZ) return -1;
+  pos = *off;
+  return 0;
+}
+
+/* same sequence on every run */
+unsigned rnd(void) {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void fail(char *what) {
+  fprintf(stderr,"uzixfsbench: %s failed.\n",what);
+  exit(2);
+}
+
+/* a benchmark: fn does one batch of operations and returns how many,
+   adding the bytes it moved; batches repeat for at least mintime */
+typedef long (*batchfn)(void *arg, long *bytes);
+
+void run(char *name, batchfn fn, void *arg) {
+  long ops = 0, bytes = 0, calls, moved, n;
+  double t0, t;
+
+  fn(arg,&bytes); /* warm up */
+  bytes = 0;
+  calls = iocalls;
+  moved = iobytes;
+  t0 = now();
+  do {
+    n = fn(arg,&bytes);
+    if (n < 0) fail(name);
+    ops += n;
+    t = now() - t0;
+  } while(t < mintime);
+  calls = iocalls - calls;
+  moved = iobytes - moved;
+
+  printf("%s    {\"name\": \"%s\", \"ops\": %ld, \"seconds\": %.4f, "
+	 "\"ops_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+	 "\"io_calls_per_op\": %.3f, \"blocks_per_op\": %.3f}",
+	 nresults++ ? ",\n" : "",name,ops,t,ops / t,bytes / t,
+	 (double) calls / ops,(double) moved / UZ_BLOCKSZ / ops);
+  fflush(stdout);
+}
+
+/* the benchmarks */
+
+long b_sblock(void *arg, long *bytes) {
+  uz_sblock x;
+  int i;
+  for(i=0;i<100;i++)
+    if (uz_read_sblock(f,&x)!=0) return -1;
+  return 100;
+}
+
+long b_inode(void *arg, long *bytes) {
+  uz_inode x;
+  int i, n = *(int *) arg;
+  for(i=0;i<100;i++)
+    if (uz_read_inode(f,&sb,1 + rnd() % n,&x)!=0) return -1;
+  return 100;
+}
+
+long b_lookup(void *arg, long *bytes) {
+  int i;
+  for(i=0;i<10;i++)
+    if (uz_lookup((char *) arg,f,&sb) < 0) return -1;
+  return 10;
+}
+
+long b_readdir(void *arg, long *bytes) {
+  uz_dir d;
+  uz_direntry e;
+  if (uz_opendir((char *) arg,f,&sb,&d)!=0) return -1;
+  while(uz_readdir(&d,&e)==0)
+    *bytes += UZ_DIRELEN;
+  uz_closedir(&d);
+  return 1;
+}
+
+long b_readdirplus(void *arg, long *bytes) {
+  uz_dir d;
+  uz_direntplus *ents;
+  int n;
+  if (uz_opendir((char *) arg,f,&sb,&d)!=0) return -1;
+  if ((n = uz_readdirplus(&d,&ents)) < 0) return -1;
+  if (n > 0) free(ents);
+  *bytes += n * UZ_DIRELEN;
+  uz_closedir(&d);
+  return 1;
+}
+
+uz_inode big;
+uint8_t  buf[4096];
+
+long b_seqread(void *arg, long *bytes) {
+  long off;
+  for(off=0;off<BIGSIZE;off+=sizeof(buf))
+    if (uz_read_data(f,&big,off,sizeof(buf),buf) < 0) return -1;
+  *bytes += BIGSIZE;
+  return BIGSIZE / sizeof(buf);
+}
+
+long b_randread(void *arg, long *bytes) {
+  int i;
+  for(i=0;i<100;i++)
+    if (uz_read_data(f,&big,(rnd() % (BIGSIZE / UZ_BLOCKSZ)) * UZ_BLOCKSZ,
+		     UZ_BLOCKSZ,buf) < 0) return -1;
+  *bytes += 100 * UZ_BLOCKSZ;
+  return 100;
+}
+
+/* grow to 256K and implode: one op is the pair */
+long b_grow(void *arg, long *bytes) {
+  int ino = *(int *) arg;
+  if (uz_inode_grow(f,&sb,ino,256 * 1024)!=0) return -1;
+  if (uz_inode_implode(f,&sb,ino)!=0) return -1;
+  *bytes += 256 * 1024;
+  return 1;
+}
+
+/* 200 blocks taken and given back: crosses free list blocks */
+long b_alloc(void *arg, long *bytes) {
+  int i, b[200];
+  for(i=0;i<200;i++)
+    if ((b[i] = uz_alloc_block(f,&sb)) <= 0) return -1;
+  for(i=199;i>=0;i--)
+    if (uz_free_block(f,&sb,b[i])!=0) return -1;
+  return 400;
+}
+
+/* /d1/d2/../d8, each level with a file f; /wN with N files; /big */
+void populate(void) {
+  char path[256], name[16];
+  int i, n, w, widths[3] = { 16, 256, 1000 };
+
+  path[0] = 0;
+  for(i=1;i<=8;i++) {
+    sprintf(name,"/d%d",i);
+    strcat(path,name);
+    if (uz_mkdir(path,f,&sb,0755) < 0) fail("mkdir");
+  }
+  for(i=8;i>=1;i--) {
+    strcat(path,"/f");
+    if (uz_mknod(path,f,&sb,UZ_IFREG | 0644) < 0) fail("mknod");
+    path[strlen(path) - 5] = 0;
+  }
+
+  for(w=0;w<3;w++) {
+    sprintf(path,"/w%d",widths[w]);
+    if (uz_mkdir(path,f,&sb,0755) < 0) fail("mkdir");
+    for(n=0;n<widths[w];n++) {
+      sprintf(path,"/w%d/f%d",widths[w],n);
+      if (uz_mknod(path,f,&sb,UZ_IFREG | 0644) < 0) fail("mknod");
+    }
+  }
+
+  if ((n = uz_mknod("/big",f,&sb,UZ_IFREG | 0644)) < 0 ||
+      uz_inode_grow(f,&sb,n,BIGSIZE)!=0 || uz_read_inode(f,&sb,n,&big)!=0)
+    fail("grow");
+  for(i=0;i<sizeof(buf);i++) buf[i] = i;
+  for(i=0;i<BIGSIZE;i+=sizeof(buf))
+    if (uz_write_data(f,&big,i,sizeof(buf),buf) < 0) fail("write");
+}
+
+int main(int argc, char **argv) {
+  cookie_io_functions_t io = { img_read, img_write, img_seek, 0 };
+  uint8_t boot[UZ_BLOCKSZ];
+  char path[64], name[32];
+  int i, j, depth[3] = { 1, 4, 8 }, width[3] = { 16, 256, 1000 };
+  int ninodes, scratch;
+
+  uz_global_opt(argc, argv);
+  if (argc > 1) mintime = atof(argv[1]);
+  if (mintime <= 0) {
+    fprintf(stderr,"usage: uzixfsbench [seconds per benchmark]\n\n");
+    return 1;
+  }
+
+  image = (uint8_t *) malloc((long) FBLOCKS * UZ_BLOCKSZ);
+  f = fopencookie(0,"r+",io);
+  if (!image || !f) fail("setup");
+  /* a block sized buffer, so each refill counts as one block I/O */
+  setvbuf(f,iobuf,_IOFBF,UZ_BLOCKSZ);
+  memset(boot,0,sizeof(boot));
+  if (uz_mkfs(f,&sb,FBLOCKS,IBLOCKS,0,boot)!=0) fail("mkfs");
+  populate();
+  if ((scratch = uz_mknod("/scratch",f,&sb,UZ_IFREG | 0644)) < 0) fail("mknod");
+  if (fflush(f)!=0 || uz_read_sblock(f,&sb)!=0) fail("setup");
+  ninodes = IBLOCKS * UZ_IPB - sb.s_tinode;
+
+  printf("{\n  \"version\": \"1.0\",\n");
+  printf("  \"image\": {\"blocks\": %d, \"inodes\": %d, \"inodes_used\": %d, "
+	 "\"free_blocks\": %d},\n",
+	 sb.s_fsize,sb.s_isize * UZ_IPB,ninodes,sb.s_tfree);
+  printf("  \"results\": [\n");
+  uz_latency(1);
+
+  run("read_sblock",b_sblock,0);
+  run("read_inode",b_inode,&ninodes);
+  for(i=0;i<3;i++) {
+    strcpy(path,"");
+    for(j=1;j<=depth[i];j++)
+      sprintf(path + strlen(path),"/d%d",j);
+    strcat(path,"/f");
+    sprintf(name,"lookup_depth_%d",depth[i]);
+    run(name,b_lookup,path);
+  }
+  for(i=0;i<3;i++) {
+    sprintf(path,"/w%d/f%d",width[i],width[i]-1);
+    sprintf(name,"lookup_width_%d",width[i]);
+    run(name,b_lookup,path);
+  }
+  for(i=0;i<3;i++) {
+    sprintf(path,"/w%d",width[i]);
+    sprintf(name,"readdir_%d",width[i]);
+    run(name,b_readdir,path);
+  }
+  for(i=0;i<3;i++) {
+    sprintf(path,"/w%d",width[i]);
+    sprintf(name,"readdirplus_%d",width[i]);
+    run(name,b_readdirplus,path);
+  }
+  run("read_data_seq_4k",b_seqread,0);
+  run("read_data_random_512",b_randread,0);
+
+  scratch = uz_lookup("/scratch",f,&sb);
+  run("inode_grow_implode_256k",b_grow,&scratch);
+  run("alloc_free_block",b_alloc,0);
+
+  printf("\n  ],\n  \"latency\": ");
+  uz_latency_dump(stdout);
+  printf("}\n");
+  fclose(f);
+  free(image);
+  return 0;
+}
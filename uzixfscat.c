@@ -19,10 +19,11 @@ uz_sblock sb;
 
 int main(int argc, char **argv) {
   uz_inode inode;
-  int i, j, ino, sz, blks, co, cr;
-  char blk[512];
+  int ino, sz, co, cr;
+  char blk[64 * 512]; /* read in batches this big */
 
   uz_global_opt(argc, argv);
+  argc = uz_stats_opt(argc, argv);
 
   if (argc!=3) {
     fprintf(stderr,"usage: uzixfscat image.dsk file\n\n");
@@ -50,17 +51,11 @@ int main(int argc, char **argv) {
     goto err1;
   
   sz = inode.i_size;
-  blks = uz_fit_bytes(sz);
-
-  co = 0;
-  for(i=0;i<blks;i++) {
-    memset(blk,0,512);
-    j = uz_xlate_block(f, &inode, i);
-    if (j<0) goto err1;
 
+  for(co=0;co<sz;) {
     cr = sz-co;
-    if (cr > 512) cr=512;
-    if (uz_read_raw_block(f,j,(void *)blk)!=0) goto err1;
+    if (cr > sizeof(blk)) cr=sizeof(blk);
+    if (uz_read_data(f,&inode,co,cr,(void *)blk)!=cr) goto err1;
     co+=cr;
 
     if (fwrite(blk,1,cr,stdout) != cr)
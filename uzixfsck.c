@@ -0,0 +1,721 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+#include "byteorder.h"
+
+/* problem kinds, in report order */
+#define P_IOERR     1  /* ino */
+#define P_BADSIZE   2  /* ino, a=size */
+#define P_BADPTR    3  /* ino, a=rank (-1 for an index block), b=block */
+#define P_DUPBLK    4  /* ino, a=block, b=other inode */
+#define P_BADENT    5  /* ino=directory, a=slot, b=inode, name */
+#define P_FREEENT   6  /* ino=directory, a=slot, b=inode, name */
+#define P_NODOT     7  /* ino=directory, name */
+#define P_ORPHAN    8  /* ino */
+#define P_NLINK     9  /* ino, a=i_nlink, b=references */
+
+typedef struct {
+  int  type;
+  int  ino, a, b;
+  char name[UZ_DIRNAMELEN+1];
+} problem;
+
+/* one per thread: own stream on the image, own problem list */
+typedef struct {
+  FILE       *f;
+  problem    *p;
+  int         n, size;
+  uz_blkno_t *map;
+} worker;
+
+typedef struct {
+  problem *p;
+  int      np;
+  int      nfiles, ndirs;
+  int      tfree, tinode, leaked;
+  int      badfree, dupfree, usedfree, badlist, badicache;
+  int      total;
+} result;
+
+char      *image;
+FILE      *dsk;
+uz_sblock  sb;
+uz_inode  *itable;
+int        ninodes, lo, hi;
+int        nthreads;
+
+uint16_t  *owner;   /* first inode found using each block */
+uint16_t  *claims;  /* number of times each block is used */
+uint32_t  *refs;    /* directory entries naming each inode */
+int       *dirs, ndirs;
+int        next;    /* work counter shared by the threads */
+
+#define CHUNK       64
+#define FREEINO(x)  ((x)->i_mode == 0 && (x)->i_nlink == 0)
+#define INRANGE(b)  ((b) >= lo && (b) < hi)
+#define SANESIZE(x) ((x)->i_size >= 0 && (x)->i_size <= UZ_MAXBLOCKS * UZ_BLOCKSZ)
+
+void add_problem(problem **v, int *n, int *size,
+		 int type, int ino, int a, int b, uint8_t *name)
+{
+  problem *p;
+
+  if (*n == *size) {
+    p = (problem *) realloc(*v, (*size ? *size * 2 : 64) * sizeof(problem));
+    if (!p) {
+      fprintf(stderr,"uzixfsck: out of memory\n");
+      exit(8);
+    }
+    *v = p;
+    *size = *size ? *size * 2 : 64;
+  }
+  p = &((*v)[(*n)++]);
+  p->type = type;
+  p->ino  = ino;
+  p->a    = a;
+  p->b    = b;
+  memset(p->name,0,sizeof(p->name));
+  if (name) memcpy(p->name,name,UZ_DIRNAMELEN);
+}
+
+#define REPORT(w,t,i,a,b,s) add_problem(&((w)->p),&((w)->n),&((w)->size),t,i,a,b,s)
+
+void claim(worker *w, int ino, int block, int rank) {
+  uint16_t prev = 0;
+
+  if (block == 0) return; /* hole */
+  if (!INRANGE(block)) {
+    REPORT(w,P_BADPTR,ino,rank,block,0);
+    return;
+  }
+  if (!__atomic_compare_exchange_n(&owner[block],&prev,(uint16_t) ino,0,
+				   __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+    REPORT(w,P_DUPBLK,ino,block,prev,0);
+  __atomic_fetch_add(&claims[block],1,__ATOMIC_RELAXED);
+}
+
+/* pass 1: block map of one inode */
+void scan_inode(worker *w, int i) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  uz_inode *x = &itable[i];
+  int r, n, ni;
+
+  if (FREEINO(x)) return;
+
+  if (!SANESIZE(x)) {
+    REPORT(w,P_BADSIZE,i,x->i_size,0,0);
+    return;
+  }
+
+  n = uz_inode_map(w->f,&sb,x,w->map,idx,&ni);
+  if (n < 0) {
+    REPORT(w,P_IOERR,i,0,0,0);
+    return;
+  }
+
+  for(r=0;r<ni;r++)
+    claim(w,i,idx[r],-1);
+  for(r=0;r<n;r++)
+    claim(w,i,w->map[r],r);
+}
+
+/* pass 2: entries of one directory */
+void scan_dir(worker *w, int d) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  uz_direntry ent[UZ_BLOCKSZ / UZ_DIRELEN];
+  uz_inode *x = &itable[d];
+  int r, e, s, n, ni, nent, ino, dot = 0, dotdot = 0;
+
+  if (!SANESIZE(x)) return; /* reported by pass 1 */
+
+  n = uz_inode_map(w->f,&sb,x,w->map,idx,&ni);
+  if (n < 0) return;
+  nent = x->i_size / UZ_DIRELEN;
+
+  for(r=0;r<n;r++) {
+    if (!INRANGE(w->map[r])) continue;
+    if (uz_read_raw_block(w->f,w->map[r],(void *)ent)!=0) {
+      REPORT(w,P_IOERR,d,0,0,0);
+      return;
+    }
+    for(e=0;e<UZ_BLOCKSZ / UZ_DIRELEN;e++) {
+      s = r * (UZ_BLOCKSZ / UZ_DIRELEN) + e;
+      if (s >= nent) break;
+      ino = u16_to_le(ent[e].d_ino);
+      if (ino == 0) continue;
+      if (ino >= ninodes) {
+	REPORT(w,P_BADENT,d,s,ino,ent[e].d_name);
+	continue;
+      }
+      if (FREEINO(&itable[ino])) {
+	REPORT(w,P_FREEENT,d,s,ino,ent[e].d_name);
+	continue;
+      }
+      __atomic_fetch_add(&refs[ino],1,__ATOMIC_RELAXED);
+      if (!strncmp((char *) ent[e].d_name,".",UZ_DIRNAMELEN))  dot = 1;
+      if (!strncmp((char *) ent[e].d_name,"..",UZ_DIRNAMELEN)) dotdot = 1;
+    }
+  }
+
+  if (!dot)    REPORT(w,P_NODOT,d,0,0,(uint8_t *) ".\0\0\0\0\0\0\0\0\0\0\0\0\0");
+  if (!dotdot) REPORT(w,P_NODOT,d,1,0,(uint8_t *) "..\0\0\0\0\0\0\0\0\0\0\0\0");
+}
+
+void * run_inodes(void *arg) {
+  worker *w = (worker *) arg;
+  int c, i;
+
+  for(;;) {
+    c = __atomic_fetch_add(&next,1,__ATOMIC_RELAXED) * CHUNK;
+    if (c >= ninodes) break;
+    for(i=c;i<c+CHUNK && i<ninodes;i++)
+      if (i != 0) scan_inode(w,i);
+  }
+  return 0;
+}
+
+void * run_dirs(void *arg) {
+  worker *w = (worker *) arg;
+  int i;
+
+  for(;;) {
+    i = __atomic_fetch_add(&next,1,__ATOMIC_RELAXED);
+    if (i >= ndirs) break;
+    scan_dir(w,dirs[i]);
+  }
+  return 0;
+}
+
+/* runs fn on all workers at once, each reading the image through
+   its own stream */
+int parallel(void * (*fn)(void *), worker *w) {
+  pthread_t *t;
+  int i, err = 0;
+
+  t = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  if (!t) return -1;
+  next = 0;
+
+  for(i=0;i<nthreads;i++) {
+    w[i].f = fopen(image,"r");
+    if (!w[i].f) { err = -1; break; }
+    if (pthread_create(&t[i],0,fn,&w[i])!=0) {
+      fclose(w[i].f);
+      err = -1;
+      break;
+    }
+  }
+  while(--i >= 0) {
+    pthread_join(t[i],0);
+    fclose(w[i].f);
+  }
+
+  free(t);
+  return err;
+}
+
+int cmp_problem(const void *a, const void *b) {
+  const problem *x = (const problem *) a;
+  const problem *y = (const problem *) b;
+  if (x->type != y->type) return(x->type - y->type);
+  if (x->ino != y->ino)   return(x->ino - y->ino);
+  if (x->a != y->a)       return(x->a - y->a);
+  return(x->b - y->b);
+}
+
+/* walks the free block list. both the UZIX layout (a 0 at the bottom
+   of the last cache) and the mkuzixfs one (last chained block holds an
+   empty cache) are accepted */
+void check_freelist(result *res) {
+  uint16_t nc[256];
+  uz_blkno_t list[50];
+  uint8_t *seen;
+  int i, b, n;
+
+  seen = (uint8_t *) calloc(65536,1);
+  if (!seen) { fprintf(stderr,"uzixfsck: out of memory\n"); exit(8); }
+
+  n = sb.s_nfree;
+  memcpy(list,sb.s_free,sizeof(list));
+  if (n > 50 || (n == 0 && sb.s_tfree != 0)) {
+    res->badlist = 1;
+    n = 0;
+  }
+
+  while(n > 0) {
+    for(i=0;i<n;i++) {
+      b = list[i];
+      if (i == 0 && b == 0) continue; /* end of list */
+      if (!INRANGE(b)) { ++res->badfree; continue; }
+      if (seen[b])     { ++res->dupfree; continue; }
+      seen[b] = 1;
+      ++res->tfree;
+      if (claims[b]) ++res->usedfree;
+    }
+
+    /* list[0] holds the next cache */
+    b = list[0];
+    if (b == 0 || !INRANGE(b)) break;
+    if (seen[b] == 2 || uz_read_raw_block(dsk,b,(void *)nc)!=0) {
+      res->badlist = 1;
+      break;
+    }
+    seen[b] = 2;
+    n = u16_to_le(nc[0]);
+    if (n > 50) {
+      res->badlist = 1;
+      break;
+    }
+    for(i=0;i<n;i++)
+      list[i] = u16_to_le(nc[i+1]);
+  }
+
+  for(b=lo;b<hi;b++)
+    if (!claims[b] && !seen[b])
+      ++res->leaked;
+
+  free(seen);
+}
+
+/* full check of the image, results are left in res */
+void check(result *res) {
+  worker *w;
+  problem *p;
+  int i, n;
+
+  memset(res,0,sizeof(result));
+  memset(owner,0,65536 * sizeof(uint16_t));
+  memset(claims,0,65536 * sizeof(uint16_t));
+  memset(refs,0,ninodes * sizeof(uint32_t));
+
+  for(ndirs=0,i=1;i<ninodes;i++) {
+    if (FREEINO(&itable[i])) {
+      ++res->tinode;
+      continue;
+    }
+    if ((itable[i].i_mode & UZ_IFMT) == UZ_IFDIR) {
+      dirs[ndirs++] = i;
+      ++res->ndirs;
+    } else
+      ++res->nfiles;
+  }
+
+  w = (worker *) calloc(nthreads,sizeof(worker));
+  if (!w) { fprintf(stderr,"uzixfsck: out of memory\n"); exit(8); }
+  for(i=0;i<nthreads;i++) {
+    w[i].map = (uz_blkno_t *) malloc(UZ_MAXBLOCKS * sizeof(uz_blkno_t));
+    if (!w[i].map) { fprintf(stderr,"uzixfsck: out of memory\n"); exit(8); }
+  }
+
+  /* directories are only scanned once all blocks are claimed, since
+     pass 2 reads through the block maps */
+  if (parallel(run_inodes,w)!=0 || parallel(run_dirs,w)!=0) {
+    fprintf(stderr,"uzixfsck: unable to start checker threads\n");
+    exit(8);
+  }
+
+  n = 0;
+  res->p = 0;
+  for(i=0;i<nthreads;i++) {
+    p = (problem *) realloc(res->p,(res->np + w[i].n + 1) * sizeof(problem));
+    if (!p) { fprintf(stderr,"uzixfsck: out of memory\n"); exit(8); }
+    res->p = p;
+    memcpy(res->p + res->np,w[i].p,w[i].n * sizeof(problem));
+    res->np += w[i].n;
+    n = res->np;
+    free(w[i].p);
+    free(w[i].map);
+  }
+  free(w);
+
+  /* the same shared block is reported once, with both inodes */
+  for(i=0;i<res->np;i++)
+    if (res->p[i].type == P_DUPBLK && res->p[i].b < res->p[i].ino) {
+      n = res->p[i].b;
+      res->p[i].b = res->p[i].ino;
+      res->p[i].ino = n;
+    }
+
+  /* pass 3: link counts. mkuzixfs gives the root one link more than
+     it has entries, so that is accepted too */
+  n = res->np;
+  for(i=1;i<ninodes;i++) {
+    if (FREEINO(&itable[i])) continue;
+    if (refs[i] == 0 && i != UZ_ROOT) {
+      add_problem(&(res->p),&(res->np),&n,P_ORPHAN,i,0,0,0);
+      continue;
+    }
+    if (itable[i].i_nlink != refs[i] &&
+	!(i == UZ_ROOT && itable[i].i_nlink == refs[i] + 1))
+      add_problem(&(res->p),&(res->np),&n,P_NLINK,i,itable[i].i_nlink,refs[i],0);
+  }
+
+  qsort(res->p,res->np,sizeof(problem),cmp_problem);
+
+  /* pass 4: free lists */
+  check_freelist(res);
+
+  if (sb.s_ninode > 50)
+    res->badicache = 1;
+  else
+    for(i=0;i<sb.s_ninode;i++)
+      if (sb.s_inode[i] <= UZ_ROOT || sb.s_inode[i] >= ninodes ||
+	  !FREEINO(&itable[sb.s_inode[i]]))
+	res->badicache = 1;
+
+  res->total = res->np + res->badfree + res->dupfree + res->usedfree +
+    res->badlist + res->badicache + (res->leaked != 0) +
+    (res->tfree != sb.s_tfree) + (res->tinode != sb.s_tinode);
+}
+
+void show(result *res) {
+  problem *p;
+  int i;
+
+  for(i=0;i<res->np;i++) {
+    p = &(res->p[i]);
+    switch(p->type) {
+    case P_IOERR:
+      printf("!! inode %d: read error\n",p->ino);
+      break;
+    case P_BADSIZE:
+      printf("!! inode %d: impossible size %d\n",p->ino,p->a);
+      break;
+    case P_BADPTR:
+      if (p->a < 0)
+	printf("!! inode %d: index block %d is out of range\n",p->ino,p->b);
+      else
+	printf("!! inode %d: block %d (rank %d) is out of range\n",
+	       p->ino,p->b,p->a);
+      break;
+    case P_DUPBLK:
+      printf("!! inode %d: block %d is also used by inode %d\n",
+	     p->ino,p->a,p->b);
+      break;
+    case P_BADENT:
+      printf("!! directory %d: entry '%s' (slot %d) points to bad inode %d\n",
+	     p->ino,p->name,p->a,p->b);
+      break;
+    case P_FREEENT:
+      printf("!! directory %d: entry '%s' (slot %d) points to free inode %d\n",
+	     p->ino,p->name,p->a,p->b);
+      break;
+    case P_NODOT:
+      printf("!! directory %d: no '%s' entry\n",p->ino,p->name);
+      break;
+    case P_ORPHAN:
+      printf("!! inode %d: in use but not in any directory\n",p->ino);
+      break;
+    case P_NLINK:
+      printf("!! inode %d: link count is %d, should be %d\n",p->ino,p->a,p->b);
+      break;
+    }
+  }
+
+  if (res->badlist)
+    printf("!! free block list is corrupt.\n");
+  if (res->badfree)
+    printf("!! %d out of range blocks in the free list.\n",res->badfree);
+  if (res->dupfree)
+    printf("!! %d blocks appear twice in the free list.\n",res->dupfree);
+  if (res->usedfree)
+    printf("!! %d blocks in the free list are in use.\n",res->usedfree);
+  if (res->leaked)
+    printf("!! %d blocks are neither used nor free.\n",res->leaked);
+  if (res->tfree != sb.s_tfree)
+    printf("!! superblock says %d free blocks, free list holds %d.\n",
+	   sb.s_tfree,res->tfree);
+  if (res->tinode != sb.s_tinode)
+    printf("!! superblock says %d free inodes, found %d.\n",
+	   sb.s_tinode,res->tinode);
+  if (res->badicache)
+    printf("!! free inode cache is corrupt.\n");
+}
+
+/* repair */
+
+void clear_entry(int d, int slot) {
+  uz_direntry ent[UZ_BLOCKSZ / UZ_DIRELEN];
+  uz_inode x;
+  int b;
+
+  if (uz_read_inode(dsk,&sb,d,&x)!=0) return;
+  b = uz_xlate_block(dsk,&x,slot / (UZ_BLOCKSZ / UZ_DIRELEN));
+  if (b <= 0 || !INRANGE(b)) return;
+  if (uz_read_raw_block(dsk,b,(void *)ent)!=0) return;
+  ent[slot % (UZ_BLOCKSZ / UZ_DIRELEN)].d_ino = 0;
+  uz_write_raw_block(dsk,b,(void *)ent);
+}
+
+/* drops every block from rank cut on. the index blocks kept are
+   known to be good, stale pointers in them are zeroed so a later
+   grow does not pick them up */
+void cut_inode(int ino, uz_inode *x, int cut) {
+  uint16_t blk[256];
+  int i, k;
+
+  if (x->i_size > cut * UZ_BLOCKSZ)
+    x->i_size = cut * UZ_BLOCKSZ;
+
+  for(i=cut;i<18;i++)
+    x->i_addr[i] = 0;
+
+  if (cut <= 18)
+    x->i_addr[18] = 0;
+  else if (cut < 274 && x->i_addr[18] &&
+	   uz_read_raw_block(dsk,x->i_addr[18],(void *)blk)==0) {
+    for(i=cut-18;i<256;i++) blk[i] = 0;
+    uz_write_raw_block(dsk,x->i_addr[18],(void *)blk);
+  }
+
+  if (cut <= 274)
+    x->i_addr[19] = 0;
+  else if (x->i_addr[19]) {
+    uint16_t top[256];
+    if (uz_read_raw_block(dsk,x->i_addr[19],(void *)top)==0) {
+      k = (cut - 274) / 256;
+      if ((cut - 274) % 256) {
+	i = u16_to_le(top[k]);
+	if (i && uz_read_raw_block(dsk,i,(void *)blk)==0) {
+	  memset(blk + (cut - 274) % 256,0,
+		 (256 - (cut - 274) % 256) * sizeof(uint16_t));
+	  uz_write_raw_block(dsk,i,(void *)blk);
+	}
+	++k;
+      }
+      for(;k<256;k++) top[k] = 0;
+      uz_write_raw_block(dsk,x->i_addr[19],(void *)top);
+    }
+  }
+
+  uz_write_inode(dsk,&sb,ino,x);
+}
+
+/* marks the blocks of an inode in inuse, cutting the file short at
+   the first block that is out of range or already taken. inodes are
+   visited in ascending order, so a shared block stays with the lowest
+   inode */
+void keep_blocks(int ino, uint8_t *inuse, uz_blkno_t *map) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  uz_inode x;
+  int r, j, b, n, ni, cut, need[2], got[2], ngot;
+
+  if (uz_read_inode(dsk,&sb,ino,&x)!=0) return;
+  if (FREEINO(&x)) return;
+  n = uz_inode_map(dsk,&sb,&x,map,idx,&ni);
+  if (n <= 0) return;
+
+  cut = n;
+  for(r=0;r<n && cut==n;r++) {
+    /* index blocks needed from this rank on */
+    ngot = 0;
+    j = -1;
+    if (r == 18)  need[++j] = 0;
+    if (r == 274) need[++j] = 1;
+    if (r >= 274 && (r-274) % 256 == 0) need[++j] = 2 + (r-274) / 256;
+
+    for(;j>=0 && cut==n;j--) {
+      b = idx[need[j]];
+      if (b == 0) continue;
+      if (!INRANGE(b) || inuse[b]) cut = r;
+      else inuse[got[ngot++] = b] = 1;
+    }
+
+    b = map[r];
+    if (cut == n && b != 0) {
+      if (!INRANGE(b) || inuse[b]) cut = r;
+      else inuse[b] = 1;
+    }
+
+    /* index blocks taken at this rank are not needed after a cut */
+    if (cut != n)
+      while(ngot > 0)
+	inuse[got[--ngot]] = 0;
+  }
+
+  if (cut < n)
+    cut_inode(ino,&x,cut);
+}
+
+/* fixes what can be fixed in one go; problems that only show up
+   after that (entries of cleared inodes, children of cleared
+   directories) are left for the next check */
+int repair(result *res) {
+  uz_blkno_t *map;
+  uint8_t *inuse;
+  uz_inode x;
+  problem *p;
+  int i, k;
+
+  inuse = (uint8_t *) calloc(65536,1);
+  map = (uz_blkno_t *) malloc(UZ_MAXBLOCKS * sizeof(uz_blkno_t));
+  if (!inuse || !map) return -1;
+
+  if (uz_begin(dsk,&sb)!=0) return -1;
+
+  for(i=0;i<res->np;i++) {
+    p = &(res->p[i]);
+    switch(p->type) {
+    case P_BADENT:
+    case P_FREEENT:
+      clear_entry(p->ino,p->a);
+      break;
+    case P_BADSIZE:
+    case P_ORPHAN:
+      memset(&x,0,sizeof(x));
+      uz_write_inode(dsk,&sb,p->ino,&x);
+      break;
+    case P_NLINK:
+      if (uz_read_inode(dsk,&sb,p->ino,&x)==0) {
+	x.i_nlink = p->b;
+	uz_write_inode(dsk,&sb,p->ino,&x);
+      }
+      break;
+    }
+  }
+
+  /* block ownership from scratch, then the free lists */
+  for(i=1;i<ninodes;i++)
+    keep_blocks(i,inuse,map);
+
+  if (uz_rebuild_freelist(dsk,&sb,inuse)!=0) {
+    uz_abort(dsk);
+    return -1;
+  }
+
+  sb.s_tinode = 0;
+  sb.s_ninode = 0;
+  memset(sb.s_inode,0,sizeof(sb.s_inode));
+  for(i=UZ_ROOT;i<ninodes;i++) {
+    if (uz_read_inode(dsk,&sb,i,&x)!=0) continue;
+    if (!FREEINO(&x)) continue;
+    ++sb.s_tinode;
+    if (sb.s_ninode < 50) sb.s_inode[sb.s_ninode++] = i;
+  }
+
+  k = (uz_write_sblock(dsk,&sb)!=0 || uz_commit(dsk,0)!=0) ? -1 : 0;
+  free(inuse);
+  free(map);
+  return k;
+}
+
+int load(void) {
+  if (uz_read_sblock(dsk,&sb)!=0) return -1;
+  if (uz_read_itable(dsk,&sb,itable)!=0) return -1;
+  return 0;
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsck [-y] [-j threads] image.dsk\n\n");
+  exit(8);
+}
+
+int main(int argc, char **argv) {
+  result res;
+  int i, fix = 0, pass, status = 0;
+
+  uz_global_opt(argc, argv);
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  image = 0;
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-y")) {
+      fix = 1;
+      continue;
+    }
+    if (!strcmp(argv[i],"-j")) {
+      if (++i >= argc) usage();
+      nthreads = atoi(argv[i]);
+      continue;
+    }
+    if (argv[i][0] == '-' || image) usage();
+    image = argv[i];
+  }
+
+  if (!image) usage();
+  if (nthreads < 1)  nthreads = 1;
+  if (nthreads > 64) nthreads = 64;
+
+  dsk = fopen(image,fix ? "r+" : "r");
+  if (!dsk) {
+    fprintf(stderr,"uzixfsck: unable to open %s.\n",image);
+    return 8;
+  }
+
+  if (uz_read_sblock(dsk,&sb)!=0) {
+    fprintf(stderr,"uzixfsck: error reading fs superblock.\n");
+    return 8;
+  }
+
+  if (sb.s_mounted != UZ_SBSIG || sb.s_reserv <= UZ_SBLOCK ||
+      sb.s_isize == 0 || sb.s_reserv + sb.s_isize >= sb.s_fsize) {
+    fprintf(stderr,"uzixfsck: superblock of %s is corrupt, cannot check.\n",
+	    image);
+    return 8;
+  }
+
+  ninodes = sb.s_isize * UZ_IPB;
+  lo = sb.s_reserv + sb.s_isize;
+  hi = sb.s_fsize;
+
+  itable = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  refs   = (uint32_t *) malloc(ninodes * sizeof(uint32_t));
+  dirs   = (int *) malloc(ninodes * sizeof(int));
+  owner  = (uint16_t *) malloc(65536 * sizeof(uint16_t));
+  claims = (uint16_t *) malloc(65536 * sizeof(uint16_t));
+  if (!itable || !refs || !dirs || !owner || !claims) {
+    fprintf(stderr,"uzixfsck: out of memory\n");
+    return 8;
+  }
+
+  if (uz_read_itable(dsk,&sb,itable)!=0) {
+    fprintf(stderr,"uzixfsck: error reading inode table.\n");
+    return 8;
+  }
+
+  printf("UZIX fs: %s\n",image);
+
+  for(pass=1;;pass++) {
+    check(&res);
+    show(&res);
+
+    if (!res.total || !fix) break;
+    if (pass == 4) break;
+
+    printf("** repairing (pass %d)\n",pass);
+    if (repair(&res)!=0 || load()!=0) {
+      fprintf(stderr,"uzixfsck: error writing %s.\n",image);
+      return 8;
+    }
+    free(res.p);
+    status = 1;
+  }
+
+  printf("%d files, %d directories, %d/%d data blocks free, %d/%d inodes free\n",
+	 res.nfiles,res.ndirs,res.tfree,hi-lo,res.tinode,ninodes-1);
+
+  if (res.total) {
+    printf("%d problem%s%s.\n",res.total,res.total==1 ? "" : "s",
+	   fix ? " left" : " found");
+    status = 4;
+  }
+
+  free(res.p);
+  fclose(dsk);
+  return status;
+}
@@ -0,0 +1,278 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+#include "byteorder.h"
+
+#define RUN 128 /* blocks read from the source at once */
+
+FILE      *src, *mem;
+uz_sblock  ssb, dsb;
+uz_inode  *stable;
+int        ninodes;
+int        quiet;
+
+int       *cloned;   /* source inode -> new inode */
+char     **first;    /* first path of each hard linked source inode */
+int        nfiles, ndirs = 1, nlinks, nerrors;
+
+uz_blkno_t smap[UZ_MAXBLOCKS], dmap[UZ_MAXBLOCKS];
+uint8_t    buf[RUN * UZ_BLOCKSZ];
+
+/* copies the data of a source inode into the new one, reading the
+   source in runs of adjacent blocks. -2 if it does not fit */
+int copy_data(int sino, int dino) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  uz_inode x;
+  int r, k, n, ni;
+
+  n = uz_inode_map(src,&ssb,&stable[sino],smap,idx,&ni);
+  if (n < 0) return -1;
+  if (n == 0) return 0;
+
+  if (uz_inode_grow(mem,&dsb,dino,stable[sino].i_size)!=0) return -2;
+  if (uz_read_inode(mem,&dsb,dino,&x)!=0) return -1;
+  if (uz_inode_map(mem,&dsb,&x,dmap,idx,&ni)!=n) return -1;
+
+  for(r=0;r<n;r+=k) {
+    if (smap[r] == 0) { k = 1; continue; } /* hole, left zeroed */
+    for(k=1;r+k<n && k<RUN && smap[r+k] == smap[r]+k;k++) ;
+    if (uz_read_blocks(src,smap[r],k,buf)!=0) return -1;
+    for(ni=0;ni<k;ni++)
+      if (uz_write_raw_block(mem,dmap[r+ni],buf + ni*UZ_BLOCKSZ)!=0)
+	return -1;
+  }
+  return 0;
+}
+
+void nospace(char *path) {
+  fprintf(stderr,"%s: out of %s, the source does not fit in the new image.\n",
+	  path,dsb.s_tinode ? "space" : "inodes");
+  exit(4);
+}
+
+/* recreates every entry of a source directory under path, then the
+   directories among them, breadth first */
+void clone_tree(void) {
+  uz_dir d;
+  uz_direntry ent;
+  char name[UZ_DIRNAMELEN+1], npath[512];
+  int *qino, i, nq = 0, sino, dino, mode;
+  char **qpath;
+
+  qino  = (int *) malloc(ninodes * sizeof(int));
+  qpath = (char **) malloc(ninodes * sizeof(char *));
+  if (!qino || !qpath) {
+    fprintf(stderr,"uzixfsclone: out of memory\n");
+    exit(2);
+  }
+
+  qino[nq] = UZ_ROOT;
+  qpath[nq++] = strdup("");
+  cloned[UZ_ROOT] = UZ_ROOT;
+
+  for(i=0;i<nq;i++) {
+    if (uz_iopendir(qino[i],src,&ssb,&d)!=0) {
+      fprintf(stderr,"%s/: can't read directory, skipped.\n",qpath[i]);
+      ++nerrors;
+      continue;
+    }
+    while(uz_readdir(&d,&ent)==0) {
+      memset(name,0,sizeof(name));
+      memcpy(name,ent.d_name,UZ_DIRNAMELEN);
+      if (!strcmp(name,".") || !strcmp(name,"..")) continue;
+
+      sino = u16_to_le(ent.d_ino);
+      if (strlen(qpath[i]) + strlen(name) + 2 > sizeof(npath) ||
+	  sino <= UZ_ROOT || sino >= ninodes) {
+	fprintf(stderr,"%s/%s: bad entry, skipped.\n",qpath[i],name);
+	++nerrors;
+	continue;
+      }
+      strcpy(npath,qpath[i]);
+      strcat(npath,"/");
+      strcat(npath,name);
+
+      if (cloned[sino]) {
+	if (first[sino] && uz_link(first[sino],npath,mem,&dsb)==0)
+	  ++nlinks;
+	else {
+	  fprintf(stderr,"%s: can't link, skipped.\n",npath);
+	  ++nerrors;
+	}
+	continue;
+      }
+
+      mode = stable[sino].i_mode;
+      if ((mode & UZ_IFMT) == UZ_IFDIR) {
+	dino = uz_mkdir(npath,mem,&dsb,mode & ~UZ_IFMT);
+	if (dino >= 0) {
+	  qino[nq] = sino;
+	  qpath[nq++] = strdup(npath);
+	  ++ndirs;
+	}
+      } else {
+	dino = uz_mknod(npath,mem,&dsb,mode);
+	if (dino >= 0) {
+	  switch(copy_data(sino,dino)) {
+	  case -1:
+	    fprintf(stderr,"%s: can't read data, copied as empty.\n",npath);
+	    ++nerrors;
+	    break;
+	  case -2:
+	    nospace(npath);
+	  }
+	  ++nfiles;
+	}
+	if (dino >= 0 && stable[sino].i_nlink > 1)
+	  first[sino] = strdup(npath);
+      }
+
+      if (dino < 0) {
+	if (dsb.s_tinode == 0 || dsb.s_tfree == 0) nospace(npath);
+	fprintf(stderr,"%s: can't create, skipped.\n",npath);
+	++nerrors;
+	continue;
+      }
+      cloned[sino] = dino;
+    }
+    uz_closedir(&d);
+  }
+
+  for(i=0;i<nq;i++) free(qpath[i]);
+  free(qpath);
+  free(qino);
+}
+
+/* owners, times and device numbers, once all entries are in place */
+void clone_attrs(void) {
+  uz_inode x, *s;
+  int i;
+
+  for(i=UZ_ROOT;i<ninodes;i++) {
+    if (!cloned[i]) continue;
+    if (uz_read_inode(mem,&dsb,cloned[i],&x)!=0) continue;
+    s = &stable[i];
+    x.i_mode  = s->i_mode;
+    x.i_uid   = s->i_uid;
+    x.i_gid   = s->i_gid;
+    x.i_atime = s->i_atime;
+    x.i_mtime = s->i_mtime;
+    x.i_ctime = s->i_ctime;
+    if ((s->i_mode & UZ_IFMT) == UZ_IFBLK || (s->i_mode & UZ_IFMT) == UZ_IFCHR)
+      x.i_addr[0] = s->i_addr[0];
+    uz_write_inode(mem,&dsb,cloned[i],&x);
+  }
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsclone [-q] [-f size] [-i size] [-r size] source.dsk dest.dsk\n");
+  fprintf(stderr,"sizes as in mkuzixfs, default to those of the source image.\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  char *sname = 0, *dname = 0;
+  FILE *dsk;
+  uint8_t boot[UZ_BLOCKSZ], *image;
+  uz_blkno_t *newpos;
+  int i, fsize = -1, isize = -1, rsize = -1, fb, ib, rb, moved;
+  long size;
+
+  uz_global_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-q")) { quiet = 1; continue; }
+    if (argv[i][0] == '-' && i == argc-1) usage();
+    if (!strcmp(argv[i],"-f")) { if ((fsize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (!strcmp(argv[i],"-i")) { if ((isize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (!strcmp(argv[i],"-r")) { if ((rsize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (argv[i][0] == '-' || dname) usage();
+    if (!sname) sname = argv[i]; else dname = argv[i];
+  }
+  if (!dname) usage();
+
+  src = fopen(sname,"r");
+  if (!src) {
+    fprintf(stderr,"unable to open %s.\n",sname);
+    return 2;
+  }
+  if (uz_read_sblock(src,&ssb)!=0 || ssb.s_mounted != UZ_SBSIG ||
+      ssb.s_reserv <= UZ_SBLOCK || ssb.s_reserv + ssb.s_isize >= ssb.s_fsize) {
+    fprintf(stderr,"%s: bad superblock.\n",sname);
+    return 2;
+  }
+
+  fb = fsize < 0 ? ssb.s_fsize : fsize / UZ_BLOCKSZ;
+  ib = isize < 0 ? ssb.s_isize : isize / UZ_BLOCKSZ;
+  rb = rsize < 0 ? ssb.s_reserv - 2 : rsize / UZ_BLOCKSZ;
+  if (fb > 65535 || rb + ib + 2 >= fb || ib == 0) {
+    fprintf(stderr,"** illegal f/i/r size specification.\n\n");
+    return 2;
+  }
+
+  ninodes = ssb.s_isize * UZ_IPB;
+  stable = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  cloned = (int *) calloc(ninodes,sizeof(int));
+  first  = (char **) calloc(ninodes,sizeof(char *));
+  size   = (long) fb * UZ_BLOCKSZ;
+  image  = (uint8_t *) calloc(size,1);
+  newpos = (uz_blkno_t *) malloc(65536 * sizeof(uz_blkno_t));
+  if (!stable || !cloned || !first || !image || !newpos) {
+    fprintf(stderr,"uzixfsclone: out of memory\n");
+    return 2;
+  }
+
+  if (uz_read_itable(src,&ssb,stable)!=0 || uz_read_raw_block(src,0,boot)!=0) {
+    fprintf(stderr,"%s: error reading image.\n",sname);
+    return 2;
+  }
+
+  /* the new image is built in memory */
+  mem = fmemopen(image,size,"r+");
+  boot[0x10] = rb;
+  if (!mem || uz_mkfs(mem,&dsb,fb,ib,rb,boot)!=0) {
+    fprintf(stderr,"uzixfsclone: unable to create the new filesystem.\n");
+    return 2;
+  }
+
+  clone_tree();
+  clone_attrs();
+
+  /* directories grew while files were being written; lay everything
+     out in single runs */
+  moved = uz_layout_plan(mem,&dsb,newpos);
+  if (moved < 0 || (moved > 0 && uz_relocate(mem,&dsb,newpos)!=0) ||
+      fflush(mem)!=0) {
+    fprintf(stderr,"uzixfsclone: relayout failed.\n");
+    return 2;
+  }
+  fclose(mem);
+
+  /* one sequential write */
+  dsk = fopen(dname,"w");
+  if (!dsk || fwrite(image,1,size,dsk)!=size || fclose(dsk)!=0) {
+    fprintf(stderr,"%s: error writing image.\n",dname);
+    return 5;
+  }
+
+  if (!quiet)
+    printf("%s: %d files, %d directories, %d links, %d/%d data blocks used\n",
+	   dname,nfiles,ndirs,nlinks,
+	   dsb.s_fsize - dsb.s_reserv - dsb.s_isize - dsb.s_tfree,
+	   dsb.s_fsize - dsb.s_reserv - dsb.s_isize);
+
+  fclose(src);
+  return nerrors ? 3 : 0;
+}
@@ -0,0 +1,142 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+
+uz_sblock  sb;
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsdefrag [-n] [-u undolog] image.dsk\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  FILE *dsk, *mem;
+  char *image = 0, *undolog = 0;
+  uint8_t *buf, *orig;
+  uz_inode *itable;
+  uz_blkno_t *newpos, *seq;
+  int i, j, b, n, ninodes, dryrun = 0;
+  int blocks = 0, before = 0, after = 0, moved, written = 0;
+  long size;
+
+  uz_global_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-n")) { dryrun = 1; continue; }
+    if (!strcmp(argv[i],"-u") && i < argc-1) { undolog = argv[++i]; continue; }
+    if (argv[i][0] == '-' || image) usage();
+    image = argv[i];
+  }
+
+  if (!image) usage();
+  if (undolog && !dryrun && uz_recover(image,undolog)!=0) return 2;
+
+  dsk = fopen(image,dryrun ? "r" : "r+");
+  if (!dsk) {
+    fprintf(stderr,"unable to open %s.\n",image);
+    return 2;
+  }
+
+  if (uz_read_sblock(dsk,&sb)!=0 || sb.s_mounted != UZ_SBSIG ||
+      sb.s_reserv <= UZ_SBLOCK ||
+      sb.s_reserv + sb.s_isize >= sb.s_fsize) {
+    fprintf(stderr,"%s: bad superblock.\n",image);
+    return 2;
+  }
+
+  /* the whole image is worked on in memory */
+  size = (long) sb.s_fsize * UZ_BLOCKSZ;
+  buf  = (uint8_t *) malloc(size);
+  orig = (uint8_t *) malloc(size);
+  newpos = (uz_blkno_t *) calloc(65536,sizeof(uz_blkno_t));
+  seq = (uz_blkno_t *) malloc((UZ_MAXBLOCKS + UZ_MAXINDEX) * sizeof(uz_blkno_t));
+  ninodes = sb.s_isize * UZ_IPB;
+  itable = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  if (!buf || !orig || !newpos || !seq || !itable) {
+    fprintf(stderr,"uzixfsdefrag: out of memory\n");
+    return 2;
+  }
+
+  if (fseek(dsk,0,SEEK_SET)!=0 || fread(buf,1,size,dsk)!=size) {
+    fprintf(stderr,"%s: error reading image.\n",image);
+    return 2;
+  }
+  memcpy(orig,buf,size);
+
+  mem = fmemopen(buf,size,"r+");
+  if (!mem || uz_read_sblock(mem,&sb)!=0 || uz_read_itable(mem,&sb,itable)!=0) {
+    fprintf(stderr,"%s: error reading image.\n",image);
+    return 2;
+  }
+
+  /* extents now: runs of adjacent blocks in read order */
+  for(i=1;i<ninodes;i++) {
+    if (itable[i].i_mode == 0 && itable[i].i_nlink == 0) continue;
+    n = uz_inode_layout(mem,&sb,&itable[i],seq);
+    if (n <= 0) continue;
+    for(j=0;j<n;j++)
+      if (j == 0 || seq[j] != seq[j-1] + 1) ++before;
+    blocks += n;
+    ++after;
+  }
+
+  moved = uz_layout_plan(mem,&sb,newpos);
+  if (moved < 0) {
+    fprintf(stderr,"%s: bad or shared blocks, run uzixfsck first.\n",image);
+    return 2;
+  }
+
+  printf("UZIX fs: %s\n",image);
+  printf("files with blocks         : %d\n",after);
+  printf("blocks in files           : %d\n",blocks);
+  printf("extents                   : %d -> %d\n",before,after);
+  printf("blocks to move            : %d\n",moved);
+
+  if (dryrun || !moved) {
+    fclose(mem);
+    fclose(dsk);
+    return 0;
+  }
+
+  if (uz_relocate(mem,&sb,newpos)!=0 || fflush(mem)!=0) {
+    fprintf(stderr,"%s: relocation failed, image left untouched.\n",image);
+    return 2;
+  }
+
+  /* write back only the blocks that changed, in one ascending pass */
+  if (uz_begin(dsk,&sb)!=0) {
+    fprintf(stderr,"uzixfsdefrag: out of memory\n");
+    return 2;
+  }
+  for(b=0;b<sb.s_fsize;b++) {
+    if (!memcmp(buf + (long) b * UZ_BLOCKSZ,orig + (long) b * UZ_BLOCKSZ,UZ_BLOCKSZ))
+      continue;
+    if (uz_write_raw_block(dsk,b,buf + (long) b * UZ_BLOCKSZ)!=0) {
+      fprintf(stderr,"uzixfsdefrag: out of memory\n");
+      return 2;
+    }
+    ++written;
+  }
+  if (uz_commit(dsk,undolog)!=0) {
+    fprintf(stderr,"%s: error writing image.\n",image);
+    return 2;
+  }
+
+  printf("blocks written            : %d\n",written);
+
+  fclose(mem);
+  fclose(dsk);
+  return 0;
+}
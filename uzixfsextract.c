@@ -0,0 +1,395 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+#include "byteorder.h"
+/* after uzixdir.h: uz_stat has fields named like the st_atime, ...
+   macros of sys/stat.h */
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <utime.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define RUN 128 /* longest run read at once, in blocks */
+
+/* blocks [block, block+count) hold ranks [rank, rank+count) */
+typedef struct {
+  uz_blkno_t block;
+  uint16_t   count;
+  int32_t    rank;
+} run;
+
+/* a file to copy, with its extents */
+typedef struct {
+  char     *path;
+  uz_ino_t  ino;
+  int       nruns;
+  run      *runs;
+} job;
+
+/* a host path made during the walk, to get its attributes later */
+typedef struct {
+  char     *path;
+  uz_ino_t  ino;
+} node;
+
+FILE      *f;
+int        fd;
+uz_sblock  sb;
+uz_inode  *itable;
+int        ninodes, nthreads, quiet, owners;
+int        nerrors, next;
+long       nbytes;
+
+char     **first;   /* host path of the first name of each inode */
+uint8_t   *seen;    /* directories already queued by the walk */
+job       *jobs;
+int        njobs;
+node      *links, *dirs;
+int        nlinks, ndirs, nspecial;
+
+uz_blkno_t map[UZ_MAXBLOCKS];
+
+void * grow(void *p, int n, int size) {
+  /* arrays double when n reaches a power of two */
+  if (n == 0 || (n & (n-1)) == 0) {
+    p = realloc(p,(n ? 2*n : 16) * size);
+    if (!p) {
+      fprintf(stderr,"uzixfsextract: out of memory\n");
+      exit(2);
+    }
+  }
+  return p;
+}
+
+void problem(char *path, char *what) {
+  fprintf(stderr,"%s: %s\n",path,what);
+  __atomic_fetch_add(&nerrors,1,__ATOMIC_RELAXED);
+}
+
+/* mode, owner and times of a host path, from its inode */
+void attrs(char *path, uz_inode *x) {
+  struct utimbuf ut;
+
+  if (owners && chown(path,x->i_uid,x->i_gid)!=0)
+    problem(path,strerror(errno));
+  if (chmod(path,x->i_mode & 07777)!=0)
+    problem(path,strerror(errno));
+  ut.actime  = uz_time_to_unix(&x->i_atime);
+  ut.modtime = uz_time_to_unix(&x->i_mtime);
+  if (utime(path,&ut)!=0)
+    problem(path,strerror(errno));
+}
+
+/* splits the blocks of a file into runs of adjacent blocks */
+int extents(job *j, uz_inode *x) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  int r, k, n, ni;
+
+  n = uz_inode_map(f,&sb,x,map,idx,&ni);
+  if (n < 0) return -1;
+
+  j->nruns = 0;
+  j->runs  = 0;
+  for(r=0;r<n;r+=k) {
+    if (map[r] == 0) { k = 1; continue; } /* hole */
+    for(k=1;r+k<n && k<RUN && map[r+k] == map[r]+k;k++) ;
+    j->runs = (run *) grow(j->runs,j->nruns,sizeof(run));
+    j->runs[j->nruns].block = map[r];
+    j->runs[j->nruns].count = k;
+    j->runs[j->nruns].rank  = r;
+    ++j->nruns;
+  }
+  return 0;
+}
+
+/* the one metadata pass: walks the tree breadth first, makes the
+   directories, links and special files on the host and lists the
+   files to copy */
+void walk(uz_ino_t top, char *dest) {
+  uz_dir d;
+  uz_direntry ent;
+  uz_inode *x;
+  struct stat st;
+  char name[UZ_DIRNAMELEN+1], path[1024], target[UZ_BLOCKSZ+1];
+  int i, ino, fmt, len;
+
+  dirs = (node *) grow(dirs,ndirs,sizeof(node));
+  dirs[ndirs].path = strdup(dest);
+  dirs[ndirs++].ino = top;
+  seen[top] = 1;
+
+  for(i=0;i<ndirs;i++) {
+    if (uz_iopendir(dirs[i].ino,f,&sb,&d)!=0) {
+      problem(dirs[i].path,"can't read directory, skipped.");
+      continue;
+    }
+    while(uz_readdir(&d,&ent)==0) {
+      memset(name,0,sizeof(name));
+      memcpy(name,ent.d_name,UZ_DIRNAMELEN);
+      if (!strcmp(name,".") || !strcmp(name,"..")) continue;
+      /* a name must not lead out of the directory it is in */
+      if (!name[0] || strchr(name,'/')) {
+	problem(dirs[i].path,"entry with a bad name, skipped.");
+	continue;
+      }
+
+      if (strlen(dirs[i].path) + strlen(name) + 2 > sizeof(path)) {
+	problem(name,"path too long, skipped.");
+	continue;
+      }
+      strcpy(path,dirs[i].path);
+      strcat(path,"/");
+      strcat(path,name);
+
+      ino = u16_to_le(ent.d_ino);
+      if (ino <= UZ_ROOT || ino >= ninodes) {
+	problem(path,"bad entry, skipped.");
+	continue;
+      }
+      x = &itable[ino];
+      fmt = x->i_mode & UZ_IFMT;
+
+      if (fmt == UZ_IFDIR) {
+	/* a second name of a directory, or a loop back to an ancestor */
+	if (seen[ino]) {
+	  problem(path,"directory already extracted, skipped.");
+	  continue;
+	}
+	seen[ino] = 1;
+	if (mkdir(path,0700)!=0) {
+	  if (errno != EEXIST) {
+	    problem(path,strerror(errno));
+	    continue;
+	  }
+	  /* never go through a link made by an earlier entry */
+	  if (lstat(path,&st)!=0 || !S_ISDIR(st.st_mode)) {
+	    problem(path,"exists and is not a directory, skipped.");
+	    continue;
+	  }
+	}
+	dirs = (node *) grow(dirs,ndirs,sizeof(node));
+	dirs[ndirs].path = strdup(path);
+	dirs[ndirs++].ino = ino;
+	continue;
+      }
+
+      /* a second name of an inode is linked after the copy */
+      if (first[ino]) {
+	links = (node *) grow(links,nlinks,sizeof(node));
+	links[nlinks].path = strdup(path);
+	links[nlinks++].ino = ino;
+	continue;
+      }
+
+      unlink(path);
+      switch(fmt) {
+      case UZ_IFLNK:
+	len = x->i_size > UZ_BLOCKSZ ? UZ_BLOCKSZ : x->i_size;
+	memset(target,0,sizeof(target));
+	if (len < 0 || uz_read_data(f,x,0,len,target)!=len) {
+	  problem(path,"can't read link, skipped.");
+	  continue;
+	}
+	if (symlink(target,path)!=0) {
+	  problem(path,strerror(errno));
+	  continue;
+	}
+	if (owners && lchown(path,x->i_uid,x->i_gid)!=0)
+	  problem(path,strerror(errno));
+	++nspecial;
+	break;
+      case UZ_IFCHR:
+      case UZ_IFBLK:
+      case UZ_IFPIPE:
+	if (mknod(path,(x->i_mode & 07777) | (fmt == UZ_IFCHR ? S_IFCHR :
+		  fmt == UZ_IFBLK ? S_IFBLK : S_IFIFO),
+		  fmt == UZ_IFPIPE ? 0 : x->i_addr[0])!=0) {
+	  problem(path,strerror(errno));
+	  continue;
+	}
+	attrs(path,x);
+	++nspecial;
+	break;
+      default:
+	if (x->i_size < 0 || x->i_size > UZ_MAXBLOCKS * UZ_BLOCKSZ) {
+	  problem(path,"bad size, skipped.");
+	  continue;
+	}
+	jobs = (job *) grow(jobs,njobs,sizeof(job));
+	jobs[njobs].path = strdup(path);
+	jobs[njobs].ino  = ino;
+	if (extents(&jobs[njobs],x)!=0) {
+	  problem(path,"bad block pointers, skipped.");
+	  free(jobs[njobs].path);
+	  continue;
+	}
+	++njobs;
+      }
+      first[ino] = strdup(path);
+    }
+    uz_closedir(&d);
+  }
+}
+
+/* copies one file with pread/pwrite; holes are left as holes */
+void copy(job *j, uint8_t *buf) {
+  uz_inode *x = &itable[j->ino];
+  long off, len, got;
+  int out, i;
+
+  out = open(j->path,O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,0600);
+  if (out < 0) {
+    problem(j->path,strerror(errno));
+    return;
+  }
+
+  for(i=0;i<j->nruns;i++) {
+    off = (long) j->runs[i].rank * UZ_BLOCKSZ;
+    len = (long) j->runs[i].count * UZ_BLOCKSZ;
+    if (off + len > x->i_size) len = x->i_size - off;
+    got = pread(fd,buf,len,(off_t) j->runs[i].block * UZ_BLOCKSZ);
+    if (got != len) {
+      problem(j->path,"error reading image, file incomplete.");
+      break;
+    }
+    if (pwrite(out,buf,len,off)!=len) {
+      problem(j->path,strerror(errno));
+      break;
+    }
+    __atomic_fetch_add(&nbytes,len,__ATOMIC_RELAXED);
+  }
+  if (ftruncate(out,x->i_size)!=0)
+    problem(j->path,strerror(errno));
+  close(out);
+  attrs(j->path,x);
+}
+
+void * worker(void *arg) {
+  uint8_t *buf;
+  int i;
+
+  buf = (uint8_t *) malloc(RUN * UZ_BLOCKSZ);
+  if (!buf) {
+    problem("uzixfsextract","out of memory");
+    return 0;
+  }
+  for(;;) {
+    i = __atomic_fetch_add(&next,1,__ATOMIC_RELAXED);
+    if (i >= njobs) break;
+    copy(&jobs[i],buf);
+  }
+  free(buf);
+  return 0;
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsextract [-q] [-j threads] image.dsk [directory] destdir\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  pthread_t *t;
+  char *image = 0, *dir = "/", *dest = 0, *arg[3];
+  int i, n = 0, ino;
+
+  uz_global_opt(argc, argv);
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-q")) { quiet = 1; continue; }
+    if (!strcmp(argv[i],"-j")) {
+      if (++i >= argc) usage();
+      nthreads = atoi(argv[i]);
+      continue;
+    }
+    if (argv[i][0] == '-' || n == 3) usage();
+    arg[n++] = argv[i];
+  }
+  if (n < 2) usage();
+  image = arg[0];
+  if (n == 3) dir = arg[1];
+  dest = arg[n-1];
+  if (nthreads < 1)  nthreads = 1;
+  if (nthreads > 64) nthreads = 64;
+  owners = geteuid() == 0;
+
+  f  = fopen(image,"r");
+  fd = open(image,O_RDONLY);
+  if (!f || fd < 0) {
+    fprintf(stderr,"unable to open %s.\n",image);
+    return 2;
+  }
+  if (uz_read_sblock(f,&sb)!=0 || sb.s_mounted != UZ_SBSIG) {
+    fprintf(stderr,"%s: bad superblock.\n",image);
+    return 2;
+  }
+
+  ninodes = sb.s_isize * UZ_IPB;
+  itable = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  first  = (char **) calloc(ninodes,sizeof(char *));
+  seen   = (uint8_t *) calloc(ninodes,1);
+  if (!itable || !first || !seen) {
+    fprintf(stderr,"uzixfsextract: out of memory\n");
+    return 2;
+  }
+  if (uz_read_itable(f,&sb,itable)!=0) {
+    fprintf(stderr,"%s: error reading inode table.\n",image);
+    return 2;
+  }
+
+  ino = uz_lookup(dir,f,&sb);
+  if (ino < 0 || (itable[ino].i_mode & UZ_IFMT) != UZ_IFDIR) {
+    fprintf(stderr,"%s: no such directory on given image.\n",dir);
+    return 4;
+  }
+  if (mkdir(dest,0700)!=0 && errno != EEXIST) {
+    fprintf(stderr,"%s: %s\n",dest,strerror(errno));
+    return 5;
+  }
+
+  walk(ino,dest);
+
+  t = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  if (!t) {
+    fprintf(stderr,"uzixfsextract: out of memory\n");
+    return 2;
+  }
+  for(i=0;i<nthreads;i++)
+    if (pthread_create(&t[i],0,worker,0)!=0) break;
+  if (i == 0) worker(0);
+  while(--i >= 0)
+    pthread_join(t[i],0);
+
+  for(i=0;i<nlinks;i++) {
+    unlink(links[i].path);
+    if (link(first[links[i].ino],links[i].path)!=0)
+      problem(links[i].path,strerror(errno));
+  }
+
+  /* directories last, deepest first, as writing in them changed their
+     times and they may be read-only */
+  for(i=ndirs-1;i>=0;i--)
+    attrs(dirs[i].path,&itable[dirs[i].ino]);
+
+  if (!quiet)
+    printf("%s: %d files, %d directories, %d links, %d special, %ld bytes\n",
+	   dest,njobs,ndirs-1,nlinks,nspecial,nbytes);
+
+  close(fd);
+  fclose(f);
+  return nerrors ? 3 : 0;
+}
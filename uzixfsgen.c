@@ -0,0 +1,348 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+
+/* the same seed and options always give the same image, byte for byte */
+uint64_t   seed = 1;
+
+FILE      *mem;
+uz_sblock  sb;
+int        quiet;
+
+int        nfiles = -1, fanout = 4, depth = 2, frag = 0, fill = -1, links = 0;
+int        minsize = 0, maxsize = 64 * 1024, big = 0, wide = 0;
+
+char     **dirs;     /* every directory, the root first */
+int        ndirs;
+int       *regular;  /* inodes of the regular files made so far */
+char     **rpath;    /* and their paths */
+int        nregular, nlinks, nmade;
+
+uint8_t    buf[64 * UZ_BLOCKSZ];
+
+/* xorshift64* */
+uint32_t rnd(void) {
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return (uint32_t) ((seed * 2685821657736338717ULL) >> 32);
+}
+
+/* 0 <= x < n */
+int below(int n) {
+  return n > 0 ? (int) (((uint64_t) rnd() * n) >> 32) : 0;
+}
+
+/* log-uniform between minsize and maxsize: as many files between 1K
+   and 2K as between 32K and 64K, so many small files and a few large
+   ones, as on a real disk */
+int file_size(void) {
+  long lo, hi, x;
+  int k, levels;
+
+  if (maxsize <= minsize) return minsize;
+  lo = minsize + 1;
+  hi = (long) maxsize + 1;
+  for(levels=0;(lo << (levels+1)) <= hi;levels++) ;
+  k = below(levels+1);
+  x = lo << k;
+  x += below((x << 1) < hi ? x : hi - x);
+  return (int) (x - 1);
+}
+
+void nospace(char *what) {
+  fprintf(stderr,"uzixfsgen: out of %s, make the image larger (-f, -i).\n",what);
+  exit(4);
+}
+
+int data_used(void) {
+  return sb.s_fsize - sb.s_reserv - sb.s_isize - sb.s_tfree;
+}
+
+/* fills an inode with size bytes of pseudo random data */
+int fill_data(int ino, long size) {
+  uz_inode x;
+  long off;
+  uint32_t r = 0;
+  int i, n;
+
+  if (size == 0) return 0;
+  if (uz_inode_grow(mem,&sb,ino,size)!=0) return -2;
+  if (uz_read_inode(mem,&sb,ino,&x)!=0) return -1;
+  for(off=0;off<size;off+=n) {
+    n = size - off < sizeof(buf) ? size - off : sizeof(buf);
+    for(i=0;i<n;i++) {
+      if (!(i & 3)) r = rnd();
+      buf[i] = r;
+      r >>= 8;
+    }
+    if (uz_write_data(mem,&x,off,n,buf) < 0) return -1;
+  }
+  return 0;
+}
+
+/* nothing is ever freed here, so every inode past those handed out
+   is free: the cache is refilled from there, where uz_alloc_inode
+   would scan the table from the start each time */
+void refill_inodes(void) {
+  static int next = UZ_IPB; /* uz_mkfs caches the rest of block 0 */
+
+  while(sb.s_ninode < 50 && sb.s_ninode < sb.s_tinode &&
+	next < sb.s_isize * UZ_IPB)
+    sb.s_inode[sb.s_ninode++] = next++;
+}
+
+/* fanout subdirectories per directory, depth levels below the root */
+void make_tree(char *path, int level) {
+  char npath[256];
+  int i;
+
+  dirs[ndirs++] = strdup(path);
+  if (level == depth) return;
+  for(i=0;i<fanout;i++) {
+    sprintf(npath,"%s/d%d",strcmp(path,"/") ? path : "",i);
+    if (sb.s_ninode == 0) refill_inodes();
+    if (uz_mkdir(npath,mem,&sb,0755) < 0) nospace("inodes");
+    make_tree(npath,level+1);
+  }
+}
+
+/* files, and hard links to files already made, in random directories */
+void make_files(void) {
+  char path[256], *dir;
+  int ino, size;
+
+  while(nfiles < 0 || nmade < nfiles) {
+    if (fill >= 0 && (100.0 * data_used()) /
+	(sb.s_fsize - sb.s_reserv - sb.s_isize) >= fill)
+      break;
+    if (nfiles < 0 && sb.s_tinode == 0) break;
+
+    dir = dirs[below(ndirs)];
+    sprintf(path,"%s/f%d",strcmp(dir,"/") ? dir : "",nmade++);
+
+    if (nregular && below(100) < links) {
+      if (uz_link(rpath[below(nregular)],path,mem,&sb)!=0) nospace("space");
+      ++nlinks;
+      continue;
+    }
+
+    size = file_size();
+    if (sb.s_ninode == 0) refill_inodes();
+    ino = uz_mknod(path,mem,&sb,UZ_IFREG | 0644);
+    if (ino < 0) nospace("inodes");
+    if (fill_data(ino,size)!=0) {
+      /* the size drawn does not fit: unless a count was asked for,
+	 the image is as full as it gets */
+      if (nfiles >= 0) nospace("space");
+      uz_unlink(path,mem,&sb);
+      --nmade;
+      break;
+    }
+    regular[nregular] = ino;
+    rpath[nregular++] = strdup(path);
+  }
+}
+
+/* blocks a file of n data blocks takes, index blocks included */
+int with_index(int n) {
+  int k = n;
+  if (n > 18)  ++k;
+  if (n > 274) k += 1 + (n - 274 + 255) / 256;
+  return k;
+}
+
+/* one file as large as the free space (and the block map) allows */
+void make_big(void) {
+  int ino, n;
+
+  for(n=sb.s_tfree;n>0 && with_index(n) > sb.s_tfree;n--) ;
+  if (n > UZ_MAXBLOCKS) n = UZ_MAXBLOCKS;
+  ino = uz_mknod("/big",mem,&sb,UZ_IFREG | 0644);
+  if (ino < 0) nospace("inodes");
+  while(n > 0 && fill_data(ino,(long) n * UZ_BLOCKSZ) == -2) --n;
+  if (n <= 0) nospace("space");
+  regular[nregular] = ino;
+  rpath[nregular++] = strdup("/big");
+}
+
+/* swaps frag percent of the data area blocks among themselves */
+void fragment(void) {
+  uz_blkno_t *newpos, *pick;
+  int i, j, n = 0, lo, t;
+
+  lo = sb.s_reserv + sb.s_isize;
+  newpos = (uz_blkno_t *) calloc(65536,sizeof(uz_blkno_t));
+  pick   = (uz_blkno_t *) malloc(65536 * sizeof(uz_blkno_t));
+  if (!newpos || !pick) nospace("memory");
+
+  for(i=lo;i<sb.s_fsize;i++)
+    if (below(100) < frag) pick[n++] = i;
+  for(i=0;i<n;i++) newpos[pick[i]] = pick[i];
+  for(i=n-1;i>0;i--) {
+    j = below(i+1);
+    t = newpos[pick[i]];
+    newpos[pick[i]] = newpos[pick[j]];
+    newpos[pick[j]] = t;
+  }
+
+  if (n && uz_relocate(mem,&sb,newpos)!=0) {
+    fprintf(stderr,"uzixfsgen: relocation failed.\n");
+    exit(2);
+  }
+  free(newpos);
+  free(pick);
+}
+
+/* times would be the only thing to change between runs */
+void fix_times(void) {
+  uz_inode x;
+  uz_time_t t;
+  int i;
+
+  uz_set_date(1,1,2000,&t);
+  uz_set_time(0,0,0,&t);
+  for(i=UZ_ROOT;i<sb.s_isize * UZ_IPB;i++) {
+    if (uz_read_inode(mem,&sb,i,&x)!=0) continue;
+    if (x.i_mode == 0 && x.i_nlink == 0) continue;
+    x.i_atime = x.i_mtime = x.i_ctime = t;
+    uz_write_inode(mem,&sb,i,&x);
+  }
+  sb.s_time = t;
+  uz_write_sblock(mem,&sb);
+}
+
+/* "a:b" into two numbers, sizes or plain */
+int pair(char *x, int *a, int *b, int sizes) {
+  char *c = strchr(x,':');
+  if (!c) return -1;
+  *c = 0;
+  *a = sizes ? uz_parse_size(x) : atoi(x);
+  *b = sizes ? uz_parse_size(c+1) : atoi(c+1);
+  *c = ':';
+  return (*a < 0 || *b < 0) ? -1 : 0;
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsgen [-q] [-s seed] [-f size] [-i size] [-n files] [-z min:max]\n");
+  fprintf(stderr,"                 [-d fanout:depth] [-p fill%%] [-l links%%] [-F frag%%]\n");
+  fprintf(stderr,"                 [--big | --wide] image.dsk\n");
+  fprintf(stderr,"sizes as in mkuzixfs.\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  char *name = 0;
+  uint8_t *image, boot[UZ_BLOCKSZ];
+  FILE *dsk;
+  long size;
+  int i, fsize = 8192 * 1024, isize = -1, fb, ib, want, sized = 0;
+
+  uz_global_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-q"))     { quiet = 1; continue; }
+    if (!strcmp(argv[i],"--big"))  { big = 1; continue; }
+    if (!strcmp(argv[i],"--wide")) { wide = 1; continue; }
+    if (argv[i][0] == '-' && i == argc-1) usage();
+    if (!strcmp(argv[i],"-s")) { seed = strtoull(argv[++i],0,0); continue; }
+    if (!strcmp(argv[i],"-f")) { if ((fsize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (!strcmp(argv[i],"-i")) { if ((isize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (!strcmp(argv[i],"-n")) { nfiles = atoi(argv[++i]); continue; }
+    if (!strcmp(argv[i],"-z")) { if (pair(argv[++i],&minsize,&maxsize,1)!=0) usage(); sized = 1; continue; }
+    if (!strcmp(argv[i],"-d")) { if (pair(argv[++i],&fanout,&depth,0)!=0) usage(); continue; }
+    if (!strcmp(argv[i],"-p")) { fill  = atoi(argv[++i]); continue; }
+    if (!strcmp(argv[i],"-l")) { links = atoi(argv[++i]); continue; }
+    if (!strcmp(argv[i],"-F")) { frag  = atoi(argv[++i]); continue; }
+    if (argv[i][0] == '-' || name) usage();
+    name = argv[i];
+  }
+  if (!name || (big && wide) || nfiles < -1 || minsize > maxsize ||
+      fill < -1 || fill > 100 || links < 0 || links > 100 || frag < 0 || frag > 100)
+    usage();
+  if (seed == 0) seed = 1; /* xorshift would stay at 0 */
+
+  /* with neither a count nor a fill ratio, 1000 files; --wide alone
+     fills the directory with as many entries as there are inodes,
+     empty unless -z says otherwise, so data blocks don't run out
+     first */
+  if (nfiles < 0 && fill < 0 && !wide) nfiles = 1000;
+  if (wide) { fanout = 0; depth = 0; }
+  if (wide && !sized) minsize = maxsize = 0;
+  if (big)  { fanout = 0; depth = 0; nfiles = 0; }
+
+  /* by default, enough inodes for what was asked, with some spare */
+  fb = fsize / UZ_BLOCKSZ;
+  if (isize < 0) {
+    for(want=1,i=0,size=1;i<depth;i++) want += (size *= fanout);
+    want += nfiles < 0 ? fb / 4 : nfiles;
+    ib = (want + 2 + want / 8) / UZ_IPB + 1;
+  } else
+    ib = isize / UZ_BLOCKSZ;
+  if (ib > 8191) ib = 8191; /* inode numbers are 16 bits */
+  if (fb > 65535 || ib + 2 >= fb || ib == 0) {
+    fprintf(stderr,"** illegal f/i size specification.\n\n");
+    return 2;
+  }
+
+  size  = (long) fb * UZ_BLOCKSZ;
+  image = (uint8_t *) calloc(size,1);
+  dirs  = (char **) malloc(ib * UZ_IPB * sizeof(char *));
+  regular = (int *) malloc(ib * UZ_IPB * sizeof(int));
+  rpath = (char **) malloc(ib * UZ_IPB * sizeof(char *));
+  if (!image || !dirs || !regular || !rpath) {
+    fprintf(stderr,"uzixfsgen: out of memory\n");
+    return 2;
+  }
+
+  /* built in memory, written once */
+  mem = fmemopen(image,size,"r+");
+  memset(boot,0,sizeof(boot));
+  if (!mem || uz_mkfs(mem,&sb,fb,ib,0,boot)!=0) {
+    fprintf(stderr,"uzixfsgen: unable to create the filesystem.\n");
+    return 2;
+  }
+
+  make_tree("/",0);
+  if (wide) {
+    if (sb.s_ninode == 0) refill_inodes();
+    if (uz_mkdir("/wide",mem,&sb,0755) < 0) nospace("inodes");
+    dirs[0] = "/wide";
+  }
+  if (big)
+    make_big();
+  else
+    make_files();
+  if (frag) fragment();
+  fix_times();
+
+  if (fflush(mem)!=0) {
+    fprintf(stderr,"uzixfsgen: error building the image.\n");
+    return 2;
+  }
+  fclose(mem);
+
+  dsk = fopen(name,"w");
+  if (!dsk || fwrite(image,1,size,dsk)!=size || fclose(dsk)!=0) {
+    fprintf(stderr,"%s: error writing image.\n",name);
+    return 5;
+  }
+
+  if (!quiet)
+    printf("%s: %d files, %d links, %d directories, %d/%d data blocks used\n",
+	   name,nregular,nlinks,ndirs + wide,data_used(),
+	   sb.s_fsize - sb.s_reserv - sb.s_isize);
+  return 0;
+}
@@ -12,53 +12,70 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "uzixfs.h"
 #include "uzixdir.h"
 
-/* superblock sanity checks */
-int consistency_check(uz_sblock *sb) {
-  int failures = 0;
+#define NCHECKS 7
+
+char *checkname[NCHECKS] = { "signature", "inode_pointer", "inode_blocks",
+			     "free_blocks", "free_list", "free_inodes",
+			     "inode_cache" };
+
+/* superblock sanity checks, bit k set when check k+1 fails */
+int sanity_checks(uz_sblock *sb) {
+  int failed = 0;
 
   // 1
-  if (sb->s_mounted != UZ_SBSIG) {
+  if (sb->s_mounted != UZ_SBSIG) failed |= 1;
+  // 2
+  if (sb->s_reserv <= 1 || sb->s_reserv > sb->s_fsize) failed |= 2;
+  // 3
+  if (sb->s_isize >= sb->s_fsize) failed |= 4;
+  // 4
+  if (sb->s_tfree > sb->s_fsize) failed |= 8;
+  // 5
+  if (sb->s_nfree == 0 || sb->s_nfree > 50) failed |= 16;
+  // 6
+  if (sb->s_tinode > sb->s_isize * UZ_IPB) failed |= 32;
+  // 7
+  if (sb->s_ninode > sb->s_tinode) failed |= 64;
+
+  return failed;
+}
+
+int consistency_check(uz_sblock *sb) {
+  int failed, failures = 0;
+
+  failed = sanity_checks(sb);
+
+  if (failed & 1) {
     printf("!! super block inconsistency: bad signature (%d, expected %d)\n",
 	   sb->s_mounted, UZ_SBSIG);
     ++failures;
   }
-
-  // 2
-  if (sb->s_reserv <= 1 || sb->s_reserv > sb->s_fsize) {
+  if (failed & 2) {
     printf("!! pointer to inode block is nuts.\n");
     ++failures;
   }
-
-
-  // 3
-  if (sb->s_isize >= sb->s_fsize) {
+  if (failed & 4) {
     printf("!! there are more inode blocks than blocks in the disk.\n");
     ++failures;
   }
-
-  // 4
-  if (sb->s_tfree > sb->s_fsize) {
+  if (failed & 8) {
     printf("!! number of free blocks is impossible.\n");
     ++failures;
   }
-
-  // 5
-  if (sb->s_nfree == 0 || sb->s_nfree > 50) {
+  if (failed & 16) {
     printf("!! free block list is corrupt.\n");
     ++failures;
   }
-
-  // 6
-  if (sb->s_tinode > sb->s_isize * UZ_IPB) {
+  if (failed & 32) {
     printf("!! there are more free inodes than blocks to hold them.\n");
     ++failures;
   }
-
-  // 7
-  if (sb->s_ninode > sb->s_tinode) {
+  if (failed & 64) {
     printf("!! free inode cache list is corrupt.\n");
     ++failures;
   }
@@ -68,7 +85,7 @@ int consistency_check(uz_sblock *sb) {
   return failures;
 }
 
-void showinfo(uz_sblock *sb) {
+int showinfo(uz_sblock *sb) {
   int i;
   int u,n,b,kb,total;
   char dbuf[32];
@@ -76,8 +93,8 @@ void showinfo(uz_sblock *sb) {
 
   printf("1 block = 512 bytes\n");
 
-  if (consistency_check(sb) > 0)
-    return;
+  if ((i = consistency_check(sb)) > 0)
+    return i;
 
   if (sb->s_free[0] == 0) ic0 = 1;
 
@@ -162,6 +179,345 @@ void showinfo(uz_sblock *sb) {
 
   printf("-------------------+-------------------------------------------------\n");  
   printf("\n");
+  return 0;
+}
+
+/* size in human units, for histogram labels */
+char * hsize(int v, char *dest) {
+  if (v >= 1024*1024 && !(v % (1024*1024)))
+    sprintf(dest,"%dM",v / (1024*1024));
+  else if (v >= 1024 && !(v % 1024))
+    sprintf(dest,"%dK",v / 1024);
+  else
+    sprintf(dest,"%d",v);
+  return dest;
+}
+
+/* scans the block maps of all files for extents, file sizes and
+   free space runs */
+void showdeep(FILE *f, uz_sblock *sb) {
+  uz_inode *table;
+  uz_blkno_t *seq;
+  uz_bmentry *map;
+  int sizes[18], runs[17], runblocks[17];
+  int i, j, n, k, e, lo, hi, ninodes;
+  int files = 0, blocks = 0, extents = 0, fragmented = 0;
+  char a[16], b[16];
+
+  ninodes = sb->s_isize * UZ_IPB;
+  table = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  seq = (uz_blkno_t *) malloc((UZ_MAXBLOCKS + UZ_MAXINDEX) * sizeof(uz_blkno_t));
+  map = (uz_bmentry *) malloc(sb->s_fsize * sizeof(uz_bmentry));
+  if (!table || !seq || !map) {
+    printf("out of memory.\n");
+    goto out;
+  }
+
+  if (uz_read_itable(f,sb,table)!=0 || uz_block_map(f,sb,map)!=0) {
+    printf("error reading inode table.\n");
+    goto out;
+  }
+
+  memset(sizes,0,sizeof(sizes));
+  memset(runs,0,sizeof(runs));
+  memset(runblocks,0,sizeof(runblocks));
+
+  printf("fragmented files:\n");
+  printf("%7s %9s %9s %9s\n","inode","size","blocks","extents");
+
+  for(i=1;i<ninodes;i++) {
+    if (table[i].i_mode == 0 && table[i].i_nlink == 0) continue;
+    if ((table[i].i_mode & UZ_IFMT) == UZ_IFBLK ||
+	(table[i].i_mode & UZ_IFMT) == UZ_IFCHR) continue;
+
+    /* size class: 0, then powers of two from 512 bytes to 16 MB, then
+       all that is larger (files reach 65810 blocks, about 33.7 MB) */
+    if (table[i].i_size > 0) {
+      for(k=1;k<17 && table[i].i_size > (512 << (k-1));k++) ;
+      ++sizes[k];
+    } else
+      ++sizes[0];
+
+    n = uz_inode_layout(f,sb,&table[i],seq);
+    if (n <= 0) continue;
+
+    for(e=1,j=1;j<n;j++)
+      if (seq[j] != seq[j-1] + 1) ++e;
+
+    ++files;
+    blocks  += n;
+    extents += e;
+    if (e > 1) {
+      ++fragmented;
+      printf("%7d %9d %9d %9d\n",i,table[i].i_size,n,e);
+    }
+  }
+  if (!fragmented) printf("(none)\n");
+  printf("\n");
+
+  /* free space runs, in power of two classes */
+  lo = sb->s_reserv + sb->s_isize;
+  hi = sb->s_fsize;
+  for(i=lo;i<hi;i=j) {
+    if (map[i].b_kind != UZ_BM_FREE) { j = i+1; continue; }
+    for(j=i+1;j<hi && map[j].b_kind == UZ_BM_FREE;j++) ;
+    for(k=0;k<16 && (j-i) >= (2 << k);k++) ;
+    ++runs[k];
+    runblocks[k] += j-i;
+  }
+
+  printf("files with blocks         : %d\n",files);
+  printf("blocks in files           : %d (data and index)\n",blocks);
+  printf("extents                   : %d\n",extents);
+  printf("fragmented files          : %d\n",fragmented);
+  printf("average run length        : %.1f blocks\n",
+	 extents ? blocks / (float) extents : 0.0);
+  /* 0% when every file is one extent, 100% when no two blocks of
+     any file are adjacent */
+  printf("fragmentation score       : %.1f%%\n",
+	 blocks > files ? (100.0 * (extents - files)) / (blocks - files) : 0.0);
+  printf("\n");
+
+  printf("---------------------------+-----------\n");
+  printf("file size (bytes)          |     files\n");
+  printf("---------------------------+-----------\n");
+  printf("%26s |  %8d\n","0",sizes[0]);
+  for(k=1;k<18;k++) {
+    if (!sizes[k]) continue;
+    if (k == 1)
+      strcpy(a,"1");
+    else
+      hsize((512 << (k-2)) + 1, a);
+    if (k == 17)
+      b[0] = 0; /* open ended */
+    else
+      hsize(512 << (k-1), b);
+    printf("%15s - %-8s |  %8d\n",a,b,sizes[k]);
+  }
+  printf("---------------------------+-----------\n");
+  printf("\n");
+
+  printf("---------------------------+---------------------\n");
+  printf("free run (blocks)          |      runs    blocks\n");
+  printf("---------------------------+---------------------\n");
+  for(k=0;k<17;k++) {
+    if (!runs[k]) continue;
+    if (k == 0)
+      printf("%26s |  %8d  %8d\n","1",runs[k],runblocks[k]);
+    else
+      printf("%15d - %-8d |  %8d  %8d\n",1 << k,(2 << k) - 1,
+	     runs[k],runblocks[k]);
+  }
+  printf("---------------------------+---------------------\n");
+  printf("\n");
+
+ out:
+  free(table);
+  free(seq);
+  free(map);
+}
+
+char *bmkind[8] = { "free", "boot", "superblock", "reserved",
+		    "inodes", "data", "index", "leaked" };
+
+void showrun(int first, int last, uz_bmentry *e, int lastrank) {
+  char range[16], ranks[16];
+
+  if (first == last)
+    sprintf(range,"%d",first);
+  else
+    sprintf(range,"%d-%d",first,last);
+
+  ranks[0] = 0;
+  if (e->b_kind == UZ_BM_DATA) {
+    if (e->b_rank == lastrank)
+      sprintf(ranks,"%d",e->b_rank);
+    else
+      sprintf(ranks,"%d-%d",e->b_rank,lastrank);
+  }
+  if (e->b_kind == UZ_BM_INDEX) {
+    if (e->b_rank < 0)
+      strcpy(ranks,"dind");
+    else
+      sprintf(ranks,"%d+",e->b_rank);
+  }
+
+  if (e->b_kind == UZ_BM_DATA || e->b_kind == UZ_BM_INDEX)
+    printf("%11s  %-10s %6d  %s\n",range,bmkind[e->b_kind],e->b_ino,ranks);
+  else
+    printf("%11s  %s\n",range,bmkind[e->b_kind]);
+}
+
+/* prints the owner of the queried blocks, or the whole map as runs */
+void showmap(FILE *f, uz_sblock *sb, int *query, int nquery) {
+  uz_bmentry *map, *a, *b;
+  int i, j;
+
+  map = (uz_bmentry *) malloc(sb->s_fsize * sizeof(uz_bmentry));
+  if (!map || uz_block_map(f,sb,map)!=0) {
+    printf("error reading block map.\n");
+    free(map);
+    return;
+  }
+
+  printf("%11s  %-10s %6s  %s\n","blocks","kind","inode","ranks");
+
+  if (nquery) {
+    for(i=0;i<nquery;i++) {
+      if (query[i] < 0 || query[i] >= sb->s_fsize)
+	printf("%11d  beyond end of filesystem\n",query[i]);
+      else
+	showrun(query[i],query[i],&map[query[i]],map[query[i]].b_rank);
+    }
+  } else {
+    for(i=0;i<sb->s_fsize;i=j) {
+      a = &map[i];
+      for(j=i+1;j<sb->s_fsize;j++) {
+	b = &map[j];
+	if (b->b_kind != a->b_kind || b->b_ino != a->b_ino) break;
+	if (a->b_kind == UZ_BM_INDEX) break;
+	if (a->b_kind == UZ_BM_DATA && b->b_rank != a->b_rank + (j-i)) break;
+      }
+      showrun(i,j-1,a,map[j-1].b_rank);
+    }
+  }
+
+  printf("\n");
+  free(map);
+}
+
+/* -j mode: one JSON record per image, made by a pool of threads and
+   printed in input order as soon as every earlier one is done */
+typedef struct {
+  char  *name;
+  char  *rec;
+  size_t len;
+  int    state;          /* 0 unreadable, 1 inconsistent, 2 ok */
+  long   blocks, free_blocks, inodes, free_inodes;
+  int    done;
+} scan;
+
+scan          *scans;
+int            nscans, nthreads, next;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  ready = PTHREAD_COND_INITIALIZER;
+
+void json_str(FILE *out, char *s) {
+  char *q = (char *) malloc(6 * strlen(s) + 3);
+  if (!q) {
+    fputs("null",out);
+    return;
+  }
+  uz_json_quote(q,s);
+  fputs(q,out);
+  free(q);
+}
+
+void json_record(scan *j) {
+  uz_sblock sb;
+  FILE *f, *out;
+  struct tm tm;
+  time_t t;
+  int i, failed, data;
+
+  out = open_memstream(&j->rec,&j->len);
+  if (!out) return;
+
+  fprintf(out,"{\"image\":");
+  json_str(out,j->name);
+
+  f = fopen(j->name,"r");
+  if (!f || uz_read_sblock(f,&sb)!=0) {
+    fprintf(out,",\"error\":\"%s\"}\n",f ? "bad superblock" : "unable to open");
+    if (f) fclose(f);
+    fclose(out);
+    return;
+  }
+  fclose(f);
+
+  failed = sanity_checks(&sb);
+  j->state = failed ? 1 : 2;
+
+  t = uz_time_to_unix(&sb.s_time);
+  gmtime_r(&t,&tm);
+  fprintf(out,",\"superblock\":{\"signature\":%d,\"reserv\":%d,\"isize\":%d,"
+	  "\"fsize\":%d,\"nfree\":%d,\"tfree\":%d,\"ninode\":%d,\"tinode\":%d,"
+	  "\"time\":%ld,\"time_iso\":\"%04d-%02d-%02dT%02d:%02d:%02dZ\"}",
+	  sb.s_mounted,sb.s_reserv,sb.s_isize,sb.s_fsize,sb.s_nfree,sb.s_tfree,
+	  sb.s_ninode,sb.s_tinode,(long) t,tm.tm_year+1900,tm.tm_mon+1,
+	  tm.tm_mday,tm.tm_hour,tm.tm_min,tm.tm_sec);
+
+  fprintf(out,",\"checks\":{\"performed\":%d,\"failed\":[",NCHECKS);
+  for(i=0,data=0;i<NCHECKS;i++)
+    if (failed & (1 << i))
+      fprintf(out,"%s\"%s\"",data++ ? "," : "",checkname[i]);
+  fprintf(out,"]}");
+
+  if (!failed) {
+    data = sb.s_fsize - sb.s_reserv - sb.s_isize;
+    fprintf(out,",\"usage\":{\"blocks\":%d,\"boot_super\":2,\"reserved\":%d,"
+	    "\"inode_blocks\":%d,\"inodes\":%d,\"inodes_used\":%d,"
+	    "\"data_blocks\":%d,\"data_used\":%d,\"data_free\":%d}",
+	    sb.s_fsize,sb.s_reserv - 2,sb.s_isize,sb.s_isize * UZ_IPB,
+	    sb.s_isize * UZ_IPB - sb.s_tinode,data,data - sb.s_tfree,sb.s_tfree);
+    j->blocks      = sb.s_fsize;
+    j->free_blocks = sb.s_tfree;
+    j->inodes      = sb.s_isize * UZ_IPB;
+    j->free_inodes = sb.s_tinode;
+  }
+  fprintf(out,"}\n");
+  fclose(out);
+}
+
+void * worker(void *arg) {
+  int i;
+
+  for(;;) {
+    i = __atomic_fetch_add(&next,1,__ATOMIC_RELAXED);
+    if (i >= nscans) break;
+    json_record(&scans[i]);
+    pthread_mutex_lock(&lock);
+    scans[i].done = 1;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+  }
+  return 0;
+}
+
+int json_scan(void) {
+  pthread_t *t;
+  long count[3], blocks = 0, free_blocks = 0, inodes = 0, free_inodes = 0;
+  int i, started;
+
+  t = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  if (!t) return 2;
+  for(started=0;started<nthreads;started++)
+    if (pthread_create(&t[started],0,worker,0)!=0) break;
+  if (!started) worker(0);
+
+  memset(count,0,sizeof(count));
+  for(i=0;i<nscans;i++) {
+    pthread_mutex_lock(&lock);
+    while(!scans[i].done) pthread_cond_wait(&ready,&lock);
+    pthread_mutex_unlock(&lock);
+
+    if (scans[i].rec) fwrite(scans[i].rec,1,scans[i].len,stdout);
+    free(scans[i].rec);
+    ++count[scans[i].state];
+    blocks      += scans[i].blocks;
+    free_blocks += scans[i].free_blocks;
+    inodes      += scans[i].inodes;
+    free_inodes += scans[i].free_inodes;
+  }
+
+  while(--started >= 0) pthread_join(t[started],0);
+  free(t);
+
+  printf("{\"total\":{\"images\":%d,\"ok\":%ld,\"inconsistent\":%ld,"
+	 "\"unreadable\":%ld,\"blocks\":%ld,\"free_blocks\":%ld,"
+	 "\"inodes\":%ld,\"free_inodes\":%ld}}\n",
+	 nscans,count[2],count[1],count[0],blocks,free_blocks,inodes,free_inodes);
+  return fflush(stdout)!=0 ? 2 : 0;
 }
 
 int main(int argc, char **argv) {
@@ -169,14 +525,57 @@ int main(int argc, char **argv) {
   FILE *f;
   int nf = 0;
   int i;
+  int blockmap = 0, nquery = 0, deep = 0;
+  int *query;
 
   uz_sblock sb;
 
   uz_global_opt(argc, argv);
+  argc = uz_stats_opt(argc, argv);
+
+  query = (int *) malloc(argc * sizeof(int));
+  if (!query) return 2;
+
+  scans = (scan *) calloc(argc,sizeof(scan));
+  if (!scans) return 2;
 
   for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"--blockmap")) blockmap = 1;
+    if (!strcmp(argv[i],"--deep")) deep = 1;
+    if (!strcmp(argv[i],"--block") && i < argc-1) {
+      blockmap = 1;
+      query[nquery++] = atoi(argv[++i]);
+    }
+    if (!strcmp(argv[i],"-j") && i < argc-1) {
+      nthreads = atoi(argv[++i]);
+      if (nthreads < 1)  nthreads = 1;
+      if (nthreads > 64) nthreads = 64;
+    }
+  }
+
+  /* one simulated head can't follow the reads of several threads */
+  if (nthreads && uz_io_hook == uz_drive_access) {
+    fprintf(stderr,"uzixfsinfo: --drive can't be used with -j.\n\n");
+    return 1;
+  }
+  /* the records of -j only hold the summary */
+  if (nthreads && (deep || blockmap)) {
+    fprintf(stderr,"uzixfsinfo: --deep, --blockmap and --block can't be "
+	    "used with -j.\n\n");
+    return 1;
+  }
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"--block") || !strcmp(argv[i],"-j")) {
+      ++i;
+      continue;
+    }
     if (argv[i][0] == '-')
       continue;
+    if (nthreads) {
+      scans[nscans++].name = argv[i];
+      continue;
+    }
 
     f=fopen(argv[i],"r");
     if (!f) {
@@ -188,13 +587,22 @@ int main(int argc, char **argv) {
     } else {
       ++nf;
       printf("UZIX fs: %s\n",argv[i]);
-      showinfo(&sb);
+      if (!blockmap) {
+	if (showinfo(&sb) == 0 && deep)
+	  showdeep(f,&sb);
+      }
+      else if (consistency_check(&sb) == 0)
+	showmap(f,&sb,query,nquery);
     }
     fclose(f);
   }
 
+  if (nscans)
+    return(json_scan());
+
   if (!nf) {
-    fprintf(stderr,"usage: uzixfsinfo image.dsk [image2.dsk ...]\n\n");
+    fprintf(stderr,"usage: uzixfsinfo [--deep | --blockmap | --block n ...] image.dsk [image2.dsk ...]\n");
+    fprintf(stderr,"       uzixfsinfo -j threads image.dsk [image2.dsk ...]\n\n");
     return 1;
   }
 
@@ -10,6 +10,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "uzixfs.h"
 #include "uzixdir.h"
@@ -17,97 +18,259 @@
 FILE *f;
 uz_sblock sb;
 
+/* --format: records are put together in obuf by hand and written out
+   a buffer at a time, not an fprintf per field */
+#define FMT_LS     0
+#define FMT_NDJSON 1
+#define FMT_CSV    2
+
+int  format = FMT_LS;
+char obuf[65536];
+int  olen;
+
 int flagset(int val, int flag) {
   return( (val & flag) == flag );
 }
 
+/* the name of entry i, terminated */
+char * entname(uz_direntplus *ent, int i) {
+  static char name[UZ_DIRNAMELEN+1];
+  memcpy(name,ent[i].entry.d_name,UZ_DIRNAMELEN);
+  name[UZ_DIRNAMELEN] = 0;
+  return name;
+}
+
 void listdir(char *path, uz_dir *d) {
   char npath[512];
-  char perm[11], tstamp[32];
-  uz_direntry cdir;
-  uz_stat prop;
+  char perm[11], tstamp[32], *name;
+  uz_direntplus *ent;
+  uz_stat *prop;
   uz_dir  kid;
+  int i, n;
 
   printf("%s:\n",path);
 
   perm[10] = 0;
-  while(uz_readdir(d,&cdir)==0) {
-    if (!strcmp(cdir.d_name,".") || !strcmp(cdir.d_name,".."))
+  /* the entries and their inodes, the inode table read in order */
+  n = uz_readdirplus(d,&ent);
+  for(i=0;i<n;i++) {
+    name = entname(ent,i);
+    if (!strcmp(name,".") || !strcmp(name,".."))
       continue;
 
-    if (uz_istat(cdir.d_ino, f, &sb, &prop)!=0) {
-      printf("can't stat %s, skipping.\n",cdir.d_name);
+    prop = &(ent[i].st);
+    if (prop->st_ino == 0) {
+      printf("can't stat %s, skipping.\n",name);
       continue;
     }
 
     memset(perm,'-',10);
     
-    if (flagset(prop.st_mode,UZ_IFDIR))   perm[0] = 'd';
-    if (flagset(prop.st_mode,UZ_IFLNK))   perm[0] = 'l';
-    if (flagset(prop.st_mode,UZ_IFBLK))   perm[0] = 'b';
-    if (flagset(prop.st_mode,UZ_IFCHR))   perm[0] = 'c';
-    if (flagset(prop.st_mode,UZ_IFPIPE))  perm[0] = 'p';
-    if (flagset(prop.st_mode,UZ_ISVTX))   perm[0] = 't';
-
-    if (flagset(prop.st_mode,UZ_IREAD))   perm[1] = 'r';
-    if (flagset(prop.st_mode,UZ_IWRITE))  perm[2] = 'w';
-    if (flagset(prop.st_mode,UZ_IEXEC))   perm[3] = 'x';
-
-    if (flagset(prop.st_mode,UZ_IGREAD))  perm[4] = 'r';
-    if (flagset(prop.st_mode,UZ_IGWRITE)) perm[5] = 'w';
-    if (flagset(prop.st_mode,UZ_IGEXEC))  perm[6] = 'x';
-
-    if (flagset(prop.st_mode,UZ_IOREAD))  perm[7] = 'r';
-    if (flagset(prop.st_mode,UZ_IOWRITE)) perm[8] = 'w';
-    if (flagset(prop.st_mode,UZ_IOEXEC))  perm[9] = 'x';
+    if (flagset(prop->st_mode,UZ_IFDIR))   perm[0] = 'd';
+    if (flagset(prop->st_mode,UZ_IFLNK))   perm[0] = 'l';
+    if (flagset(prop->st_mode,UZ_IFBLK))   perm[0] = 'b';
+    if (flagset(prop->st_mode,UZ_IFCHR))   perm[0] = 'c';
+    if (flagset(prop->st_mode,UZ_IFPIPE))  perm[0] = 'p';
+    if (flagset(prop->st_mode,UZ_ISVTX))   perm[0] = 't';
+
+    if (flagset(prop->st_mode,UZ_IREAD))   perm[1] = 'r';
+    if (flagset(prop->st_mode,UZ_IWRITE))  perm[2] = 'w';
+    if (flagset(prop->st_mode,UZ_IEXEC))   perm[3] = 'x';
+
+    if (flagset(prop->st_mode,UZ_IGREAD))  perm[4] = 'r';
+    if (flagset(prop->st_mode,UZ_IGWRITE)) perm[5] = 'w';
+    if (flagset(prop->st_mode,UZ_IGEXEC))  perm[6] = 'x';
+
+    if (flagset(prop->st_mode,UZ_IOREAD))  perm[7] = 'r';
+    if (flagset(prop->st_mode,UZ_IOWRITE)) perm[8] = 'w';
+    if (flagset(prop->st_mode,UZ_IOEXEC))  perm[9] = 'x';
     
-    if (flagset(prop.st_mode,UZ_ISUID))  perm[3] = 's';
-    if (flagset(prop.st_mode,UZ_ISGID))  perm[6] = 's';
+    if (flagset(prop->st_mode,UZ_ISUID))  perm[3] = 's';
+    if (flagset(prop->st_mode,UZ_ISGID))  perm[6] = 's';
     
     printf("%s %3d %3d:%-3d %8d %19s %s\n",
-	   perm, prop.st_nlink, prop.st_uid, prop.st_gid,
-	   prop.st_size, uz_date_for_humans(&(prop.st_mtime),tstamp),
-	   cdir.d_name);
+	   perm, prop->st_nlink, prop->st_uid, prop->st_gid,
+	   prop->st_size, uz_date_for_humans(&(prop->st_mtime),tstamp),
+	   name);
   }
   printf("\n");
 
-  uz_rewinddir(d);
-  while(uz_readdir(d,&cdir)==0) {
-    if (!strcmp(cdir.d_name,".") || !strcmp(cdir.d_name,".."))
+  for(i=0;i<n;i++) {
+    name = entname(ent,i);
+    if (!strcmp(name,".") || !strcmp(name,".."))
       continue;
-    if (uz_istat(cdir.d_ino, f, &sb, &prop)==0)
-      if (flagset(prop.st_mode,UZ_IFDIR)) {
+    prop = &(ent[i].st);
+    if (prop->st_ino != 0)
+      if (flagset(prop->st_mode,UZ_IFDIR)) {
 	if (!strcmp(path,"/"))
-	  sprintf(npath,"/%s",cdir.d_name);
+	  sprintf(npath,"/%s",name);
 	else
-	  sprintf(npath,"%s/%s",path,cdir.d_name);
-	if (uz_opendir(npath,f,&sb,&kid)==0) {
+	  sprintf(npath,"%s/%s",path,name);
+	if (uz_iopendir(prop->st_ino,f,&sb,&kid)==0) {
 	  listdir(npath, &kid);
 	  uz_closedir(&kid);
 	}
       }
   }
+  if (n > 0) free(ent);
+}
+
+void out_flush(void) {
+  fwrite(obuf,1,olen,stdout);
+  olen = 0;
+}
+
+/* room for n more bytes */
+void out_room(int n) {
+  if (olen + n > sizeof(obuf)) out_flush();
+}
+
+void out_str(char *x) {
+  int n = strlen(x);
+  out_room(n);
+  memcpy(obuf+olen,x,n);
+  olen += n;
+}
+
+void out_num(unsigned long v) {
+  char d[24];
+  int n = 0;
+
+  do { d[n++] = '0' + v % 10; v /= 10; } while(v);
+  out_room(n);
+  while(n) obuf[olen++] = d[--n];
+}
 
+void out_2(int v) {
+  obuf[olen++] = '0' + (v / 10) % 10;
+  obuf[olen++] = '0' + v % 10;
+}
+
+/* quoted and escaped for the format in use */
+void out_quoted(char *x) {
+  out_room(6 * strlen(x) + 3);
+  if (format == FMT_NDJSON) {
+    olen += uz_json_quote(obuf+olen,x);
+    return;
+  }
+  obuf[olen++] = '"';
+  for(;*x;x++) {
+    if (*x == '"') obuf[olen++] = '"';
+    obuf[olen++] = *x;
+  }
+  obuf[olen++] = '"';
+}
+
+/* seconds since 1970, then yyyy-mm-ddThh:mm:ssZ */
+void out_time(uz_time_t *t, char *sep) {
+  out_num(uz_time_to_unix(t));
+  out_str(sep);
+  out_room(22);
+  if (format == FMT_NDJSON) obuf[olen++] = '"';
+  out_2((1980 + ((t->t_date >> 9) & 0x7f)) / 100);
+  out_2(1980 + ((t->t_date >> 9) & 0x7f));
+  obuf[olen++] = '-';
+  out_2((t->t_date >> 5) & 0x0f);
+  obuf[olen++] = '-';
+  out_2(t->t_date & 0x1f);
+  obuf[olen++] = 'T';
+  out_2((t->t_time >> 11) & 0x1f);
+  obuf[olen++] = ':';
+  out_2((t->t_time >> 5) & 0x3f);
+  obuf[olen++] = ':';
+  out_2((t->t_time << 1) & 0x3f);
+  obuf[olen++] = 'Z';
+  if (format == FMT_NDJSON) obuf[olen++] = '"';
+}
+
+void out_record(char *path, uz_stat *p) {
+  if (format == FMT_NDJSON) {
+    out_str("{\"ino\":");      out_num(p->st_ino);
+    out_str(",\"mode\":");     out_num(p->st_mode);
+    out_str(",\"nlink\":");    out_num(p->st_nlink);
+    out_str(",\"uid\":");      out_num(p->st_uid);
+    out_str(",\"gid\":");      out_num(p->st_gid);
+    out_str(",\"size\":");     out_num(p->st_size);
+    out_str(",\"atime\":");    out_time(&p->st_atime,",\"atime_iso\":");
+    out_str(",\"mtime\":");    out_time(&p->st_mtime,",\"mtime_iso\":");
+    out_str(",\"ctime\":");    out_time(&p->st_ctime,",\"ctime_iso\":");
+    out_str(",\"path\":");     out_quoted(path);
+    out_str("}\n");
+  } else {
+    out_num(p->st_ino);    out_str(",");
+    out_num(p->st_mode);   out_str(",");
+    out_num(p->st_nlink);  out_str(",");
+    out_num(p->st_uid);    out_str(",");
+    out_num(p->st_gid);    out_str(",");
+    out_num(p->st_size);   out_str(",");
+    out_time(&p->st_atime,",");  out_str(",");
+    out_time(&p->st_mtime,",");  out_str(",");
+    out_time(&p->st_ctime,",");  out_str(",");
+    out_quoted(path);
+    out_str("\n");
+  }
+}
+
+/* one record per entry, depth first, each inode block read once
+   per directory */
+void listrec(char *path, uz_dir *d) {
+  char npath[512], name[UZ_DIRNAMELEN+1];
+  uz_direntplus *ent;
+  uz_dir  kid;
+  int i, n;
+
+  n = uz_readdirplus(d,&ent);
+  for(i=0;i<n;i++) {
+    strcpy(name,entname(ent,i));
+    if (!strcmp(name,".") || !strcmp(name,".."))
+      continue;
+    if (strlen(path) + strlen(name) + 2 > sizeof(npath)) {
+      fprintf(stderr,"%s/%s: path too long, skipping.\n",path,name);
+      continue;
+    }
+    strcpy(npath,path);
+    if (strcmp(path,"/")) strcat(npath,"/");
+    strcat(npath,name);
+    if (ent[i].st.st_ino == 0) {
+      fprintf(stderr,"can't stat %s, skipping.\n",npath);
+      continue;
+    }
+    out_record(npath,&(ent[i].st));
+    if (flagset(ent[i].st.st_mode,UZ_IFDIR) &&
+	uz_iopendir(ent[i].st.st_ino,f,&sb,&kid)==0) {
+      listrec(npath,&kid);
+      uz_closedir(&kid);
+    }
+  }
+  if (n > 0) free(ent);
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsls [--format=ndjson|csv] image.dsk [directory]\n\n");
+  exit(1);
 }
 
 int main(int argc, char **argv) {
   uz_dir d;
-  char ipath[512];
+  char ipath[512], *image = 0, *dir = 0;
+  int i;
 
   uz_global_opt(argc, argv);
-
-  if (argc!=2 && argc!=3) {
-    fprintf(stderr,"usage: uzixfsls image.dsk [directory]\n\n");
-    return 1;
-  }
+  argc = uz_stats_opt(argc, argv);
 
   strcpy(ipath,"/");
-  if (argc == 3)
-    strcpy(ipath, argv[2]);
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"--format=ndjson")) { format = FMT_NDJSON; continue; }
+    if (!strcmp(argv[i],"--format=csv"))    { format = FMT_CSV; continue; }
+    if (argv[i][0] == '-' || dir) usage();
+    if (!image) image = argv[i]; else dir = argv[i];
+  }
+  if (!image || (dir && strlen(dir) >= sizeof(ipath))) usage();
+  if (dir) strcpy(ipath,dir);
 
-  f = fopen(argv[1],"r");
+  f = fopen(image,"r");
   if (!f) {
-    fprintf(stderr,"cannot open %s\n\n",argv[1]);
+    fprintf(stderr,"cannot open %s\n\n",image);
     return 2;
   }
 
@@ -117,7 +280,18 @@ int main(int argc, char **argv) {
   if (uz_opendir(ipath, f, &sb, &d) != 0)
     goto err1;
 
-  listdir(ipath,&d);
+  if (format == FMT_LS)
+    listdir(ipath,&d);
+  else {
+    if (format == FMT_CSV)
+      out_str("ino,mode,nlink,uid,gid,size,atime,atime_iso,mtime,mtime_iso,"
+	      "ctime,ctime_iso,path\n");
+    while(strlen(ipath) > 1 && ipath[strlen(ipath)-1] == '/')
+      ipath[strlen(ipath)-1] = 0;
+    listrec(ipath,&d);
+    out_flush();
+    if (fflush(stdout)!=0) return 2;
+  }
 
   uz_closedir(&d);
   fclose(f);
@@ -0,0 +1,232 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+/* runs a call trace recorded with --trace against an image and
+   reports how fast the library went through it, as JSON */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+
+FILE      *f, *t;
+uz_sblock  sb;
+int        readonly, txn;
+
+char *opname[UZ_TR_OPS] = {
+  "", "lookup", "readdir", "istat", "read_data", "write_data", "grow",
+  "truncate", "implode", "remove", "mknod", "mkdir", "unlink", "rmdir",
+  "link", "rename", "readdirplus" };
+
+long  count[UZ_TR_OPS], failed[UZ_TR_OPS], skipped[UZ_TR_OPS];
+long  bread, bwritten;
+double spent[UZ_TR_OPS];
+
+uint8_t *buf;
+uint32_t bufsize;
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsreplay [-n] [-t] image.dsk trace\n\n");
+  exit(1);
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int changes_image(int op) {
+  return op == UZ_TR_WRITE || (op >= UZ_TR_GROW && op <= UZ_TR_RENAME);
+}
+
+/* the inode of a read, write or readdir. when the program had just
+   read it and the trace knows its number, it is read again from this
+   image, so that what is measured is the layout of this image and
+   not that of the one traced */
+uz_inode *inode_of(uz_trace_rec *r) {
+  static uz_inode cur;
+  static int known = 0;
+
+  if (r->fresh)
+    known = r->ino != 0 && uz_read_inode(f,&sb,r->ino,&cur) == 0;
+  return known ? &cur : &(r->inode);
+}
+
+/* one call, as it was made. returns what the library returned */
+int replay(uz_trace_rec *r) {
+  uz_dir d;
+  uz_direntry e;
+  uz_direntplus *ents;
+  uz_stat st;
+  uz_inode *x;
+  int n;
+
+  if ((r->op == UZ_TR_READ || r->op == UZ_TR_WRITE) && r->b > bufsize) {
+    bufsize = r->b;
+    buf = (uint8_t *) realloc(buf,bufsize);
+    if (!buf) {
+      fprintf(stderr,"uzixfsreplay: out of memory\n");
+      exit(2);
+    }
+    memset(buf,0,bufsize);
+  }
+
+  switch(r->op) {
+  case UZ_TR_LOOKUP:
+    return(uz_lookup(r->path,f,&sb));
+  case UZ_TR_READDIR:
+  case UZ_TR_READDIRPLUS:
+    d.inode = *inode_of(r);
+    d.count = d.inode.i_size / UZ_DIRELEN;
+    d.next  = r->a;
+    d.sb    = &sb;
+    d.dsk   = f;
+    if (r->op == UZ_TR_READDIR)
+      return(uz_readdir(&d,&e));
+    n = uz_readdirplus(&d,&ents);
+    if (n >= 0) free(ents);
+    return n;
+  case UZ_TR_ISTAT:
+    return(uz_istat(r->a,f,&sb,&st));
+  case UZ_TR_READ:
+    x = inode_of(r);
+    n = uz_read_data(f,x,r->a,r->b,buf);
+    if (n > 0) bread += n;
+    return n;
+  case UZ_TR_WRITE:
+    x = inode_of(r);
+    n = uz_write_data(f,x,r->a,r->b,buf);
+    if (n > 0) bwritten += n;
+    return n;
+  case UZ_TR_GROW:
+    return(uz_inode_grow(f,&sb,r->a,r->b));
+  case UZ_TR_TRUNCATE:
+    return(uz_inode_truncate(f,&sb,r->a,r->b));
+  case UZ_TR_IMPLODE:
+    return(uz_inode_implode(f,&sb,r->a));
+  case UZ_TR_REMOVE:
+    return(uz_inode_remove(f,&sb,r->a));
+  case UZ_TR_MKNOD:
+    return(uz_mknod(r->path,f,&sb,r->b));
+  case UZ_TR_MKDIR:
+    return(uz_mkdir(r->path,f,&sb,r->b));
+  case UZ_TR_UNLINK:
+    return(uz_unlink(r->path,f,&sb));
+  case UZ_TR_RMDIR:
+    return(uz_rmdir(r->path,f,&sb));
+  case UZ_TR_LINK:
+    return(uz_link(r->path,r->path2,f,&sb));
+  case UZ_TR_RENAME:
+    return(uz_rename(r->path,r->path2,f,&sb));
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  static uz_trace_rec r;
+  char *image = 0, *trace = 0;
+  double t0, total = 0, commit = 0;
+  long calls = 0, first;
+  int i, k, err;
+
+  uz_global_opt(argc, argv);
+  argc = uz_stats_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-n")) { readonly = 1; continue; }
+    if (!strcmp(argv[i],"-t")) { txn = 1; continue; }
+    if (argv[i][0] == '-') usage();
+    if (!image) image = argv[i];
+    else if (!trace) trace = argv[i];
+    else usage();
+  }
+  if (!trace || (readonly && txn)) usage();
+
+  f = fopen(image,readonly ? "r" : "r+");
+  if (!f) {
+    fprintf(stderr,"cannot open %s\n\n",image);
+    return 2;
+  }
+  t = fopen(trace,"r");
+  if (!t) {
+    fprintf(stderr,"cannot open %s\n\n",trace);
+    return 2;
+  }
+  if (uz_trace_head(t,&r)!=0) {
+    fprintf(stderr,"%s is not a call trace\n\n",trace);
+    return 2;
+  }
+  if (uz_read_sblock(f,&sb)!=0 || (txn && uz_begin(f,&sb)!=0)) {
+    fprintf(stderr,"error reading image\n\n");
+    return 3;
+  }
+
+  first = -1;
+  while((err = uz_trace_read(t,&r)) == 0) {
+    if (first < 0) first = r.usec;
+    ++calls;
+    ++count[r.op];
+    if (readonly && changes_image(r.op)) {
+      ++skipped[r.op];
+      continue;
+    }
+    t0 = now();
+    k = replay(&r);
+    spent[r.op] += now() - t0;
+    if (k < 0) ++failed[r.op];
+  }
+  if (err < 0)
+    fprintf(stderr,"%s: damaged after %ld calls, replay stopped there\n",
+	    trace,calls);
+
+  if (txn) {
+    t0 = now();
+    if (uz_commit(f,0)!=0) {
+      fprintf(stderr,"error writing image\n\n");
+      return 3;
+    }
+    commit = now() - t0;
+  }
+  if (fclose(f)!=0) {
+    fprintf(stderr,"error writing image\n\n");
+    return 3;
+  }
+  fclose(t);
+
+  for(i=1;i<UZ_TR_OPS;i++) total += spent[i];
+  total += commit;
+
+  printf("{\n  \"trace\": {\"calls\": %ld, \"seconds\": %.4f},\n",calls,
+	 calls ? (r.usec - first) / 1e6 : 0.0);
+  printf("  \"replay\": {\"seconds\": %.4f, \"commit_seconds\": %.4f, "
+	 "\"calls_per_sec\": %.1f,\n"
+	 "             \"bytes_read\": %ld, \"bytes_written\": %ld, "
+	 "\"bytes_per_sec\": %.1f},\n",
+	 total,commit,total > 0 ? calls / total : 0.0,bread,bwritten,
+	 total > 0 ? (bread + bwritten) / total : 0.0);
+  if (uz_io_hook == uz_drive_access)
+    printf("  \"drive\": {\"seconds\": %.4f, \"accesses\": %lu, \"seeks\": %lu, "
+	   "\"cylinders\": %lu,\n            \"calls_per_sec\": %.1f},\n",
+	   uz_drive_stats.ms / 1000,uz_drive_stats.accesses,uz_drive_stats.seeks,
+	   uz_drive_stats.cylinders,
+	   uz_drive_stats.ms > 0 ? calls / (uz_drive_stats.ms / 1000) : 0.0);
+  printf("  \"calls\": {");
+  for(i=1,k=0;i<UZ_TR_OPS;i++) {
+    if (!count[i]) continue;
+    printf("%s\n    \"%s\": {\"count\": %ld, \"failed\": %ld, \"skipped\": %ld, "
+	   "\"seconds\": %.4f}",k++ ? "," : "",opname[i],count[i],failed[i],
+	   skipped[i],spent[i]);
+  }
+  printf("\n  }\n}\n");
+  return err < 0 ? 4 : 0;
+}
@@ -0,0 +1,227 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+
+uz_sblock  sb;
+uint8_t    inuse[65536];
+
+/* marks the blocks of every inode in inuse. -1 on bad or shared
+   blocks, which a relocation would only make worse */
+int claim_blocks(FILE *f) {
+  uz_inode *table;
+  uz_blkno_t *map, idx[UZ_MAXINDEX];
+  int i, j, n, ni, b, lo, ninodes, ret = -1;
+
+  lo = sb.s_reserv + sb.s_isize;
+  ninodes = sb.s_isize * UZ_IPB;
+  table = (uz_inode *) malloc(ninodes * sizeof(uz_inode));
+  map   = (uz_blkno_t *) malloc(UZ_MAXBLOCKS * sizeof(uz_blkno_t));
+  if (!table || !map || uz_read_itable(f,&sb,table)!=0) goto out;
+
+  memset(inuse,0,sizeof(inuse));
+  for(i=1;i<ninodes;i++) {
+    if (table[i].i_mode == 0 && table[i].i_nlink == 0) continue;
+    if ((table[i].i_mode & UZ_IFMT) == UZ_IFBLK ||
+	(table[i].i_mode & UZ_IFMT) == UZ_IFCHR) continue;
+    n = uz_inode_map(f,&sb,&table[i],map,idx,&ni);
+    if (n < 0) goto out;
+    for(j=0;j<n+ni;j++) {
+      b = j < n ? map[j] : idx[j-n];
+      if (b == 0) continue; /* hole */
+      if (b < lo || b >= sb.s_fsize || inuse[b]) goto out;
+      inuse[b] = 1;
+    }
+  }
+  ret = 0;
+
+ out:
+  free(table);
+  free(map);
+  return ret;
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfsresize [-n] [-u undolog] [-f size] [-i size] image.dsk\n");
+  fprintf(stderr,"sizes as in mkuzixfs. the inode table can only grow.\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  FILE *dsk, *mem;
+  char *image = 0, *undolog = 0;
+  uint8_t *buf, *orig, zero[UZ_BLOCKSZ];
+  uz_blkno_t *newpos;
+  int i, b, d, dryrun = 0, fsize = -1, isize = -1;
+  int of, oi, nf, ni, lo, nlo, hi, need = 0, avail = 0, written = 0;
+  long osize, size;
+
+  uz_global_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-n")) { dryrun = 1; continue; }
+    if (argv[i][0] == '-' && i == argc-1) usage();
+    if (!strcmp(argv[i],"-u")) { undolog = argv[++i]; continue; }
+    if (!strcmp(argv[i],"-f")) { if ((fsize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (!strcmp(argv[i],"-i")) { if ((isize = uz_parse_size(argv[++i])) < 0) usage(); continue; }
+    if (argv[i][0] == '-' || image) usage();
+    image = argv[i];
+  }
+
+  if (!image || (fsize < 0 && isize < 0)) usage();
+  if (undolog && !dryrun && uz_recover(image,undolog)!=0) return 2;
+
+  dsk = fopen(image,dryrun ? "r" : "r+");
+  if (!dsk) {
+    fprintf(stderr,"unable to open %s.\n",image);
+    return 2;
+  }
+
+  if (uz_read_sblock(dsk,&sb)!=0 || sb.s_mounted != UZ_SBSIG ||
+      sb.s_reserv <= UZ_SBLOCK ||
+      sb.s_reserv + sb.s_isize >= sb.s_fsize) {
+    fprintf(stderr,"%s: bad superblock.\n",image);
+    return 2;
+  }
+
+  of = sb.s_fsize;
+  oi = sb.s_isize;
+  nf = fsize < 0 ? of : fsize / UZ_BLOCKSZ;
+  ni = isize < 0 ? oi : isize / UZ_BLOCKSZ;
+  lo  = sb.s_reserv + oi;
+  nlo = sb.s_reserv + ni;
+  if (nf > 65535 || ni < oi || ni * UZ_IPB > 65536 || nlo >= nf) {
+    fprintf(stderr,"** illegal f/i size specification.\n\n");
+    return 2;
+  }
+
+  /* the whole image is worked on in memory, at its larger size */
+  osize = (long) of * UZ_BLOCKSZ;
+  size  = (long) (nf > of ? nf : of) * UZ_BLOCKSZ;
+  buf   = (uint8_t *) calloc(size,1);
+  orig  = (uint8_t *) malloc(osize);
+  newpos = (uz_blkno_t *) calloc(65536,sizeof(uz_blkno_t));
+  if (!buf || !orig || !newpos) {
+    fprintf(stderr,"uzixfsresize: out of memory\n");
+    return 2;
+  }
+
+  if (fseek(dsk,0,SEEK_SET)!=0 || fread(buf,1,osize,dsk)!=osize) {
+    fprintf(stderr,"%s: error reading image.\n",image);
+    return 2;
+  }
+  memcpy(orig,buf,osize);
+
+  mem = fmemopen(buf,size,"r+");
+  if (!mem || uz_read_sblock(mem,&sb)!=0) {
+    fprintf(stderr,"%s: error reading image.\n",image);
+    return 2;
+  }
+
+  if (claim_blocks(mem)!=0) {
+    fprintf(stderr,"%s: bad or shared blocks, run uzixfsck first.\n",image);
+    return 2;
+  }
+
+  /* the blocks where the inode table will grow and those past the new
+     end are moved to the lowest free blocks that stay in the data area */
+  if (nf > of) sb.s_fsize = nf;
+  hi = nf < of ? nf : sb.s_fsize;
+  d = nlo;
+  for(b=lo;b<of;b++) {
+    if (!inuse[b] || (b >= nlo && b < nf)) continue;
+    ++need;
+    while(d < hi && inuse[d]) d++;
+    if (d >= hi) continue;
+    newpos[b] = d++;
+    ++avail;
+  }
+
+  printf("UZIX fs: %s\n",image);
+  printf("filesystem blocks         : %d -> %d\n",of,nf);
+  printf("inode table blocks        : %d -> %d\n",oi,ni);
+  printf("blocks to move            : %d\n",need);
+
+  if (avail < need) {
+    fprintf(stderr,"%s: not enough free blocks, %d missing.\n",image,need-avail);
+    return 4;
+  }
+
+  if (dryrun || (nf == of && ni == oi)) {
+    fclose(mem);
+    fclose(dsk);
+    return 0;
+  }
+
+  if (need && uz_relocate(mem,&sb,newpos)!=0) {
+    fprintf(stderr,"%s: relocation failed, image left untouched.\n",image);
+    return 2;
+  }
+
+  /* now that they are clear, take the new inode table blocks and drop
+     the blocks past the new end */
+  memset(zero,0,sizeof(zero));
+  for(b=lo;b<nlo;b++)
+    if (uz_write_raw_block(mem,b,zero)!=0) goto relocfail;
+  sb.s_tinode += (ni - oi) * UZ_IPB;
+  sb.s_isize = ni;
+  sb.s_fsize = nf;
+  if (claim_blocks(mem)!=0 || uz_rebuild_freelist(mem,&sb,inuse)!=0 ||
+      fflush(mem)!=0)
+    goto relocfail;
+
+  /* a grown image is extended first, so nothing points past its end */
+  if (nf > of && (fflush(dsk)!=0 || ftruncate(fileno(dsk),(long) nf * UZ_BLOCKSZ)!=0)) {
+    fprintf(stderr,"%s: unable to extend image.\n",image);
+    return 2;
+  }
+
+  /* write back only the blocks that changed, in one ascending pass */
+  if (uz_begin(dsk,&sb)!=0) {
+    fprintf(stderr,"uzixfsresize: out of memory\n");
+    return 2;
+  }
+  for(b=0;b<nf;b++) {
+    if (!memcmp(buf + (long) b * UZ_BLOCKSZ,b < of ? orig + (long) b * UZ_BLOCKSZ : zero,
+		UZ_BLOCKSZ))
+      continue;
+    if (uz_write_raw_block(dsk,b,buf + (long) b * UZ_BLOCKSZ)!=0) {
+      fprintf(stderr,"uzixfsresize: out of memory\n");
+      return 2;
+    }
+    ++written;
+  }
+  if (uz_commit(dsk,undolog)!=0) {
+    fprintf(stderr,"%s: error writing image.\n",image);
+    return 2;
+  }
+
+  if (nf < of && (fflush(dsk)!=0 || ftruncate(fileno(dsk),(long) nf * UZ_BLOCKSZ)!=0)) {
+    fprintf(stderr,"%s: unable to truncate image (the filesystem is fine).\n",image);
+    return 2;
+  }
+
+  printf("blocks written            : %d\n",written);
+  printf("free blocks               : %d\n",sb.s_tfree);
+  printf("free inodes               : %d\n",sb.s_tinode);
+
+  fclose(mem);
+  fclose(dsk);
+  return 0;
+
+ relocfail:
+  fprintf(stderr,"%s: relocation failed, image left untouched.\n",image);
+  return 2;
+}
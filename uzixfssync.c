@@ -0,0 +1,384 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+#include "byteorder.h"
+/* after uzixdir.h: uz_stat has fields named like the st_atime, ...
+   macros of sys/stat.h */
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define RUN 128 /* blocks read from a host file at once */
+
+FILE      *f;
+uz_sblock  sb;
+int        dryrun, verbose;
+int        nadded, nupdated, nremoved, nsame, nerrors;
+
+uz_blkno_t map[UZ_MAXBLOCKS];
+uint8_t    buf[RUN * UZ_BLOCKSZ];
+
+void report(char c, char *path) {
+  if (verbose || dryrun) printf("%c %s\n",c,path);
+}
+
+void problem(char *path, char *what) {
+  fprintf(stderr,"%s: %s\n",path,what);
+  ++nerrors;
+}
+
+void nospace(char *path) {
+  fprintf(stderr,"%s: out of %s, image left untouched.\n",
+	  path,sb.s_tinode ? "space" : "inodes");
+  exit(4);
+}
+
+/* joins a directory and a name, -1 if it doesn't fit */
+int join(char *dest, int size, char *dir, char *name) {
+  if (strlen(dir) + strlen(name) + 2 > size) return -1;
+  strcpy(dest,dir);
+  if (strcmp(dir,"/")) strcat(dest,"/");
+  strcat(dest,name);
+  return 0;
+}
+
+/* removes an image entry, a whole subtree for a directory */
+int remove_entry(char *ipath) {
+  uz_dir d;
+  uz_direntry ent;
+  uz_stat st;
+  char name[UZ_DIRNAMELEN+1], kid[512];
+  int found;
+
+  if (uz_fstat(ipath,f,&sb,&st)!=0) return -1;
+  if ((st.st_mode & UZ_IFMT) != UZ_IFDIR)
+    return(uz_unlink(ipath,f,&sb));
+
+  /* one entry at a time: the directory shrinks as they go */
+  for(;;) {
+    if (uz_opendir(ipath,f,&sb,&d)!=0) return -1;
+    found = 0;
+    while(!found && uz_readdir(&d,&ent)==0) {
+      memset(name,0,sizeof(name));
+      memcpy(name,ent.d_name,UZ_DIRNAMELEN);
+      found = strcmp(name,".") && strcmp(name,"..");
+    }
+    uz_closedir(&d);
+    if (!found) break;
+    if (join(kid,sizeof(kid),ipath,name)!=0 || remove_entry(kid)!=0)
+      return -1;
+  }
+  return(uz_rmdir(ipath,f,&sb));
+}
+
+/* (re)writes the data of an image file from a host file, keeping the
+   blocks it has: only the difference in size is allocated or freed */
+int write_data(char *hpath, char *ipath, int ino, long size) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  uz_inode x;
+  int fd, r, k, n, ni, i;
+  long got;
+
+  if (uz_read_inode(f,&sb,ino,&x)!=0) return -1;
+  if (size < x.i_size) {
+    if (uz_inode_truncate(f,&sb,ino,size)!=0) return -1;
+  } else if (size > x.i_size)
+    if (uz_inode_grow(f,&sb,ino,size)!=0) nospace(ipath);
+  if (size == 0) return 0;
+
+  if (uz_read_inode(f,&sb,ino,&x)!=0) return -1;
+  n = uz_inode_map(f,&sb,&x,map,idx,&ni);
+  if (n != uz_fit_bytes(size)) return -1;
+
+  fd = open(hpath,O_RDONLY);
+  if (fd < 0) return -1;
+  for(r=0;r<n;r+=k) {
+    k = n - r < RUN ? n - r : RUN;
+    memset(buf,0,k * UZ_BLOCKSZ);
+    got = read(fd,buf,k * UZ_BLOCKSZ);
+    if (got < 0) { close(fd); return -1; }
+    for(i=0;i<k;i++) {
+      if (map[r+i] == 0) continue;
+      if (uz_write_raw_block(f,map[r+i],buf + i * UZ_BLOCKSZ)!=0) {
+	fprintf(stderr,"uzixfssync: out of memory\n");
+	exit(2);
+      }
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+/* makes the attributes of an image inode those of a host file,
+   writing the inode only if they differ */
+void set_attrs(int ino, struct stat *st) {
+  uz_inode x, y;
+
+  if (uz_read_inode(f,&sb,ino,&x)!=0) return;
+  y = x;
+  x.i_mode = (x.i_mode & UZ_IFMT) | (st->st_mode & 07777);
+  x.i_uid  = st->st_uid;
+  x.i_gid  = st->st_gid;
+  uz_unix_to_time((long) st->st_mtime,&x.i_mtime);
+  if (memcmp(&x,&y,sizeof(uz_inode)))
+    uz_write_inode(f,&sb,ino,&x);
+}
+
+/* same size and mtime means the same contents, as for make and rsync */
+int same_file(uz_inode *x, struct stat *st) {
+  uz_time_t t;
+
+  uz_unix_to_time((long) st->st_mtime,&t);
+  return(x->i_size == st->st_size && x->i_mtime.t_time == t.t_time &&
+	 x->i_mtime.t_date == t.t_date);
+}
+
+int same_attrs(uz_inode *x, struct stat *st) {
+  return((x->i_mode & 07777) == (st->st_mode & 07777) &&
+	 x->i_uid == (st->st_uid & 0xff) && x->i_gid == (st->st_gid & 0xff));
+}
+
+void sync_dir(char *hpath, char *ipath, int dino);
+
+void sync_entry(char *hpath, char *ipath, struct stat *st) {
+  char target[UZ_BLOCKSZ+1], old[UZ_BLOCKSZ+1];
+  uz_inode x;
+  int ino, fmt, want, len;
+
+  if (S_ISDIR(st->st_mode))       want = UZ_IFDIR;
+  else if (S_ISREG(st->st_mode))  want = UZ_IFREG;
+  else if (S_ISLNK(st->st_mode))  want = UZ_IFLNK;
+  else if (S_ISFIFO(st->st_mode)) want = UZ_IFPIPE;
+  else {
+    problem(hpath,"device or socket, skipped.");
+    return;
+  }
+
+  ino = uz_lookup(ipath,f,&sb);
+  if (ino >= 0 && uz_read_inode(f,&sb,ino,&x)!=0) {
+    problem(ipath,"can't read inode, skipped.");
+    return;
+  }
+  fmt = ino >= 0 ? (x.i_mode & UZ_IFMT) : 0;
+  if (fmt == 0 && ino >= 0) fmt = UZ_IFREG;
+
+  /* a symbolic link whose target changed is made again */
+  if (fmt == UZ_IFLNK && want == UZ_IFLNK) {
+    len = readlink(hpath,target,UZ_BLOCKSZ);
+    memset(old,0,sizeof(old));
+    if (len < 0 || x.i_size != len || uz_read_data(f,&x,0,len,old)!=len ||
+	memcmp(old,target,len))
+      fmt = -1;
+  }
+
+  if (ino >= 0 && fmt != want) {
+    if (remove_entry(ipath)!=0) {
+      problem(ipath,"can't replace, skipped.");
+      return;
+    }
+    report('-',ipath);
+    ++nremoved;
+    ino = -1;
+  }
+
+  if (ino < 0) {
+    switch(want) {
+    case UZ_IFDIR:
+      ino = uz_mkdir(ipath,f,&sb,st->st_mode & 07777);
+      break;
+    case UZ_IFLNK:
+      len = readlink(hpath,target,UZ_BLOCKSZ);
+      if (len < 0) {
+	problem(hpath,strerror(errno));
+	return;
+      }
+      target[len] = 0;
+      ino = uz_mknod(ipath,f,&sb,UZ_IFLNK | (st->st_mode & 07777));
+      if (ino >= 0 &&
+	  (uz_inode_grow(f,&sb,ino,len)!=0 || uz_read_inode(f,&sb,ino,&x)!=0 ||
+	   uz_write_data(f,&x,0,len,target)!=len))
+	nospace(ipath);
+      break;
+    default:
+      ino = uz_mknod(ipath,f,&sb,want | (st->st_mode & 07777));
+      if (ino >= 0 && want == UZ_IFREG &&
+	  write_data(hpath,ipath,ino,st->st_size)!=0) {
+	problem(hpath,"can't read, left empty.");
+	uz_inode_truncate(f,&sb,ino,0);
+      }
+    }
+    if (ino < 0) {
+      if (sb.s_tinode == 0 || sb.s_tfree == 0) nospace(ipath);
+      problem(ipath,"can't create, skipped.");
+      return;
+    }
+    report('+',ipath);
+    ++nadded;
+  } else if (want == UZ_IFREG && !same_file(&x,st)) {
+    if (write_data(hpath,ipath,ino,st->st_size)!=0) {
+      problem(hpath,"can't read, left as it was.");
+      return;
+    }
+    report('~',ipath);
+    ++nupdated;
+  } else if (want != UZ_IFDIR) {
+    if (same_attrs(&x,st)) ++nsame;
+    else {
+      report('~',ipath);
+      ++nupdated;
+    }
+  }
+
+  if (want == UZ_IFDIR) sync_dir(hpath,ipath,ino);
+  set_attrs(ino,st);
+}
+
+/* image entries the host doesn't have go first, then every host
+   entry is brought over */
+void sync_dir(char *hpath, char *ipath, int dino) {
+  uz_dir d;
+  uz_direntry ent;
+  struct stat st;
+  struct dirent *e;
+  DIR *hd;
+  char name[UZ_DIRNAMELEN+1], hkid[1024], ikid[512], **gone = 0;
+  int i, ngone = 0;
+
+  if (uz_iopendir(dino,f,&sb,&d)!=0) {
+    problem(ipath,"can't read directory, skipped.");
+    return;
+  }
+  while(uz_readdir(&d,&ent)==0) {
+    memset(name,0,sizeof(name));
+    memcpy(name,ent.d_name,UZ_DIRNAMELEN);
+    if (!strcmp(name,".") || !strcmp(name,"..")) continue;
+    if (join(hkid,sizeof(hkid),hpath,name)!=0) continue;
+    if (lstat(hkid,&st)==0) continue;
+    gone = (char **) realloc(gone,(ngone+1) * sizeof(char *));
+    if (!gone) {
+      fprintf(stderr,"uzixfssync: out of memory\n");
+      exit(2);
+    }
+    gone[ngone++] = strdup(name);
+  }
+  uz_closedir(&d);
+
+  for(i=0;i<ngone;i++) {
+    if (join(ikid,sizeof(ikid),ipath,gone[i])!=0 || remove_entry(ikid)!=0)
+      problem(ikid,"can't remove.");
+    else {
+      report('-',ikid);
+      ++nremoved;
+    }
+    free(gone[i]);
+  }
+  free(gone);
+
+  hd = opendir(hpath);
+  if (!hd) {
+    problem(hpath,strerror(errno));
+    return;
+  }
+  while((e = readdir(hd))!=0) {
+    if (!strcmp(e->d_name,".") || !strcmp(e->d_name,"..")) continue;
+    if (strlen(e->d_name) > UZ_DIRNAMELEN) {
+      problem(e->d_name,"name too long for UZIX, skipped.");
+      continue;
+    }
+    if (join(hkid,sizeof(hkid),hpath,e->d_name)!=0 ||
+	join(ikid,sizeof(ikid),ipath,e->d_name)!=0) {
+      problem(e->d_name,"path too long, skipped.");
+      continue;
+    }
+    if (lstat(hkid,&st)!=0) {
+      problem(hkid,strerror(errno));
+      continue;
+    }
+    sync_entry(hkid,ikid,&st);
+  }
+  closedir(hd);
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfssync [-n] [-l] [-u undolog] hostdir image.dsk [directory]\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  char *host = 0, *image = 0, *dir = "/", *undolog = 0, *arg[3];
+  struct stat st;
+  uz_stat ust;
+  int i, n = 0, ino;
+
+  uz_global_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-n")) { dryrun = 1; continue; }
+    if (!strcmp(argv[i],"-l")) { verbose = 1; continue; }
+    if (!strcmp(argv[i],"-u") && i < argc-1) { undolog = argv[++i]; continue; }
+    if (argv[i][0] == '-' || n == 3) usage();
+    arg[n++] = argv[i];
+  }
+  if (n < 2) usage();
+  host  = arg[0];
+  image = arg[1];
+  if (n == 3) dir = arg[2];
+  if (undolog && !dryrun && uz_recover(image,undolog)!=0) return 2;
+
+  if (stat(host,&st)!=0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr,"%s: not a directory.\n",host);
+    return 4;
+  }
+
+  f = fopen(image,dryrun ? "r" : "r+");
+  if (!f) {
+    fprintf(stderr,"unable to open %s.\n",image);
+    return 2;
+  }
+  if (uz_read_sblock(f,&sb)!=0 || sb.s_mounted != UZ_SBSIG) {
+    fprintf(stderr,"%s: bad superblock.\n",image);
+    return 2;
+  }
+
+  ino = uz_lookup(dir,f,&sb);
+  if (ino < 0 || uz_istat(ino,f,&sb,&ust)!=0 ||
+      (ust.st_mode & UZ_IFMT) != UZ_IFDIR) {
+    fprintf(stderr,"%s: no such directory on given image.\n",dir);
+    return 4;
+  }
+
+  /* all changes are kept in memory and written once at the end; a
+     dry run just drops them */
+  if (uz_begin(f,&sb)!=0) {
+    fprintf(stderr,"uzixfssync: out of memory\n");
+    return 2;
+  }
+  sync_dir(host,dir,ino);
+
+  if (dryrun)
+    uz_abort(f);
+  else if (uz_write_sblock(f,&sb)!=0 || uz_commit(f,undolog)!=0) {
+    fprintf(stderr,"%s: error writing image.\n",image);
+    return 2;
+  }
+
+  printf("%s: %d added, %d updated, %d removed, %d unchanged%s\n",
+	 image,nadded,nupdated,nremoved,nsame,dryrun ? " (dry run)" : "");
+
+  fclose(f);
+  return nerrors ? 3 : 0;
+}
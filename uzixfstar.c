@@ -0,0 +1,681 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+#include "byteorder.h"
+
+#define RUN    128   /* blocks read from the image at once */
+#define RECORD 10240 /* tar output is padded to whole records */
+
+FILE      *f, *out;
+uz_sblock  sb;
+char     **first;    /* first path of each hard linked inode */
+uint8_t   *walked;   /* directories already in the archive */
+int        ninodes, nerrors;
+long       written;
+
+uz_blkno_t map[UZ_MAXBLOCKS];
+uint8_t    buf[RUN * UZ_BLOCKSZ];
+
+int put(void *data, long len) {
+  if (fwrite(data,1,len,out)!=len) {
+    fprintf(stderr,"uzixfstar: error writing archive.\n");
+    exit(5);
+  }
+  written += len;
+  return 0;
+}
+
+void pad(void) {
+  static uint8_t zero[UZ_BLOCKSZ];
+  if (written % UZ_BLOCKSZ)
+    put(zero,UZ_BLOCKSZ - written % UZ_BLOCKSZ);
+}
+
+/* one ustar header. long paths are split between prefix and name */
+int header(char *path, uz_inode *x, char type, long size, char *link) {
+  uint8_t h[UZ_BLOCKSZ];
+  unsigned sum;
+  int i, len, dev;
+
+  memset(h,0,sizeof(h));
+
+  len = strlen(path);
+  if (len <= 100)
+    memcpy(h,path,len);
+  else {
+    for(i=len-101;i<len && path[i] != '/';i++) ;
+    if (i >= len - 1 || i > 155) return -1;
+    memcpy(h,path+i+1,len-i-1);
+    memcpy(h+345,path,i);
+  }
+  if (link && strlen(link) > 100) return -1;
+
+  dev = x->i_addr[0];
+  sprintf((char *)h+100,"%07o",x->i_mode & 07777);
+  sprintf((char *)h+108,"%07o",x->i_uid);
+  sprintf((char *)h+116,"%07o",x->i_gid);
+  sprintf((char *)h+124,"%011lo",(unsigned long) size);
+  sprintf((char *)h+136,"%011lo",(unsigned long) uz_time_to_unix(&x->i_mtime));
+  h[156] = type;
+  if (link) strncpy((char *)h+157,link,100);
+  memcpy(h+257,"ustar",6);
+  memcpy(h+263,"00",2);
+  if (type == '3' || type == '4') {
+    sprintf((char *)h+329,"%07o",(dev >> 8) & 0xff);
+    sprintf((char *)h+337,"%07o",dev & 0xff);
+  }
+
+  memset(h+148,' ',8);
+  for(sum=0,i=0;i<UZ_BLOCKSZ;i++) sum += h[i];
+  sprintf((char *)h+148,"%06o",sum);
+
+  return(put(h,UZ_BLOCKSZ));
+}
+
+/* the contents of a file, read in runs of adjacent blocks. a file
+   that can't be read is still padded to its size, so that the archive
+   stays readable */
+void data(char *path, uz_inode *x) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  long left;
+  int r, k, n, ni, bad = 0;
+
+  n = uz_inode_map(f,&sb,x,map,idx,&ni);
+  if (n < 0) { n = uz_fit_bytes(x->i_size); bad = 1; }
+  left = x->i_size;
+
+  for(r=0;r<n;r+=k) {
+    if (bad || map[r] == 0) {
+      k = 1;
+      memset(buf,0,UZ_BLOCKSZ);
+    } else {
+      for(k=1;r+k<n && k<RUN && map[r+k] == map[r]+k;k++) ;
+      if (uz_read_blocks(f,map[r],k,buf)!=0) {
+	memset(buf,0,k * UZ_BLOCKSZ);
+	bad = 1;
+      }
+    }
+    put(buf,left < k * UZ_BLOCKSZ ? left : k * UZ_BLOCKSZ);
+    left -= k * UZ_BLOCKSZ;
+  }
+  pad();
+
+  if (bad) {
+    fprintf(stderr,"%s: can't read data, zeroed in the archive.\n",path);
+    ++nerrors;
+  }
+}
+
+void entry(char *path, uz_ino_t ino) {
+  uz_inode x;
+  char lname[101], type;
+  int fmt, len;
+
+  if (ino >= ninodes || uz_read_inode(f,&sb,ino,&x)!=0) {
+    fprintf(stderr,"%s: bad inode, skipped.\n",path);
+    ++nerrors;
+    return;
+  }
+
+  fmt = x.i_mode & UZ_IFMT;
+
+  if (fmt != UZ_IFDIR && first[ino]) {
+    if (header(path,&x,'1',0,first[ino])!=0) goto toolong;
+    return;
+  }
+
+  switch(fmt) {
+  case UZ_IFDIR:  type = '5'; break;
+  case UZ_IFLNK:  type = '2'; break;
+  case UZ_IFCHR:  type = '3'; break;
+  case UZ_IFBLK:  type = '4'; break;
+  case UZ_IFPIPE: type = '6'; break;
+  default:        type = '0';
+  }
+
+  if (type == '2') {
+    len = x.i_size > 100 ? 100 : x.i_size;
+    memset(lname,0,sizeof(lname));
+    if (len < 0 || uz_read_data(f,&x,0,len,lname)!=len) {
+      fprintf(stderr,"%s: can't read link, skipped.\n",path);
+      ++nerrors;
+      return;
+    }
+    if (header(path,&x,type,0,lname)!=0) goto toolong;
+  } else if (type == '0') {
+    if (x.i_size < 0 || x.i_size > UZ_MAXBLOCKS * UZ_BLOCKSZ) {
+      fprintf(stderr,"%s: bad size, skipped.\n",path);
+      ++nerrors;
+      return;
+    }
+    if (header(path,&x,type,x.i_size,0)!=0) goto toolong;
+    data(path,&x);
+  } else if (header(path,&x,type,0,0)!=0)
+    goto toolong;
+
+  if (x.i_nlink > 1 && fmt != UZ_IFDIR)
+    first[ino] = strdup(path);
+  return;
+
+ toolong:
+  fprintf(stderr,"%s: name too long for tar, skipped.\n",path);
+  ++nerrors;
+}
+
+/* path has no leading slash; it is empty for the root */
+void walk(char *path, uz_ino_t dino) {
+  uz_dir d;
+  uz_direntry ent;
+  uz_inode x;
+  char name[UZ_DIRNAMELEN+1], npath[512];
+  uz_ino_t ino;
+
+  walked[dino] = 1;
+  if (uz_iopendir(dino,f,&sb,&d)!=0) {
+    fprintf(stderr,"%s/: can't read directory, skipped.\n",path);
+    ++nerrors;
+    return;
+  }
+
+  while(uz_readdir(&d,&ent)==0) {
+    memset(name,0,sizeof(name));
+    memcpy(name,ent.d_name,UZ_DIRNAMELEN);
+    if (!strcmp(name,".") || !strcmp(name,"..")) continue;
+
+    if (strlen(path) + strlen(name) + 2 > sizeof(npath)) {
+      fprintf(stderr,"%s/%s: path too long, skipped.\n",path,name);
+      ++nerrors;
+      continue;
+    }
+    strcpy(npath,path);
+    if (path[0]) strcat(npath,"/");
+    strcat(npath,name);
+
+    ino = u16_to_le(ent.d_ino);
+    if (ino <= UZ_ROOT || ino >= ninodes || uz_read_inode(f,&sb,ino,&x)!=0) {
+      fprintf(stderr,"%s: bad entry, skipped.\n",npath);
+      ++nerrors;
+      continue;
+    }
+
+    if ((x.i_mode & UZ_IFMT) == UZ_IFDIR) {
+      /* a second name of a directory, or a loop back to an ancestor */
+      if (walked[ino]) {
+	fprintf(stderr,"%s/: directory already archived, skipped.\n",npath);
+	++nerrors;
+	continue;
+      }
+      strcat(npath,"/");
+      entry(npath,ino);
+      npath[strlen(npath)-1] = 0;
+      walk(npath,ino);
+    } else
+      entry(npath,ino);
+  }
+
+  uz_closedir(&d);
+}
+
+char **names; /* for cmp_name */
+
+int cmp_name(const void *a, const void *b) {
+  return(strcmp(names[*(int *) a],names[*(int *) b]));
+}
+
+/* only what changed after since, under top: one scan of the inode
+   table finds it and one directory walk names it */
+int newer(char *top, long since) {
+  uint8_t *hit;
+  int *list;
+  char name[512];
+  uz_inode x;
+  int i, n, len;
+
+  hit   = (uint8_t *) malloc(ninodes);
+  names = (char **) malloc(ninodes * sizeof(char *));
+  list  = (int *) malloc(ninodes * sizeof(int));
+  if (!hit || !names || !list) return -1;
+
+  if (uz_scan_newer(f,&sb,since,hit) < 0 || uz_inode_paths(f,&sb,hit,names) < 0)
+    return -1;
+
+  /* sorted by name, directories come before their entries */
+  len = strlen(top);
+  for(i=UZ_ROOT+1,n=0;i<ninodes;i++)
+    if (names[i] && !strncmp(names[i]+1,top,len) &&
+	(!len || names[i][len+1] == '/' || names[i][len+1] == 0))
+      list[n++] = i;
+  qsort(list,n,sizeof(int),cmp_name);
+
+  for(i=0;i<n;i++) {
+    if (strlen(names[list[i]]) + 1 > sizeof(name) ||
+	uz_read_inode(f,&sb,list[i],&x)!=0) continue;
+    strcpy(name,names[list[i]]+1);
+    if ((x.i_mode & UZ_IFMT) == UZ_IFDIR) strcat(name,"/");
+    entry(name,list[i]);
+  }
+  return 0;
+}
+
+/* image -> archive on stdout, everything or what changed after since
+   (since < 0) */
+int export(char *image, char *start, long since) {
+  char path[512];
+  uz_inode x;
+  int ino;
+
+  out = stdout;
+  ino = uz_lookup(start,f,&sb);
+  if (ino < 0) {
+    fprintf(stderr,"%s: not found on given image.\n",start);
+    return 4;
+  }
+
+  /* names in the archive are relative to the root */
+  while(*start == '/') ++start;
+  if (strlen(start) + 2 > sizeof(path)) {
+    fprintf(stderr,"%s: path too long.\n",start);
+    return 4;
+  }
+  strcpy(path,start);
+  while(path[0] && path[strlen(path)-1] == '/') path[strlen(path)-1] = 0;
+
+  if (uz_read_inode(f,&sb,ino,&x)!=0) {
+    fprintf(stderr,"%s: error reading image.\n",image);
+    return 2;
+  }
+  if (since >= 0) {
+    if (newer(path,since)!=0) {
+      fprintf(stderr,"%s: error reading image.\n",image);
+      return 2;
+    }
+  } else if ((x.i_mode & UZ_IFMT) != UZ_IFDIR)
+    entry(path,ino);
+  else if (path[0]) {
+    entry(strcat(path,"/"),ino);
+    path[strlen(path)-1] = 0;
+    walk(path,ino);
+  } else
+    walk(path,ino);
+
+  /* two zero blocks end the archive */
+  memset(buf,0,2 * UZ_BLOCKSZ);
+  put(buf,2 * UZ_BLOCKSZ);
+  memset(buf,0,RECORD > sizeof(buf) ? sizeof(buf) : RECORD);
+  if (written % RECORD) put(buf,RECORD - written % RECORD);
+  if (fflush(out)!=0) {
+    fprintf(stderr,"uzixfstar: error writing archive.\n");
+    return 5;
+  }
+
+  return nerrors ? 3 : 0;
+}
+
+/* tar headers are read from here on -x */
+FILE      *in;
+char       longname[512], longlink[512];
+uz_time_t *dtime;    /* archived mtimes of directories, set at the end */
+uint8_t   *dset;
+int        nfiles, ndirs, nlinks;
+
+long octal(uint8_t *p, int len) {
+  long v = 0;
+  while(len && (*p == ' ' || *p == 0)) { ++p; --len; }
+  for(;len && *p >= '0' && *p <= '7';p++,len--)
+    v = v * 8 + (*p - '0');
+  return v;
+}
+
+/* a field that may fill its whole length, without a 0 */
+void field(char *dest, uint8_t *p, int len) {
+  memcpy(dest,p,len);
+  dest[len] = 0;
+}
+
+void input(void *dest, long len) {
+  if (fread(dest,1,len,in)!=len) {
+    fprintf(stderr,"uzixfstar: archive truncated, image left untouched.\n");
+    exit(6);
+  }
+}
+
+void skip(long size) {
+  long n;
+  for(n=(size + UZ_BLOCKSZ - 1) / UZ_BLOCKSZ;n>0;n--) input(buf,UZ_BLOCKSZ);
+}
+
+void nospace(char *path) {
+  fprintf(stderr,"%s: out of %s, image left untouched.\n",
+	  path,sb.s_tinode ? "space" : "inodes");
+  exit(4);
+}
+
+/* the name of a header, prefix included */
+void tarname(uint8_t *h, char *dest) {
+  char name[101];
+
+  field(dest,h+345,155);
+  field(name,h,100);
+  if (dest[0]) strcat(dest,"/");
+  strcat(dest,name);
+}
+
+/* a name of the archive as a path of the image, under base */
+int archive_path(char *dest, char *base, char *p) {
+  while(p[0] == '.' && p[1] == '/') p += 2;
+  while(*p == '/') ++p;
+  if (strlen(base) + strlen(p) + 2 > 512) return -1;
+  strcpy(dest,base);
+  if (*p) {
+    strcat(dest,"/");
+    strcat(dest,p);
+  }
+  while(strlen(dest) > 1 && dest[strlen(dest)-1] == '/')
+    dest[strlen(dest)-1] = 0;
+  if (!dest[0]) strcpy(dest,"/");
+  return 0;
+}
+
+/* the directories leading to path, as mkdir -p would make them */
+int parents(char *path) {
+  char p[512];
+  int i, ino;
+
+  for(i=1;path[i];i++) {
+    if (path[i] != '/') continue;
+    memcpy(p,path,i);
+    p[i] = 0;
+    if (uz_lookup(p,f,&sb) >= 0) continue;
+    ino = uz_mkdir(p,f,&sb,0755);
+    if (ino < 0) {
+      if (sb.s_tinode == 0 || sb.s_tfree == 0) nospace(p);
+      return -1;
+    }
+    ++ndirs;
+  }
+  return 0;
+}
+
+/* a regular file of size bytes, its blocks allocated at once so they
+   come out of the free list as one run */
+int mkfile(char *path, uz_mode_t mode, long size) {
+  uz_blkno_t idx[UZ_MAXINDEX];
+  uz_inode x;
+  int ino, r, k, n, ni, i;
+
+  if (size > UZ_MAXBLOCKS * (long) UZ_BLOCKSZ) return -1;
+  ino = uz_mknod(path,f,&sb,UZ_IFREG | mode);
+  if (ino < 0) return -1;
+  if (size == 0) return ino;
+
+  if (uz_inode_grow(f,&sb,ino,size)!=0) nospace(path);
+  if (uz_read_inode(f,&sb,ino,&x)!=0) return -1;
+  n = uz_inode_map(f,&sb,&x,map,idx,&ni);
+  if (n != uz_fit_bytes(size)) return -1;
+
+  for(r=0;r<n;r+=k) {
+    k = n - r < RUN ? n - r : RUN;
+    input(buf,k * UZ_BLOCKSZ);
+    for(i=0;i<k;i++)
+      if (uz_write_raw_block(f,map[r+i],buf + i * UZ_BLOCKSZ)!=0) {
+	fprintf(stderr,"uzixfstar: out of memory\n");
+	exit(2);
+      }
+  }
+  return ino;
+}
+
+/* archive on stdin -> image, in one transaction */
+int import(char *image, char *base, char *undolog) {
+  uint8_t h[UZ_BLOCKSZ];
+  char name[512], path[512], target[512];
+  uz_inode x;
+  unsigned sum;
+  long size, data;
+  int i, ino, type, mode, eof = 0;
+
+  in = stdin;
+  while(*base == '/') ++base;
+  strcpy(path,"/");
+  strcat(path,base);
+  ino = uz_lookup(path,f,&sb);
+  if (ino < 0 || uz_read_inode(f,&sb,ino,&x)!=0 ||
+      (x.i_mode & UZ_IFMT) != UZ_IFDIR) {
+    fprintf(stderr,"%s: no such directory on given image.\n",path);
+    return 4;
+  }
+  base = strdup(strlen(path) > 1 ? path : "");
+
+  dtime = (uz_time_t *) calloc(ninodes,sizeof(uz_time_t));
+  dset  = (uint8_t *) calloc(ninodes,1);
+  if (!dtime || !dset || !base || uz_begin(f,&sb)!=0) {
+    fprintf(stderr,"uzixfstar: out of memory\n");
+    return 2;
+  }
+
+  while(fread(h,1,UZ_BLOCKSZ,in)==UZ_BLOCKSZ) {
+    for(i=0;i<UZ_BLOCKSZ && !h[i];i++) ;
+    if (i == UZ_BLOCKSZ) { eof = 1; break; }
+
+    for(sum=0,i=0;i<UZ_BLOCKSZ;i++) sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    if (sum != octal(h+148,8)) {
+      fprintf(stderr,"uzixfstar: bad tar header, image left untouched.\n");
+      return 6;
+    }
+
+    type = h[156];
+    size = octal(h+124,12);
+    mode = octal(h+100,8) & 07777;
+
+    /* GNU long names come as a data block before their header */
+    if (type == 'L' || type == 'K') {
+      char *lng = type == 'L' ? longname : longlink;
+      if (size > 0) {
+	input(lng,UZ_BLOCKSZ);
+	skip(size - UZ_BLOCKSZ);
+      }
+      lng[size > 0 && size < 511 ? size : 511] = 0;
+      continue;
+    }
+    if (type == 'x' || type == 'g') { skip(size); continue; }
+
+    data = (type == '0' || type == 0 || type == '7') ? size : 0;
+
+    if (longname[0]) strcpy(name,longname); else tarname(h,name);
+    longname[0] = 0;
+    if (archive_path(path,base,name)!=0) {
+      fprintf(stderr,"%s: name too long, skipped.\n",name);
+      goto skipentry;
+    }
+
+    if (parents(path)!=0) {
+      fprintf(stderr,"%s: can't make its directory, skipped.\n",path);
+      goto skipentry;
+    }
+
+    /* what the archive brings replaces what is there, but for
+       directories, which are kept */
+    ino = uz_lookup(path,f,&sb);
+    if (ino >= 0 && uz_read_inode(f,&sb,ino,&x)==0 &&
+	(x.i_mode & UZ_IFMT) == UZ_IFDIR) {
+      if (type != '5') {
+	fprintf(stderr,"%s: is a directory, skipped.\n",path);
+	goto skipentry;
+      }
+    } else if (ino >= 0 && uz_unlink(path,f,&sb)!=0) {
+      fprintf(stderr,"%s: can't replace, skipped.\n",path);
+      goto skipentry;
+    } else
+      ino = -1;
+
+    switch(type) {
+    case '5':
+      if (ino < 0) {
+	ino = uz_mkdir(path,f,&sb,mode);
+	if (ino >= 0) ++ndirs;
+      }
+      break;
+    case '1':
+      if (!longlink[0]) field(longlink,h+157,100);
+      if (archive_path(target,base,longlink)!=0 ||
+	  uz_link(target,path,f,&sb)!=0) {
+	fprintf(stderr,"%s: can't link, skipped.\n",path);
+	goto skipentry;
+      }
+      ++nlinks;
+      longlink[0] = 0;
+      continue;
+    case '2':
+      if (longlink[0]) strcpy(target,longlink); else field(target,h+157,100);
+      longlink[0] = 0;
+      ino = uz_mknod(path,f,&sb,UZ_IFLNK | mode);
+      if (ino >= 0 &&
+	  (uz_inode_grow(f,&sb,ino,strlen(target))!=0 ||
+	   uz_read_inode(f,&sb,ino,&x)!=0 ||
+	   uz_write_data(f,&x,0,strlen(target),target)!=strlen(target)))
+	nospace(path);
+      break;
+    case '3': case '4': case '6':
+      ino = uz_mknod(path,f,&sb,mode |
+		     (type == '3' ? UZ_IFCHR : type == '4' ? UZ_IFBLK : UZ_IFPIPE));
+      if (ino >= 0 && type != '6' && uz_read_inode(f,&sb,ino,&x)==0) {
+	x.i_addr[0] = (octal(h+329,8) & 0xff) << 8 | (octal(h+337,8) & 0xff);
+	uz_write_inode(f,&sb,ino,&x);
+      }
+      break;
+    case '0': case 0: case '7':
+      ino = mkfile(path,mode,size);
+      if (ino >= 0) { data = 0; ++nfiles; }
+      break;
+    default:
+      fprintf(stderr,"%s: unsupported entry type '%c', skipped.\n",path,type);
+      goto skipentry;
+    }
+
+    if (ino < 0) {
+      if (sb.s_tinode == 0 || sb.s_tfree == 0) nospace(path);
+      fprintf(stderr,"%s: can't create, skipped.\n",path);
+      goto skipentry;
+    }
+
+    if (uz_read_inode(f,&sb,ino,&x)==0) {
+      x.i_mode = (x.i_mode & UZ_IFMT) | mode;
+      x.i_uid  = octal(h+108,8);
+      x.i_gid  = octal(h+116,8);
+      uz_unix_to_time(octal(h+136,12),&x.i_mtime);
+      x.i_atime = x.i_ctime = x.i_mtime;
+      uz_write_inode(f,&sb,ino,&x);
+      if (type == '5') {
+	dtime[ino] = x.i_mtime;
+	dset[ino] = 1;
+      }
+    }
+    skip(data);
+    continue;
+
+  skipentry:
+    ++nerrors;
+    longname[0] = longlink[0] = 0;
+    skip(data);
+  }
+
+  if (!eof) {
+    fprintf(stderr,"uzixfstar: archive truncated, image left untouched.\n");
+    return 6;
+  }
+
+  /* directories were stamped as entries went in */
+  for(i=UZ_ROOT;i<ninodes;i++) {
+    if (!dset[i] || uz_read_inode(f,&sb,i,&x)!=0) continue;
+    x.i_mtime = dtime[i];
+    uz_write_inode(f,&sb,i,&x);
+  }
+
+  if (uz_write_sblock(f,&sb)!=0 || uz_commit(f,undolog)!=0) {
+    fprintf(stderr,"%s: error writing image.\n",image);
+    return 2;
+  }
+
+  printf("%s: %d files, %d directories, %d links added\n",
+	 image,nfiles,ndirs,nlinks);
+  return nerrors ? 3 : 0;
+}
+
+/* @seconds, or yyyy-mm-dd[Thh:mm[:ss]] in UTC */
+long parse_date(char *x) {
+  int Y, M, D, h = 0, m = 0, sec = 0, n;
+  uz_time_t t;
+  char c;
+
+  if (x[0] == '@') return(atol(x+1));
+  n = sscanf(x,"%d-%d-%d%c%d:%d:%d",&Y,&M,&D,&c,&h,&m,&sec);
+  if (n != 3 && n < 6) return -1;
+  if (Y < 1980 || Y > 2107 || M < 1 || M > 12 || D < 1 || D > 31 ||
+      h > 23 || m > 59 || sec > 59)
+    return -1;
+  uz_set_date(D,M,Y,&t);
+  uz_set_time(h,m,sec,&t);
+  return(uz_time_to_unix(&t) + (sec & 1));
+}
+
+void usage(void) {
+  fprintf(stderr,"usage: uzixfstar [--newer date] image.dsk [directory] > archive.tar\n");
+  fprintf(stderr,"       uzixfstar -x [-u undolog] image.dsk [directory] < archive.tar\n\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  char *image = 0, *dir = 0, *undolog = 0;
+  int i, ret, xflag = 0;
+  long since = -1;
+
+  uz_global_opt(argc, argv);
+
+  for(i=1;i<argc;i++) {
+    if (!strcmp(argv[i],"-x")) { xflag = 1; continue; }
+    if (!strcmp(argv[i],"-u") && i < argc-1) { undolog = argv[++i]; continue; }
+    if (!strcmp(argv[i],"--newer") && i < argc-1) {
+      if ((since = parse_date(argv[++i])) < 0) usage();
+      continue;
+    }
+    if (argv[i][0] == '-' || dir) usage();
+    if (!image) image = argv[i]; else dir = argv[i];
+  }
+  if (!image || (undolog && !xflag) || (since >= 0 && xflag)) usage();
+  if (undolog && uz_recover(image,undolog)!=0) return 2;
+
+  f = fopen(image,xflag ? "r+" : "r");
+  if (!f) {
+    fprintf(stderr,"cannot open %s\n\n",image);
+    return 2;
+  }
+
+  if (uz_read_sblock(f,&sb)!=0 || sb.s_mounted != UZ_SBSIG) {
+    fprintf(stderr,"%s: bad superblock.\n",image);
+    return 2;
+  }
+  ninodes = sb.s_isize * UZ_IPB;
+  first  = (char **) calloc(ninodes,sizeof(char *));
+  walked = (uint8_t *) calloc(ninodes,1);
+  if (!first || !walked) {
+    fprintf(stderr,"uzixfstar: out of memory\n");
+    return 2;
+  }
+
+  if (!dir) dir = "/";
+  ret = xflag ? import(image,dir,undolog) : export(image,dir,since);
+  fclose(f);
+  return ret;
+}
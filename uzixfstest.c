@@ -0,0 +1,189 @@
+/*
+   Uzix X-Utils (cross platform utilities)
+   (C) 2003 Felipe Bergo - bergo@seul.org
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License,
+   version 2 or (at your option) any later version. The license
+   is included in the COPYING file.
+*/
+
+/* checks of the undo logs of uz_commit, run by make check: commits
+   are cut short at chosen points and the image must come back as it
+   was, from the library and from the tools that take -u */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "uzixfs.h"
+#include "uzixdir.h"
+/* after uzixdir.h, see uzixfsextract.c */
+#include <sys/stat.h>
+
+#define IMAGE   "uzixfstest.dsk"
+#define UNDOLOG "uzixfstest.log"
+#define HOSTDIR "uzixfstest.d"
+#define ARCHIVE "uzixfstest.tar"
+#define FBLOCKS 4096
+
+uint8_t *orig, *now;
+int      failures, cut, seen;
+
+void check(int ok, char *what) {
+  printf("%s: %s\n",ok ? "ok  " : "FAIL",what);
+  if (!ok) ++failures;
+}
+
+int load(uint8_t *dest) {
+  FILE *f = fopen(IMAGE,"r");
+  int n;
+  if (!f) return -1;
+  n = fread(dest,1,FBLOCKS * UZ_BLOCKSZ,f);
+  fclose(f);
+  return n == FBLOCKS * UZ_BLOCKSZ ? 0 : -1;
+}
+
+int exists(char *path) {
+  return access(path,F_OK) == 0;
+}
+
+/* the image: a few directories and files with data in them */
+void build(void) {
+  uint8_t boot[UZ_BLOCKSZ], data[4096];
+  uz_sblock sb;
+  uz_inode x;
+  char path[32];
+  FILE *f;
+  int i, ino;
+
+  f = fopen(IMAGE,"w+");
+  memset(boot,0,sizeof(boot));
+  if (!f || uz_mkfs(f,&sb,FBLOCKS,32,0,boot)!=0) {
+    fprintf(stderr,"uzixfstest: cannot make %s\n",IMAGE);
+    exit(2);
+  }
+  for(i=0;i<sizeof(data);i++) data[i] = i * 7;
+  for(i=0;i<8;i++) {
+    sprintf(path,"/d%d",i);
+    uz_mkdir(path,f,&sb,0755);
+    sprintf(path,"/d%d/f",i);
+    ino = uz_mknod(path,f,&sb,UZ_IFREG | 0644);
+    if (ino < 0 || uz_inode_grow(f,&sb,ino,(i + 1) * sizeof(data))!=0 ||
+	uz_read_inode(f,&sb,ino,&x)!=0 ||
+	uz_write_data(f,&x,i * sizeof(data),sizeof(data),data) < 0) {
+      fprintf(stderr,"uzixfstest: cannot fill %s\n",IMAGE);
+      exit(2);
+    }
+  }
+  fclose(f);
+}
+
+/* stops the process at the cut-th block read (while the undo log is
+   being saved) or, with cut < 0, at the -cut-th block written */
+void stop(uint32_t offset, uint32_t length, int write) {
+  if (cut > 0 && !write && ++seen == cut)  _exit(0);
+  if (cut < 0 && write && ++seen == -cut) _exit(0);
+}
+
+/* a transaction adding /new with 64K of data, committed with an undo
+   log and cut short as above */
+void interrupted(int at) {
+  uint8_t data[UZ_BLOCKSZ];
+  uz_sblock sb;
+  uz_inode x;
+  FILE *f;
+  int i, ino, st;
+
+  if (fork() == 0) {
+    f = fopen(IMAGE,"r+");
+    if (!f) _exit(1);
+    setvbuf(f,0,_IONBF,0); /* what was written is on the image */
+    if (uz_read_sblock(f,&sb)!=0 || uz_begin(f,&sb)!=0) _exit(1);
+    ino = uz_mknod("/new",f,&sb,UZ_IFREG | 0644);
+    if (ino < 0 || uz_inode_grow(f,&sb,ino,64 * 1024)!=0 ||
+	uz_read_inode(f,&sb,ino,&x)!=0)
+      _exit(1);
+    memset(data,0xee,sizeof(data));
+    for(i=0;i<128;i++)
+      uz_write_data(f,&x,i * UZ_BLOCKSZ,UZ_BLOCKSZ,data);
+    cut = at;
+    seen = 0;
+    uz_io_hook = stop;
+    uz_commit(f,UNDOLOG);
+    _exit(1); /* not cut short */
+  }
+  wait(&st);
+}
+
+/* image and log as an interrupted run left them, then put back */
+void cutoff(char *what, int at, char *tool) {
+  char msg[128], cmd[128];
+  int k;
+
+  build();
+  load(orig);
+  remove(UNDOLOG);
+  interrupted(at);
+
+  sprintf(msg,"%s: undo log left behind",what);
+  check(exists(UNDOLOG),msg);
+  if (at < 0) {
+    load(now);
+    sprintf(msg,"%s: image partly written",what);
+    check(memcmp(orig,now,FBLOCKS * UZ_BLOCKSZ)!=0,msg);
+  }
+
+  if (!tool) {
+    k = uz_recover(IMAGE,UNDOLOG);
+    load(now);
+    sprintf(msg,"%s: uz_recover puts the image back",what);
+    check(k == 0 && !memcmp(orig,now,FBLOCKS * UZ_BLOCKSZ),msg);
+  } else {
+    sprintf(cmd,"%s >/dev/null 2>&1",tool);
+    k = system(cmd);
+    sprintf(msg,"%s: runs again",what);
+    check(k == 0,msg);
+    sprintf(msg,"%s: image is clean, without /new",what);
+    check(system("./uzixfsck " IMAGE " >/dev/null 2>&1") == 0 &&
+	  system("./uzixfscat " IMAGE " /new >/dev/null 2>&1") != 0,msg);
+  }
+  sprintf(msg,"%s: undo log removed",what);
+  check(!exists(UNDOLOG),msg);
+}
+
+int main(int argc, char **argv) {
+  FILE *f;
+
+  uz_global_opt(argc, argv);
+
+  orig = (uint8_t *) malloc(FBLOCKS * UZ_BLOCKSZ);
+  now  = (uint8_t *) malloc(FBLOCKS * UZ_BLOCKSZ);
+  if (!orig || !now) {
+    fprintf(stderr,"uzixfstest: out of memory\n");
+    return 2;
+  }
+
+  cutoff("cut while saving the log",3,0);
+  cutoff("cut while writing",-5,0);
+  cutoff("uzixfsdefrag",-5,"./uzixfsdefrag -u " UNDOLOG " " IMAGE);
+  cutoff("uzixfsresize",-5,"./uzixfsresize -f 2500K -u " UNDOLOG " " IMAGE);
+  /* an empty archive and an empty directory: what matters is that
+     the tool gets to run */
+  memset(now,0,10240);
+  if ((f = fopen(ARCHIVE,"w"))!=0) {
+    fwrite(now,1,10240,f);
+    fclose(f);
+  }
+  cutoff("uzixfstar -x",-5,"./uzixfstar -x -u " UNDOLOG " " IMAGE " < " ARCHIVE);
+  mkdir(HOSTDIR,0755);
+  cutoff("uzixfssync",-5,"./uzixfssync -u " UNDOLOG " " HOSTDIR " " IMAGE " /d0");
+
+  remove(ARCHIVE);
+  rmdir(HOSTDIR);
+  remove(IMAGE);
+  remove(UNDOLOG);
+  printf("%d failure(s)\n",failures);
+  return failures ? 1 : 0;
+}